@@ -19,6 +19,8 @@ if { $osplatform eq "windows" } {
 package ifneeded sha ${shaver} \
     [list load [file join $dir ${osname}${osbits} \
     sha[info sharedlibextension]]]
+package ifneeded sha256 ${shaver} \
+    "package require sha ${shaver}; package provide sha256 ${shaver}"
 
 unset -nocomplain osbits
 unset -nocomplain osplatform
@@ -9,9 +9,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
 #include <memory.h>
 #include <sys/stat.h>
 #include <string.h>
+#if ! defined(COMP_WINDOWS) && ! defined(_WIN32)
+# define SHA_USE_MMAP 1
+# include <fcntl.h>
+# include <setjmp.h>
+# include <signal.h>
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
 
 #define SHA_DEBUG 0
 
@@ -30,36 +39,101 @@
     | (((x) & 0x000000000000ff00ull) << 40) \
     | (((x) & 0x00000000000000ffull) << 56))
 
+#define SHA_VARIANT 1
 #include "sha.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+# if BASEHASHSIZE == 256 || BASEHASHSIZE == 512
+#  define SHA_HAVE_MB 1
+# endif
+# if BASEHASHSIZE == 256 || BASEHASHSIZE == 1
+#  define SHA_HAVE_SHANI 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+# endif
+#endif
+
 #define IS_BIG_ENDIAN (!*(unsigned char*)(void*)&(uint16_t){1})
-#define LASTSIZE (sizeof(uint64_t)*(BASEHASHSIZE/256))
+#define LASTSIZE (sizeof(uint64_t)*(CHARSINCHUNK/64))
+
+/* big endian loads; compilers turn these into a load and a byte swap */
+#define LOAD32(p) \
+    ( ((uint32_t) (p)[0] << 24) \
+    | ((uint32_t) (p)[1] << 16) \
+    | ((uint32_t) (p)[2] <<  8) \
+    | ((uint32_t) (p)[3]) )
+#define LOAD64(p) \
+    ( ((uint64_t) LOAD32 (p) << 32) | (uint64_t) LOAD32 ((p) + 4) )
+/* keccak lanes are little endian */
+#define LOADLE64(p) \
+    ( (uint64_t) (p)[0]         | ((uint64_t) (p)[1] << 8) \
+    | ((uint64_t) (p)[2] << 16) | ((uint64_t) (p)[3] << 24) \
+    | ((uint64_t) (p)[4] << 32) | ((uint64_t) (p)[5] << 40) \
+    | ((uint64_t) (p)[6] << 48) | ((uint64_t) (p)[7] << 56) )
 
 #define RR(a,b,c) (((a) >> (b)) | ((a) << ((c)-(b))))
 #define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
 #define MAJ(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
 
-typedef struct {
-  size_t      flen;     /* actual length        */
-  size_t      aflen;    /* adjusted length      */
-  size_t      foffset;  /* actual offset        */
-  size_t      blen;     /* length of buffer     */
-  size_t      boffset;  /* offset into buffer   */
-  buff_t      *buf;
-  buff_t      *chunk;
-} shainfo_t;
+/* sha-3 keeps the 25 lane keccak state and absorbs rate byte chunks */
+#if BASEHASHSIZE == 3
+# define SHA_STATEWORDS 25
+# define SHA_BSIZE(ctx) ((ctx)->bsize)
+#else
+# define SHA_STATEWORDS SHA_VALSINHASH
+# define SHA_BSIZE(ctx) CHARSINCHUNK
+#endif
+
+/*
+ * A context keeps the compression function that was selected when it
+ * was set up, so a backend switch never lands in the middle of a hash.
+ */
+#if BASEHASHSIZE == 3
+typedef void (*shacompress_t) (hash_t *sha_h, const buff_t *chunk, size_t nblocks,
+    size_t rate);
+# define SHACOMPRESS(ctx,chunk,n) \
+    (ctx)->compress ((ctx)->sha_h, chunk, n, (ctx)->bsize)
+# define SHACOMPRESS1(fn,h,chunk,rate) (fn) (h, chunk, 1, rate)
+#else
+typedef void (*shacompress_t) (hash_t *sha_h, const buff_t *chunk, size_t nblocks);
+# define SHACOMPRESS(ctx,chunk,n) (ctx)->compress ((ctx)->sha_h, chunk, n)
+# define SHACOMPRESS1(fn,h,chunk,rate) (fn) (h, chunk, 1)
+#endif
+
+struct shactx {
+  const shafamily_t *fam;             /* must be first, see shadisp.c */
+  hash_t      sha_h [SHA_STATEWORDS];
+  buff_t      chunk [CHARSINCHUNK];   /* partial chunk                */
+  size_t      clen;                   /* bytes held in chunk          */
+  uint64_t    mlen;                   /* message length in bytes      */
+  const hash_t *init;                 /* initial hash values          */
+  size_t      dlen;                   /* digest length in bytes       */
+  shacompress_t compress;             /* backend in use               */
+#if BASEHASHSIZE == 3
+  size_t      bsize;                  /* rate in bytes                */
+  buff_t      pad;                    /* domain and first pad bits    */
+#endif
+};
+
+struct hmacctx {
+  shactx_t    ictx;                   /* inner hash in progress       */
+  shactx_t    ipad;                   /* inner state after the key    */
+  shactx_t    opad;                   /* outer state after the key    */
+};
 
 #if BASEHASHSIZE == 512
 
 # define SHAFMT "%016llx"
 # define bs bs64    /* the bs macro is for use on hash_t */
+# define LOADBE LOAD64
 
 # define SIG0(x) (RR(x,1,64) ^ RR(x,8,64) ^ ((x) >> 7))
 # define SIG1(x) (RR(x,19,64) ^ RR(x,61,64) ^ ((x) >> 6))
 # define EP0(x) (RR(x,28,64) ^ RR(x,34,64) ^ RR(x,39,64))
 # define EP1(x) (RR(x,14,64) ^ RR(x,18,64) ^ RR(x,41,64))
 
-  static hash_t sha_h512_init[] = {
+  static const hash_t sha_h512_init[] = {
     0x6a09e667f3bcc908,
     0xbb67ae8584caa73b,
     0x3c6ef372fe94f82b,
@@ -69,7 +143,7 @@ typedef struct {
     0x1f83d9abfb41bd6b,
     0x5be0cd19137e2179
   };
-  static hash_t sha_h384_init[] = {
+  static const hash_t sha_h384_init[] = {
     0xcbbb9d5dc1059ed8,
     0x629a292a367cd507,
     0x9159015a3070dd17,
@@ -80,7 +154,7 @@ typedef struct {
     0x47b5481dbefa4fa4
   };
 
-  static hash_t sha_h512_224_init[] = {
+  static const hash_t sha_h512_224_init[] = {
     0x8c3d37c819544da2,
     0x73e1996689dcd4d6,
     0x1dfab7ae32ff9c82,
@@ -91,7 +165,7 @@ typedef struct {
     0x1112e6ad91d692a1
   };
 
-  static hash_t sha_h512_256_init[] = {
+  static const hash_t sha_h512_256_init[] = {
     0x22312194fc2bf72c,
     0x9f555fa3c84c64c2,
     0x2393b86b6f53b151,
@@ -190,13 +264,14 @@ typedef struct {
 
 # define SHAFMT "%08x"
 # define bs bs32   /* the bs macro is for use on hash_t */
+# define LOADBE LOAD32
 
 # define SIG0(x) (RR(x,7,32) ^ RR(x,18,32) ^ ((x) >> 3))
 # define SIG1(x) (RR(x,17,32) ^ RR(x,19,32) ^ ((x) >> 10))
 # define EP0(x) (RR(x,2,32) ^ RR(x,13,32) ^ RR(x,22,32))
 # define EP1(x) (RR(x,6,32) ^ RR(x,11,32) ^ RR(x,25,32))
 
-  static hash_t sha_h256_init[] = {
+  static const hash_t sha_h256_init[] = {
     0x6a09e667,
     0xbb67ae85,
     0x3c6ef372,
@@ -206,7 +281,7 @@ typedef struct {
     0x1f83d9ab,
     0x5be0cd19
   };
-  static hash_t sha_h224_init[] = {
+  static const hash_t sha_h224_init[] = {
     0xc1059ed8,
     0x367cd507,
     0x3070dd17,
@@ -284,6 +359,58 @@ typedef struct {
     0xc67178f2
   };
 #endif
+
+#if BASEHASHSIZE == 1
+
+# define SHAFMT "%08x"
+# define bs bs32   /* the bs macro is for use on hash_t */
+# define LOADBE LOAD32
+
+  /* the state array has room for eight words; sha-1 uses five */
+  static const hash_t sha_h1_init[] = {
+    0x67452301,
+    0xefcdab89,
+    0x98badcfe,
+    0x10325476,
+    0xc3d2e1f0,
+    0,
+    0,
+    0
+  };
+#endif
+
+#if BASEHASHSIZE == 3
+
+  /* the sponge starts from an all zero state */
+  static const hash_t sha_h3_init[SHA_STATEWORDS] = { 0 };
+
+  static const hash_t keccak_rc[] = {
+    0x0000000000000001,
+    0x0000000000008082,
+    0x800000000000808a,
+    0x8000000080008000,
+    0x000000000000808b,
+    0x0000000080000001,
+    0x8000000080008081,
+    0x8000000000008009,
+    0x000000000000008a,
+    0x0000000000000088,
+    0x0000000080008009,
+    0x000000008000000a,
+    0x000000008000808b,
+    0x800000000000008b,
+    0x8000000000008089,
+    0x8000000000008003,
+    0x8000000000008002,
+    0x8000000000000080,
+    0x000000000000800a,
+    0x800000008000000a,
+    0x8000000080008081,
+    0x8000000000008080,
+    0x0000000080000001,
+    0x8000000080008008
+  };
+#endif
 #define MAXLOOP (sizeof(sha_k)/sizeof(hash_t))
 
 #if SHA_DEBUG
@@ -308,158 +435,202 @@ dump (char *msg, buff_t *buf, size_t len)
 
 #endif
 
+static void shareset (shactx_t *ctx);
 
-static inline int
-fillChunk (shainfo_t *shainfo, buff_t *predata)
+static void
+shainit (shactx_t *ctx, const shaalgo_t *algo)
 {
-  size_t        copylen = CHARSINCHUNK;
-  size_t        coffset;
-  int           last = 0;
-  uint64_t      nlen;
-  long          left;
+  ctx->fam = &SHA_NAME(family);
+  ctx->init = (const hash_t *) algo->iv;
+  ctx->dlen = algo->dlen;
+#if BASEHASHSIZE == 3
+  ctx->bsize = algo->blocksize;
+  ctx->pad = algo->xof ? 0x1f : 0x06;
+#endif
+  shareset (ctx);
+}
+
+/* the new e is kept in d and the new a in h; the callers rotate names */
+#define RND(a,b,c,d,e,f,g,h,k,x) \
+    t1 = (h) + EP1(e) + CH(e,f,g) + (k) + (x); \
+    (d) += t1; \
+    (h) = t1 + EP0(a) + MAJ(a,b,c);
+#define RND16(i,X) \
+    RND(a,b,c,d,e,f,g,h,sha_k[(i)+0],X(0)) \
+    RND(h,a,b,c,d,e,f,g,sha_k[(i)+1],X(1)) \
+    RND(g,h,a,b,c,d,e,f,sha_k[(i)+2],X(2)) \
+    RND(f,g,h,a,b,c,d,e,sha_k[(i)+3],X(3)) \
+    RND(e,f,g,h,a,b,c,d,sha_k[(i)+4],X(4)) \
+    RND(d,e,f,g,h,a,b,c,sha_k[(i)+5],X(5)) \
+    RND(c,d,e,f,g,h,a,b,sha_k[(i)+6],X(6)) \
+    RND(b,c,d,e,f,g,h,a,sha_k[(i)+7],X(7)) \
+    RND(a,b,c,d,e,f,g,h,sha_k[(i)+8],X(8)) \
+    RND(h,a,b,c,d,e,f,g,sha_k[(i)+9],X(9)) \
+    RND(g,h,a,b,c,d,e,f,sha_k[(i)+10],X(10)) \
+    RND(f,g,h,a,b,c,d,e,sha_k[(i)+11],X(11)) \
+    RND(e,f,g,h,a,b,c,d,sha_k[(i)+12],X(12)) \
+    RND(d,e,f,g,h,a,b,c,sha_k[(i)+13],X(13)) \
+    RND(c,d,e,f,g,h,a,b,sha_k[(i)+14],X(14)) \
+    RND(b,c,d,e,f,g,h,a,sha_k[(i)+15],X(15))
+#define WSCHED(j) \
+    (w[j] += SIG1(w[((j)+14)&15]) + w[((j)+9)&15] + SIG0(w[((j)+1)&15]))
+
+/*
+ * Compresses nblocks consecutive chunks.  The words are loaded big
+ * endian straight from the caller's buffer; no alignment is needed.
+ *
+ * SHA_PORTABLE selects the plain loop; the default is the unrolled
+ * version below, which keeps the schedule in a rolling 16 word window.
+ */
+#if BASEHASHSIZE == 1
 
+# define RL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+# define PARITY(x,y,z) ((x) ^ (y) ^ (z))
+/* the first 16 words come from the chunk, the rest from a 16 word window */
+# define S1W(j) ((j) < 16 ? \
+    (w[(j)&15] = LOADBE (chunk + ((j)&15) * sizeof (hash_t))) : \
+    (w[(j)&15] = RL(w[((j)+13)&15] ^ w[((j)+8)&15] ^ \
+        w[((j)+2)&15] ^ w[(j)&15], 1)))
+/* the new a is kept in e and b is rotated in place; the callers rotate names */
+# define S1RND(a,b,c,d,e,F,k,j) \
+    (e) += RL(a,5) + F(b,c,d) + (k) + S1W(j); \
+    (b) = RL(b,30);
+# define S1RND5(F,k,j) \
+    S1RND(a,b,c,d,e,F,k,(j)+0) \
+    S1RND(e,a,b,c,d,F,k,(j)+1) \
+    S1RND(d,e,a,b,c,F,k,(j)+2) \
+    S1RND(c,d,e,a,b,F,k,(j)+3) \
+    S1RND(b,c,d,e,a,F,k,(j)+4)
+# define S1RND20(F,k,j) \
+    S1RND5(F,k,(j)+0) S1RND5(F,k,(j)+5) S1RND5(F,k,(j)+10) S1RND5(F,k,(j)+15)
+
+static void
+shablocks (hash_t *sha_h, const buff_t *chunk, size_t nblocks)
+{
+  hash_t      w [VALSINCHUNK];
+  hash_t      a, b, c, d, e;
 
-  if (predata != NULL) {
-    memcpy (shainfo->chunk, predata, CHARSINCHUNK);
+  for ( ; nblocks > 0; --nblocks, chunk += CHARSINCHUNK) {
 #if SHA_DEBUG
-    dump ("fc:predata", shainfo->chunk, CHARSINCHUNK);
+    dump ("chunk", (buff_t *) chunk, CHARSINCHUNK);
 #endif
-    shainfo->aflen += CHARSINCHUNK;
-    return last;
+    a = sha_h[0];
+    b = sha_h[1];
+    c = sha_h[2];
+    d = sha_h[3];
+    e = sha_h[4];
+
+    S1RND20(CH, 0x5a827999, 0)
+    S1RND20(PARITY, 0x6ed9eba1, 20)
+    S1RND20(MAJ, 0x8f1bbcdc, 40)
+    S1RND20(PARITY, 0xca62c1d6, 60)
+
+    sha_h[0] += a;
+    sha_h[1] += b;
+    sha_h[2] += c;
+    sha_h[3] += d;
+    sha_h[4] += e;
   }
+}
 
-  left = (long) (shainfo->flen - shainfo->foffset);
-  if ( left < (long) CHARSINCHUNK ) {
-    copylen = left < 0 ? 0 : shainfo->blen - shainfo->boffset;
-    memset (shainfo->chunk, '\0', CHARSINCHUNK);
-    coffset = copylen;
-    if (left >= 0) {
-      *(shainfo->chunk + coffset) = 0x80;
-    }
-    if (CHARSINCHUNK - copylen - 1 >= LASTSIZE) {
-      /* 512/384 actually use a 128 bit value */
-      nlen = (uint64_t) shainfo->aflen * 8;
-      if ( ! IS_BIG_ENDIAN ) {
-        nlen = bs64 (nlen);
-      }
-      memcpy (shainfo->chunk + CHARSINCHUNK - sizeof(nlen), &nlen, sizeof (nlen));
-      last = 1;
-    }
+#elif BASEHASHSIZE == 3
+
+# define KROL(x,n) (((x) << (n)) | ((x) >> (64-(n))))
+# define KTHETA(x) \
+    c[x] = a[x] ^ a[(x)+5] ^ a[(x)+10] ^ a[(x)+15] ^ a[(x)+20];
+# define KTHETAD(x) \
+    d[x] = c[((x)+4)%5] ^ KROL(c[((x)+1)%5], 1);
+# define KCHI(y) \
+    a[(y)+0] = b[(y)+0] ^ (~b[(y)+1] & b[(y)+2]); \
+    a[(y)+1] = b[(y)+1] ^ (~b[(y)+2] & b[(y)+3]); \
+    a[(y)+2] = b[(y)+2] ^ (~b[(y)+3] & b[(y)+4]); \
+    a[(y)+3] = b[(y)+3] ^ (~b[(y)+4] & b[(y)+0]); \
+    a[(y)+4] = b[(y)+4] ^ (~b[(y)+0] & b[(y)+1]);
+
+/*
+ * Keccak-f[1600].  Lane (x,y) is a[x+5y].  Each round is written out
+ * with constant indices, so the compiler keeps the lanes in registers;
+ * rho and pi are done together as b[y,2x+3y] = rot(a[x,y]).
+ */
+static void
+keccakf (hash_t *st)
+{
+  hash_t      a [25];
+  hash_t      b [25];
+  hash_t      c [5];
+  hash_t      d [5];
+  size_t      r;
+
+  memcpy (a, st, sizeof (a));
+  for (r = 0; r < sizeof (keccak_rc) / sizeof (hash_t); ++r) {
+    KTHETA(0) KTHETA(1) KTHETA(2) KTHETA(3) KTHETA(4)
+    KTHETAD(0) KTHETAD(1) KTHETAD(2) KTHETAD(3) KTHETAD(4)
+
+    b[ 0] = a[ 0] ^ d[0];
+    b[10] = KROL(a[ 1] ^ d[1], 1);
+    b[20] = KROL(a[ 2] ^ d[2], 62);
+    b[ 5] = KROL(a[ 3] ^ d[3], 28);
+    b[15] = KROL(a[ 4] ^ d[4], 27);
+    b[16] = KROL(a[ 5] ^ d[0], 36);
+    b[ 1] = KROL(a[ 6] ^ d[1], 44);
+    b[11] = KROL(a[ 7] ^ d[2], 6);
+    b[21] = KROL(a[ 8] ^ d[3], 55);
+    b[ 6] = KROL(a[ 9] ^ d[4], 20);
+    b[ 7] = KROL(a[10] ^ d[0], 3);
+    b[17] = KROL(a[11] ^ d[1], 10);
+    b[ 2] = KROL(a[12] ^ d[2], 43);
+    b[12] = KROL(a[13] ^ d[3], 25);
+    b[22] = KROL(a[14] ^ d[4], 39);
+    b[23] = KROL(a[15] ^ d[0], 41);
+    b[ 8] = KROL(a[16] ^ d[1], 45);
+    b[18] = KROL(a[17] ^ d[2], 15);
+    b[ 3] = KROL(a[18] ^ d[3], 21);
+    b[13] = KROL(a[19] ^ d[4], 8);
+    b[14] = KROL(a[20] ^ d[0], 18);
+    b[24] = KROL(a[21] ^ d[1], 2);
+    b[ 9] = KROL(a[22] ^ d[2], 61);
+    b[19] = KROL(a[23] ^ d[3], 56);
+    b[ 4] = KROL(a[24] ^ d[4], 14);
+
+    KCHI(0) KCHI(5) KCHI(10) KCHI(15) KCHI(20)
+    a[0] ^= keccak_rc[r];
   }
+  memcpy (st, a, sizeof (a));
+}
+
+/* absorbs nblocks chunks of rate bytes */
+static void
+shablocks (hash_t *sha_h, const buff_t *chunk, size_t nblocks, size_t rate)
+{
+  size_t      i;
 
-  memcpy (shainfo->chunk, shainfo->buf + shainfo->boffset, copylen);
+  for ( ; nblocks > 0; --nblocks, chunk += rate) {
 #if SHA_DEBUG
-  dump ("fc:chunk", shainfo->chunk, CHARSINCHUNK);
+    dump ("chunk", (buff_t *) chunk, rate);
 #endif
-  return last;
+    for (i = 0; i < rate / sizeof (hash_t); ++i) {
+      sha_h[i] ^= LOADLE64 (chunk + i * sizeof (hash_t));
+    }
+    keccakf (sha_h);
+  }
 }
 
-int
-shahash (char *hsize, char *buf, size_t blen, buff_t *predata,
-    char *fn, int flags, char *ret, size_t *rlen)
+#elif SHA_PORTABLE
+
+static void
+shablocks (hash_t *sha_h, const buff_t *chunk, size_t nblocks)
 {
-  hash_t      sha_h [SHA_VALSINHASH];
   hash_t      w [MAXLOOP];
   hash_t      a, b, c, d, e, f, g, h;
   hash_t      t1, t2;
   size_t      i;
-  size_t      maxbuff = 1024 * 1024 * 5;
-  hash_t      *ptr;               /* used for return_raw */
-  int         last, half;
-  shainfo_t   shainfo;
-  FILE        *fh = NULL;
 
-  if ((flags & SHA_RETURN_RAW) != SHA_RETURN_RAW) {
-    ret [0] = '\0';
-    ret [SHA_CHARSINHASH * 2] = '\0';
-  }
-#if BASEHASHSIZE == 512
-  if (strcmp (hsize, "512") != 0 &&
-      strcmp (hsize, "384") != 0 &&
-      strcmp (hsize, "512/256") != 0 &&
-      strcmp (hsize, "512/224") != 0) {
-    return 2;
-  }
-  if (strcmp (hsize, "384") == 0) {
-    memcpy (sha_h, sha_h384_init, sizeof (sha_h384_init));
-  }
-  if (strcmp (hsize, "512") == 0) {
-    memcpy (sha_h, sha_h512_init, sizeof (sha_h512_init));
-  }
-  if (strcmp (hsize, "512/224") == 0) {
-    memcpy (sha_h, sha_h512_224_init, sizeof (sha_h512_init));
-  }
-  if (strcmp (hsize, "512/256") == 0) {
-    memcpy (sha_h, sha_h512_256_init, sizeof (sha_h512_init));
-  }
-#endif
-#if BASEHASHSIZE == 256
-  if (strcmp (hsize, "256") != 0 &&
-      strcmp (hsize, "224") != 0) {
-    return 2;
-  }
-  if (strncmp (hsize, "256", 3) == 0) {
-    memcpy (sha_h, sha_h256_init, sizeof (sha_h256_init));
-  }
-  if (strcmp (hsize, "224") == 0) {
-    memcpy (sha_h, sha_h224_init, sizeof (sha_h224_init));
-  }
+  for ( ; nblocks > 0; --nblocks, chunk += CHARSINCHUNK) {
+#if SHA_DEBUG
+    dump ("chunk", (buff_t *) chunk, CHARSINCHUNK);
 #endif
-
-  shainfo.flen = blen;
-  shainfo.aflen = blen;
-  shainfo.foffset = 0;
-  shainfo.blen = blen;
-  shainfo.boffset = 0;
-  shainfo.buf = (buff_t *) buf;
-  shainfo.chunk = (buff_t *) w;
-
-  if ((flags & SHA_HAVEFILE) == SHA_HAVEFILE && fn != NULL) {
-    struct stat statbuf;
-
-    buf = malloc (maxbuff);
-    if (buf == NULL) {
-      return 1;
-    }
-    shainfo.buf = (buff_t *) buf;
-    flags |= SHA_BUFFER_ALLOC;
-    fh = fopen (fn, "rb");
-    if (fh == (FILE *) NULL) {
-      free (buf);
-      flags &= ~SHA_BUFFER_ALLOC;
-      return 3;
-    }
-    stat (fn, &statbuf);
-    shainfo.flen = (size_t) statbuf.st_size;
-    shainfo.aflen = shainfo.flen;
-    shainfo.blen = fread (buf, 1, maxbuff, fh);
-  }
-
-  do {
-    last = fillChunk (&shainfo, predata);
-    if ( ! IS_BIG_ENDIAN ) {
-      for (i = 0; i < VALSINCHUNK; ++i) {
-        w[i] = bs (w[i]);
-      }
-    }
-    if (predata == NULL) {
-      shainfo.boffset += CHARSINCHUNK;
-      shainfo.foffset += CHARSINCHUNK;
-    }
-
-    /* if the buffer is getting empty, move what's left to
-       the beginning and fill it up again */
-    if (predata == NULL &&
-        (flags & SHA_HAVEFILE) == SHA_HAVEFILE &&
-        shainfo.blen - shainfo.boffset < CHARSINCHUNK) {
-      i = shainfo.blen - shainfo.boffset;
-      if (i > 0) {
-        memmove (buf, buf + shainfo.boffset, i);
-      }
-      shainfo.blen -= shainfo.boffset;
-      shainfo.boffset = 0;
-      shainfo.blen += fread (buf + shainfo.boffset,
-          1, maxbuff - shainfo.blen, fh);
+    for (i = 0; i < VALSINCHUNK; ++i) {
+      w[i] = LOADBE (chunk + i * sizeof (hash_t));
     }
 
     for (i = 16; i < MAXLOOP; ++i) {
@@ -497,150 +668,1393 @@ shahash (char *hsize, char *buf, size_t blen, buff_t *predata,
     sha_h[5] += f;
     sha_h[6] += g;
     sha_h[7] += h;
+  }
+}
 
-    predata = NULL;
-  } while (last == 0);
+#else
 
-  if ((flags & SHA_HAVEFILE) == SHA_HAVEFILE && fn != NULL) {
-    fclose (fh);
-  }
+# define WLOAD(j) (w[j] = LOADBE (chunk + (j) * sizeof (hash_t)))
 
-  if ((flags & SHA_RETURN_RAW) == SHA_RETURN_RAW) {
-    ptr = (hash_t *) ret;
-  }
+static void
+shablocks (hash_t *sha_h, const buff_t *chunk, size_t nblocks)
+{
+  hash_t      w [VALSINCHUNK];
+  hash_t      a, b, c, d, e, f, g, h;
+  hash_t      t1;
+  size_t      i;
 
-  half = 0;
-  *rlen = 0;
-  for (i = 0; i < SHA_VALSINHASH; ++i) {
-    if (strcmp (hsize, "224") == 0 && i == 7) {
-      break;
-    }
-    if (strcmp (hsize, "512/224") == 0 && i > 3) {
-      break;
-    }
-    if (strcmp (hsize, "512/224") == 0 && i == 3) {
-      half = 1;
-    }
-    if (strcmp (hsize, "512/256") == 0 && i > 3) {
-      break;
-    }
-    if (strcmp (hsize, "384") == 0 && i > 5) {
-      break;
-    }
+  for ( ; nblocks > 0; --nblocks, chunk += CHARSINCHUNK) {
+#if SHA_DEBUG
+    dump ("chunk", (buff_t *) chunk, CHARSINCHUNK);
+#endif
+    a = sha_h[0];
+    b = sha_h[1];
+    c = sha_h[2];
+    d = sha_h[3];
+    e = sha_h[4];
+    f = sha_h[5];
+    g = sha_h[6];
+    h = sha_h[7];
 
-    if ((flags & SHA_RETURN_RAW) == SHA_RETURN_RAW) {
-      if ( ! IS_BIG_ENDIAN ) {
-        *(ptr+i) = bs (sha_h[i]);
-      } else {
-        *(ptr+i) = sha_h[i];
-      }
-    } else {
-      sprintf (ret+(i*sizeof(hash_t)*2), SHAFMT, sha_h[i]);
-      if (half) {
-        *(ret+((i+1)*sizeof(hash_t)*2)-8) = '\0';
-      }
+    RND16(0, WLOAD)
+    for (i = 16; i < MAXLOOP; i += 16) {
+      RND16(i, WSCHED)
     }
-    ++*rlen;
+
+    sha_h[0] += a;
+    sha_h[1] += b;
+    sha_h[2] += c;
+    sha_h[3] += d;
+    sha_h[4] += e;
+    sha_h[5] += f;
+    sha_h[6] += g;
+    sha_h[7] += h;
   }
-#if SHA_DEBUG
-  if ((flags & SHA_RETURN_RAW) == SHA_RETURN_RAW) {
-    printf ("rlen-a: %d\n", *rlen);
+}
+
+#endif
+
+#if SHA_HAVE_SHANI && BASEHASHSIZE == 1
+
+# define NI1RND(ea,eb,m,f) \
+    ea = _mm_sha1nexte_epu32 (ea, m); \
+    eb = ABCD; \
+    ABCD = _mm_sha1rnds4_epu32 (ABCD, ea, f);
+# define NI1MSG1(m,cur) m = _mm_sha1msg1_epu32 (m, cur);
+# define NI1MSG2(m,cur) m = _mm_sha1msg2_epu32 (m, cur);
+# define NI1XOR(m,cur) m = _mm_xor_si128 (m, cur);
+# define NI1LOAD(m,off) \
+    m = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (chunk + (off))), MASK);
+
+/*
+ * SHA extensions: sha1rnds4 does four rounds on ABCD, sha1nexte
+ * derives the next E from the previous A, and sha1msg1/2 extend the
+ * schedule four words at a time.  E is kept in the top word.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+shablocksni (hash_t *sha_h, const buff_t *chunk, size_t nblocks)
+{
+  __m128i     ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+  __m128i     M0, M1, M2, M3;
+  const __m128i MASK = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  ABCD = _mm_loadu_si128 ((const __m128i *) &sha_h[0]);
+  ABCD = _mm_shuffle_epi32 (ABCD, 0x1B);          /* DCBA */
+  E0 = _mm_set_epi32 ((int) sha_h[4], 0, 0, 0);
+
+  for ( ; nblocks > 0; --nblocks, chunk += CHARSINCHUNK) {
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    NI1LOAD(M0, 0)
+    E0 = _mm_add_epi32 (E0, M0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32 (ABCD, E0, 0);
+    NI1LOAD(M1, 16)
+    NI1RND(E1, E0, M1, 0)                    NI1MSG1(M0, M1)
+    NI1LOAD(M2, 32)
+    NI1RND(E0, E1, M2, 0)                    NI1MSG1(M1, M2) NI1XOR(M0, M2)
+    NI1LOAD(M3, 48)
+    NI1RND(E1, E0, M3, 0)  NI1MSG2(M0, M3)   NI1MSG1(M2, M3) NI1XOR(M1, M3)
+    NI1RND(E0, E1, M0, 0)  NI1MSG2(M1, M0)   NI1MSG1(M3, M0) NI1XOR(M2, M0)
+    NI1RND(E1, E0, M1, 1)  NI1MSG2(M2, M1)   NI1MSG1(M0, M1) NI1XOR(M3, M1)
+    NI1RND(E0, E1, M2, 1)  NI1MSG2(M3, M2)   NI1MSG1(M1, M2) NI1XOR(M0, M2)
+    NI1RND(E1, E0, M3, 1)  NI1MSG2(M0, M3)   NI1MSG1(M2, M3) NI1XOR(M1, M3)
+    NI1RND(E0, E1, M0, 1)  NI1MSG2(M1, M0)   NI1MSG1(M3, M0) NI1XOR(M2, M0)
+    NI1RND(E1, E0, M1, 1)  NI1MSG2(M2, M1)   NI1MSG1(M0, M1) NI1XOR(M3, M1)
+    NI1RND(E0, E1, M2, 2)  NI1MSG2(M3, M2)   NI1MSG1(M1, M2) NI1XOR(M0, M2)
+    NI1RND(E1, E0, M3, 2)  NI1MSG2(M0, M3)   NI1MSG1(M2, M3) NI1XOR(M1, M3)
+    NI1RND(E0, E1, M0, 2)  NI1MSG2(M1, M0)   NI1MSG1(M3, M0) NI1XOR(M2, M0)
+    NI1RND(E1, E0, M1, 2)  NI1MSG2(M2, M1)   NI1MSG1(M0, M1) NI1XOR(M3, M1)
+    NI1RND(E0, E1, M2, 2)  NI1MSG2(M3, M2)   NI1MSG1(M1, M2) NI1XOR(M0, M2)
+    NI1RND(E1, E0, M3, 3)  NI1MSG2(M0, M3)   NI1MSG1(M2, M3) NI1XOR(M1, M3)
+    NI1RND(E0, E1, M0, 3)  NI1MSG2(M1, M0)   NI1MSG1(M3, M0) NI1XOR(M2, M0)
+    NI1RND(E1, E0, M1, 3)  NI1MSG2(M2, M1)                   NI1XOR(M3, M1)
+    NI1RND(E0, E1, M2, 3)  NI1MSG2(M3, M2)
+    NI1RND(E1, E0, M3, 3)
+
+    E0 = _mm_sha1nexte_epu32 (E0, E0_SAVE);
+    ABCD = _mm_add_epi32 (ABCD, ABCD_SAVE);
+  }
+
+  ABCD = _mm_shuffle_epi32 (ABCD, 0x1B);
+  _mm_storeu_si128 ((__m128i *) &sha_h[0], ABCD);
+  sha_h[4] = (hash_t) _mm_extract_epi32 (E0, 3);
+}
+
+#elif SHA_HAVE_SHANI
+
+# define NIRND(g,cur) \
+    MSG = _mm_add_epi32 (cur, _mm_loadu_si128 ((const __m128i *) &sha_k[(g)*4])); \
+    STATE1 = _mm_sha256rnds2_epu32 (STATE1, STATE0, MSG);
+# define NIRND2 \
+    MSG = _mm_shuffle_epi32 (MSG, 0x0E); \
+    STATE0 = _mm_sha256rnds2_epu32 (STATE0, STATE1, MSG);
+# define NIMSG1(prev,cur) \
+    prev = _mm_sha256msg1_epu32 (prev, cur);
+# define NIMSG2(cur,prev,next) \
+    TMP = _mm_alignr_epi8 (cur, prev, 4); \
+    next = _mm_add_epi32 (next, TMP); \
+    next = _mm_sha256msg2_epu32 (next, cur);
+# define NILOAD(m,off) \
+    m = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (chunk + (off))), MASK);
+
+/*
+ * SHA extensions: sha256rnds2 does two rounds on the state held as
+ * ABEF/CDGH, sha256msg1/2 extend the schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+shablocksni (hash_t *sha_h, const buff_t *chunk, size_t nblocks)
+{
+  __m128i     STATE0, STATE1, ABEF_SAVE, CDGH_SAVE;
+  __m128i     MSG, TMP;
+  __m128i     M0, M1, M2, M3;
+  const __m128i MASK = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  TMP = _mm_loadu_si128 ((const __m128i *) &sha_h[0]);
+  STATE1 = _mm_loadu_si128 ((const __m128i *) &sha_h[4]);
+  TMP = _mm_shuffle_epi32 (TMP, 0xB1);            /* CDAB */
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0x1B);      /* EFGH */
+  STATE0 = _mm_alignr_epi8 (TMP, STATE1, 8);      /* ABEF */
+  STATE1 = _mm_blend_epi16 (STATE1, TMP, 0xF0);   /* CDGH */
+
+  for ( ; nblocks > 0; --nblocks, chunk += CHARSINCHUNK) {
+    ABEF_SAVE = STATE0;
+    CDGH_SAVE = STATE1;
+
+    NILOAD(M0, 0)  NIRND(0, M0)                       NIRND2
+    NILOAD(M1, 16) NIRND(1, M1)                       NIRND2 NIMSG1(M0, M1)
+    NILOAD(M2, 32) NIRND(2, M2)                       NIRND2 NIMSG1(M1, M2)
+    NILOAD(M3, 48) NIRND(3, M3)  NIMSG2(M3, M2, M0)   NIRND2 NIMSG1(M2, M3)
+    NIRND(4, M0)   NIMSG2(M0, M3, M1)   NIRND2 NIMSG1(M3, M0)
+    NIRND(5, M1)   NIMSG2(M1, M0, M2)   NIRND2 NIMSG1(M0, M1)
+    NIRND(6, M2)   NIMSG2(M2, M1, M3)   NIRND2 NIMSG1(M1, M2)
+    NIRND(7, M3)   NIMSG2(M3, M2, M0)   NIRND2 NIMSG1(M2, M3)
+    NIRND(8, M0)   NIMSG2(M0, M3, M1)   NIRND2 NIMSG1(M3, M0)
+    NIRND(9, M1)   NIMSG2(M1, M0, M2)   NIRND2 NIMSG1(M0, M1)
+    NIRND(10, M2)  NIMSG2(M2, M1, M3)   NIRND2 NIMSG1(M1, M2)
+    NIRND(11, M3)  NIMSG2(M3, M2, M0)   NIRND2 NIMSG1(M2, M3)
+    NIRND(12, M0)  NIMSG2(M0, M3, M1)   NIRND2 NIMSG1(M3, M0)
+    NIRND(13, M1)  NIMSG2(M1, M0, M2)   NIRND2
+    NIRND(14, M2)  NIMSG2(M2, M1, M3)   NIRND2
+    NIRND(15, M3)                       NIRND2
+
+    STATE0 = _mm_add_epi32 (STATE0, ABEF_SAVE);
+    STATE1 = _mm_add_epi32 (STATE1, CDGH_SAVE);
   }
+
+  TMP = _mm_shuffle_epi32 (STATE0, 0x1B);         /* FEBA */
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0xB1);      /* DCHG */
+  STATE0 = _mm_blend_epi16 (TMP, STATE1, 0xF0);   /* DCBA */
+  STATE1 = _mm_alignr_epi8 (STATE1, TMP, 8);      /* ABEF */
+  _mm_storeu_si128 ((__m128i *) &sha_h[0], STATE0);
+  _mm_storeu_si128 ((__m128i *) &sha_h[4], STATE1);
+}
+
 #endif
-  *rlen *= sizeof (hash_t);
 
-#if SHA_DEBUG
-  if ((flags & SHA_RETURN_RAW) == SHA_RETURN_RAW) {
-    printf ("rlen-b: %d\n", *rlen);
-    dump ("ret-raw", ret, *rlen);
+#if SHA_HAVE_SHANI
+
+static int
+shacpushani (void)
+{
+  unsigned int  a, b, c, d;
+
+  if (! __get_cpuid (1, &a, &b, &c, &d) ||
+      (c & bit_SSSE3) == 0 || (c & bit_SSE4_1) == 0) {
+    return 0;
+  }
+  if (! __get_cpuid_count (7, 0, &a, &b, &c, &d)) {
+    return 0;
   }
+  return (b & bit_SHA) != 0;
+}
+
 #endif
 
-  if ((flags & SHA_RETURN_RAW) != SHA_RETURN_RAW) {
-    ret [SHA_CHARSINHASH*2] = '\0';
+typedef struct {
+  const char    *name;
+  shacompress_t compress;
+  int           (*available) (void);
+} shabackend_t;
+
+/* in order of preference */
+static shabackend_t shabackends [] = {
+#if SHA_HAVE_SHANI
+  { "shani", shablocksni, shacpushani },
+#endif
+  { "c", shablocks, NULL },
+  { NULL, NULL, NULL }
+};
+
+/*
+ * The selected backend is one pointer, so that a context set up while
+ * sha::backend runs in another thread sees either the old or the new
+ * entry, never half of each.  It starts as "c", the last entry.
+ */
+static const shabackend_t *shabackendcur =
+    &shabackends [sizeof (shabackends) / sizeof (shabackends [0]) - 2];
+
+/*
+ * Selects the named compression backend, or the fastest one the cpu
+ * supports if name is NULL.  Returns 1 if it is not available.
+ */
+static int
+shabackend (const char *name)
+{
+  shabackend_t  *be;
+
+  for (be = shabackends; be->name != NULL; ++be) {
+    if (name != NULL && strcmp (name, be->name) != 0) {
+      continue;
+    }
+    if (be->available != NULL && ! be->available ()) {
+      continue;
+    }
+    __atomic_store_n (&shabackendcur, be, __ATOMIC_RELEASE);
+    return 0;
   }
-  if ((flags & SHA_BUFFER_ALLOC) == SHA_BUFFER_ALLOC) {
-    free (buf);
-    flags &= ~SHA_BUFFER_ALLOC;
+  return 1;
+}
+
+static const char *
+shabackendname (void)
+{
+  return __atomic_load_n (&shabackendcur, __ATOMIC_ACQUIRE)->name;
+}
+
+/* fills names with the backends usable on this cpu */
+static int
+shabackendlist (const char **names, int max)
+{
+  shabackend_t  *be;
+  int           count = 0;
+
+  for (be = shabackends; be->name != NULL && count < max; ++be) {
+    if (be->available != NULL && ! be->available ()) {
+      continue;
+    }
+    names [count++] = be->name;
   }
-  return 0;
+  return count;
+}
+
+static shactx_t *
+shanew (const shaalgo_t *algo)
+{
+  shactx_t    *ctx;
+
+  ctx = malloc (sizeof (shactx_t));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  shainit (ctx, algo);
+  return ctx;
+}
+
+static void
+shafree (shactx_t *ctx)
+{
+  free (ctx);
 }
 
 static void
-hmacpad (buff_t *key, buff_t xorvalue, buff_t *ret)
+shareset (shactx_t *ctx)
+{
+  memcpy (ctx->sha_h, ctx->init, sizeof (ctx->sha_h));
+  ctx->clen = 0;
+  ctx->mlen = 0;
+  ctx->compress = __atomic_load_n (&shabackendcur, __ATOMIC_ACQUIRE)->compress;
+}
+
+static shactx_t *
+shaclone (const shactx_t *ctx)
 {
-  memcpy (ret, key, CHARSINCHUNK);
-  for (int i = 0; i < (int) CHARSINCHUNK; ++i) {
-    ret[i] ^= xorvalue;
+  shactx_t    *nctx;
+
+  nctx = malloc (sizeof (shactx_t));
+  if (nctx != NULL) {
+    memcpy (nctx, ctx, sizeof (shactx_t));
   }
-#if SHA_DEBUG
-  dump ("hmac-key", ret, CHARSINCHUNK);
-#endif
+  return nctx;
 }
 
-int
-hmac (char *hsize, char *buf, size_t blen, char *inkey, size_t inklen,
-    char *fn, int flags, char *ret, size_t *rlen)
+static void
+shaupdate (shactx_t *ctx, const buff_t *buf, size_t blen)
 {
-  int           rc;
-  buff_t        key [CHARSINCHUNK];
-  buff_t        ikey [CHARSINCHUNK];
-  buff_t        okey [CHARSINCHUNK];
-  buff_t        *predata;
-  size_t        klen;
+  size_t      copylen;
 
-  memset (key, '\0', CHARSINCHUNK);
-  memset (ret, '\0', CHARSINCHUNK);
-  if ((flags & SHA_KEYISFILE) == SHA_KEYISFILE) {
-    FILE        *fh;
-    struct stat statbuf;
+  ctx->mlen += blen;
 
-#if SHA_DEBUG
-    printf ("keyfile: %s\n", inkey);
-#endif
-    fh = fopen (inkey, "rb");
-    if (fh == (FILE *) NULL) {
-      return 1;
+  /* top up a partial chunk left over from the last update */
+  if (ctx->clen > 0) {
+    copylen = SHA_BSIZE (ctx) - ctx->clen;
+    if (copylen > blen) {
+      copylen = blen;
     }
-    stat (inkey, &statbuf);
-    if ((size_t) statbuf.st_size > CHARSINCHUNK) {
-#if SHA_DEBUG
-      printf ("hmac: %d > %d : key by hash \n", statbuf.st_size, CHARSINCHUNK);
-#endif
-      flags |= SHA_RETURN_RAW;
-      shahash (hsize, inkey, 0, NULL, inkey, flags, (char *) key, &klen);
-      flags &= ~SHA_RETURN_RAW;
-    } else {
-#if SHA_DEBUG
-      printf ("key from file\n");
-#endif
-      fread (key, 1, CHARSINCHUNK, fh);
+    memcpy (ctx->chunk + ctx->clen, buf, copylen);
+    ctx->clen += copylen;
+    buf += copylen;
+    blen -= copylen;
+    if (ctx->clen < SHA_BSIZE (ctx)) {
+      return;
     }
-    fclose (fh);
-  } else {
-#if SHA_DEBUG
-    printf ("key from data\n");
-#endif
-    memcpy (key, inkey, inklen);
+    SHACOMPRESS (ctx, ctx->chunk, 1);
+    ctx->clen = 0;
   }
-#if SHA_DEBUG
-  dump ("key", key, CHARSINCHUNK);
-#endif
 
-  hmacpad (key, 0x36, ikey);
-  hmacpad (key, 0x5c, okey);
-  predata = ikey;
-  flags |= SHA_RETURN_RAW;
-  rc = shahash (hsize, buf, blen, predata, fn, flags, (char *) key, rlen);
-#if SHA_DEBUG
-  printf ("hmac-ret len: %d\n", *rlen);
-  dump ("hmac-ret", key, *rlen);
-#endif
+  /* full chunks are compressed in place */
+  if (blen >= SHA_BSIZE (ctx)) {
+    copylen = blen / SHA_BSIZE (ctx);
+    SHACOMPRESS (ctx, buf, copylen);
+    copylen *= SHA_BSIZE (ctx);
+    buf += copylen;
+    blen -= copylen;
+  }
 
-  predata = okey;
-  flags &= ~SHA_RETURN_RAW;
-  flags &= ~SHA_HAVEFILE;
-  flags |= SHA_HAVEDATA;
-  rc = shahash (hsize, (char *) key, *rlen, predata, fn, flags, ret, rlen);
-  return rc;
+  if (blen > 0) {
+    memcpy (ctx->chunk, buf, blen);
+    ctx->clen = blen;
+  }
 }
+
+#if BASEHASHSIZE != 3
+
+/*
+ * Builds the final padded block(s) from the last partial chunk.
+ * tail must have room for two chunks.  Returns the number of chunks.
+ */
+static size_t
+shapad (buff_t *tail, const buff_t *rem, size_t remlen, uint64_t mlen)
+{
+  size_t      nblocks = 1;
+  uint64_t    nlen;
+
+  nlen = mlen * 8;
+  memcpy (tail, rem, remlen);
+  tail [remlen++] = 0x80;
+  if (CHARSINCHUNK - remlen < LASTSIZE) {
+    nblocks = 2;
+  }
+  memset (tail + remlen, '\0', CHARSINCHUNK * nblocks - remlen);
+  /* 512/384 actually use a 128 bit value */
+  if ( ! IS_BIG_ENDIAN ) {
+    nlen = bs64 (nlen);
+  }
+  memcpy (tail + CHARSINCHUNK * nblocks - sizeof (nlen), &nlen, sizeof (nlen));
+  return nblocks;
+}
+
+static void
+shaoutput (const hash_t *sha_h, buff_t *digest, size_t dlen)
+{
+  buff_t      out [SHA_CHARSINHASH];
+  hash_t      v;
+  size_t      i;
+
+  for (i = 0; i < SHA_VALSINHASH; ++i) {
+    v = sha_h[i];
+    if ( ! IS_BIG_ENDIAN ) {
+      v = bs (v);
+    }
+    memcpy (out + i * sizeof (hash_t), &v, sizeof (hash_t));
+  }
+  memcpy (digest, out, dlen);
+#if SHA_DEBUG
+  dump ("digest", digest, dlen);
+#endif
+}
+
+static void
+shafinal (shactx_t *ctx, buff_t *digest, size_t *dlen)
+{
+  buff_t      tail [CHARSINCHUNK * 2];
+  size_t      nblocks;
+
+  nblocks = shapad (tail, ctx->chunk, ctx->clen, ctx->mlen);
+  SHACOMPRESS (ctx, tail, nblocks);
+  ctx->clen = 0;
+  shaoutput (ctx->sha_h, digest, ctx->dlen);
+  *dlen = ctx->dlen;
+}
+
+#else
+
+/* the first dlen bytes of the state, dlen is at most the rate */
+static void
+shaoutput (const hash_t *sha_h, buff_t *digest, size_t dlen)
+{
+  size_t      i;
+
+  for (i = 0; i < dlen; ++i) {
+    digest [i] = (buff_t) (sha_h [i / sizeof (hash_t)] >>
+        (8 * (i % sizeof (hash_t))));
+  }
+}
+
+/*
+ * Pads the last chunk with the domain bits (01 for sha-3, 1111 for
+ * shake), then squeezes dlen bytes out of the sponge.
+ */
+static void
+shafinal (shactx_t *ctx, buff_t *digest, size_t *dlen)
+{
+  size_t      off;
+  size_t      n;
+
+  memset (ctx->chunk + ctx->clen, '\0', ctx->bsize - ctx->clen);
+  ctx->chunk [ctx->clen] ^= ctx->pad;
+  ctx->chunk [ctx->bsize - 1] ^= 0x80;
+  SHACOMPRESS (ctx, ctx->chunk, 1);
+  ctx->clen = 0;
+
+  for (off = 0; ; ) {
+    n = ctx->dlen - off < ctx->bsize ? ctx->dlen - off : ctx->bsize;
+    shaoutput (ctx->sha_h, digest + off, n);
+    off += n;
+    if (off >= ctx->dlen) {
+      break;
+    }
+    keccakf (ctx->sha_h);
+  }
+#if SHA_DEBUG
+  dump ("digest", digest, ctx->dlen);
+#endif
+  *dlen = ctx->dlen;
+}
+
+#endif
+
+#if SHA_HAVE_MB
+# define MB_FUNC    shamb_avx2
+# define MB_TARGET  "avx2"
+# define MB_BYTES   32
+# include "shamb.h"
+# undef MB_FUNC
+# undef MB_TARGET
+# undef MB_BYTES
+# define MB_FUNC    shamb_avx512
+# define MB_TARGET  "avx512f"
+# define MB_BYTES   64
+# include "shamb.h"
+# undef MB_FUNC
+# undef MB_TARGET
+# undef MB_BYTES
+
+static int
+shacpuavx2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+
+static int
+shacpuavx512 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx512f");
+}
+#endif
+
+#define MBMAXLANES (64 / sizeof (hash_t))
+
+typedef void (*shambcompress_t) (hash_t *st, const buff_t **blk);
+
+typedef struct {
+  const char      *name;
+  shambcompress_t compress;
+  size_t          lanes;
+  int             (*available) (void);
+} shambbackend_t;
+
+/* in order of preference */
+static shambbackend_t shambbackends [] = {
+#if SHA_HAVE_MB
+  { "avx512", shamb_avx512, 64 / sizeof (hash_t), shacpuavx512 },
+  { "avx2", shamb_avx2, 32 / sizeof (hash_t), shacpuavx2 },
+#endif
+  { "c", NULL, 1, NULL },
+  { NULL, NULL, 0, NULL }
+};
+
+/* published as one pointer, as with shabackendcur */
+static const shambbackend_t *shambcur = NULL;
+
+/*
+ * Selects the multi-buffer engine for shahashlist().  "c" hashes
+ * the messages one at a time with the current backend.
+ */
+static int
+shambbackend (const char *name)
+{
+  shambbackend_t  *be;
+
+  for (be = shambbackends; be->name != NULL; ++be) {
+    if (name != NULL && strcmp (name, be->name) != 0) {
+      continue;
+    }
+    if (be->available != NULL && ! be->available ()) {
+      continue;
+    }
+#if SHA_HAVE_SHANI && SHA_HAVE_MB
+    /* a single sha-ni stream is faster than eight avx2 lanes */
+    if (name == NULL && be->compress == shamb_avx2 && shacpushani ()) {
+      continue;
+    }
+#endif
+    __atomic_store_n (&shambcur, be, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return 1;
+}
+
+/* the current engine; the fastest one is picked on first use */
+static const shambbackend_t *
+shambget (void)
+{
+  const shambbackend_t *be;
+
+  be = __atomic_load_n (&shambcur, __ATOMIC_ACQUIRE);
+  if (be == NULL) {
+    shambbackend (NULL);
+    be = __atomic_load_n (&shambcur, __ATOMIC_ACQUIRE);
+  }
+  return be;
+}
+
+static const char *
+shambbackendname (void)
+{
+  return shambget ()->name;
+}
+
+static int
+shambbackendlist (const char **names, int max)
+{
+  shambbackend_t  *be;
+  int             count = 0;
+
+  for (be = shambbackends; be->name != NULL && count < max; ++be) {
+    if (be->available != NULL && ! be->available ()) {
+      continue;
+    }
+    names [count++] = be->name;
+  }
+  return count;
+}
+
+#if SHA_HAVE_MB
+
+typedef struct {
+  const buff_t  *buf;
+  size_t        nfull;          /* full chunks in the message       */
+  size_t        nblocks;        /* including the padding chunks     */
+  size_t        bidx;           /* next chunk                       */
+  size_t        msg;            /* message index                    */
+  buff_t        tail [CHARSINCHUNK * 2];
+} shamblane_t;
+
+/*
+ * Each SIMD lane runs its own message; a lane that finishes picks up
+ * the next message, so messages of different lengths keep all lanes
+ * busy.
+ */
+static void
+shahashlistmb (const shambbackend_t *be, shactx_t *ctx, size_t count,
+    const buff_t **bufs, const size_t *blens, buff_t *digests)
+{
+  static const buff_t zeroblock [CHARSINCHUNK];
+  shamblane_t     lane [MBMAXLANES];
+  hash_t          st [SHA_VALSINHASH * MBMAXLANES];
+  hash_t          h [SHA_VALSINHASH];
+  const buff_t    *blk [MBMAXLANES];
+  size_t          lanes;
+  size_t          next;
+  size_t          active;
+  size_t          l;
+  size_t          i;
+  size_t          rem;
+
+  lanes = be->lanes;
+  next = 0;
+  active = 0;
+  for (l = 0; l < lanes; ++l) {
+    lane[l].msg = count;
+  }
+  do {
+    /* load the next message into every idle lane */
+    for (l = 0; l < lanes; ++l) {
+      if (lane[l].msg < count || next >= count) {
+        continue;
+      }
+      lane[l].msg = next;
+      lane[l].buf = bufs[next];
+      lane[l].nfull = blens[next] / CHARSINCHUNK;
+      rem = blens[next] - lane[l].nfull * CHARSINCHUNK;
+      lane[l].nblocks = lane[l].nfull + shapad (lane[l].tail,
+          bufs[next] + lane[l].nfull * CHARSINCHUNK, rem, blens[next]);
+      lane[l].bidx = 0;
+      for (i = 0; i < SHA_VALSINHASH; ++i) {
+        st [i * lanes + l] = ctx->init [i];
+      }
+      ++next;
+      ++active;
+    }
+
+    for (l = 0; l < lanes; ++l) {
+      if (lane[l].msg >= count) {
+        blk[l] = zeroblock;
+      } else if (lane[l].bidx < lane[l].nfull) {
+        blk[l] = lane[l].buf + lane[l].bidx * CHARSINCHUNK;
+      } else {
+        blk[l] = lane[l].tail + (lane[l].bidx - lane[l].nfull) * CHARSINCHUNK;
+      }
+    }
+    be->compress (st, blk);
+
+    for (l = 0; l < lanes; ++l) {
+      if (lane[l].msg >= count) {
+        continue;
+      }
+      if (++lane[l].bidx == lane[l].nblocks) {
+        for (i = 0; i < SHA_VALSINHASH; ++i) {
+          h [i] = st [i * lanes + l];
+        }
+        shaoutput (h, digests + lane[l].msg * ctx->dlen, ctx->dlen);
+        lane[l].msg = count;
+        --active;
+      }
+    }
+  } while (active > 0 || next < count);
+}
+
+#endif
+
+/*
+ * Hashes count independent messages with the multi-buffer engine.
+ * The digests are stored one after the other, *dlen bytes each.
+ */
+static int
+shahashlist (const shaalgo_t *algo, size_t count, const buff_t **bufs,
+    const size_t *blens, buff_t *digests, size_t *dlen)
+{
+  shactx_t        ctx;
+  size_t          i;
+#if SHA_HAVE_MB
+  const shambbackend_t *be;
+#endif
+
+  shainit (&ctx, algo);
+  *dlen = ctx.dlen;
+
+#if SHA_HAVE_MB
+  /* one engine for the whole list; the lanes and kernel must match */
+  be = shambget ();
+  if (be->compress != NULL && count >= 2) {
+    shahashlistmb (be, &ctx, count, bufs, blens, digests);
+    return 0;
+  }
+#endif
+  for (i = 0; i < count; ++i) {
+    shareset (&ctx);
+    shaupdate (&ctx, bufs[i], blens[i]);
+    shafinal (&ctx, digests + i * ctx.dlen, dlen);
+  }
+  return 0;
+}
+
+#if SHA_USE_MMAP
+
+/*
+ * Reading a mapped page past the end of a file that was truncated
+ * after it was mapped raises SIGBUS.  shamapupdate() hashes from a
+ * mapping with the signal turned into an error return; any other
+ * SIGBUS goes to the handler that was installed before.
+ */
+static __thread sigjmp_buf  *shabusjmp = NULL;
+static struct sigaction     shabusold;
+
+static void
+shabushandler (int sig, siginfo_t *info, void *uctx)
+{
+  if (shabusjmp != NULL) {
+    siglongjmp (*shabusjmp, 1);
+  }
+  if ((shabusold.sa_flags & SA_SIGINFO) == SA_SIGINFO) {
+    shabusold.sa_sigaction (sig, info, uctx);
+  } else if (shabusold.sa_handler != SIG_DFL &&
+      shabusold.sa_handler != SIG_IGN) {
+    shabusold.sa_handler (sig);
+  } else {
+    /* the fault repeats on return and takes the default action */
+    signal (sig, SIG_DFL);
+  }
+}
+
+static void
+shabusinstall (void)
+{
+  static int        state = 0;
+  int               expect = 0;
+  struct sigaction  sa;
+
+  if (__atomic_load_n (&state, __ATOMIC_ACQUIRE) == 2) {
+    return;
+  }
+  if (__atomic_compare_exchange_n (&state, &expect, 1, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    memset (&sa, '\0', sizeof (sa));
+    sa.sa_sigaction = shabushandler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGBUS, &sa, &shabusold);
+    __atomic_store_n (&state, 2, __ATOMIC_RELEASE);
+  }
+  while (__atomic_load_n (&state, __ATOMIC_ACQUIRE) != 2) {
+    ;
+  }
+}
+
+static int
+shamapupdate (shactx_t *ctx, const buff_t *map, size_t len)
+{
+  sigjmp_buf  jmp;
+
+  shabusinstall ();
+  if (sigsetjmp (jmp, 1) != 0) {
+    shabusjmp = NULL;
+    errno = EIO;
+    return 3;
+  }
+  shabusjmp = &jmp;
+  shaupdate (ctx, map, len);
+  shabusjmp = NULL;
+  return 0;
+}
+
+/*
+ * Regular files are mapped a window at a time and hashed straight
+ * out of the mapping.  Returns -1 if the file can't be mapped and
+ * should be read instead, and 3 if it shrinks while it is hashed.
+ */
+static int
+shafilemap (shactx_t *ctx, const char *fn, volatile int *cancel)
+{
+  size_t      mapwindow = 1024 * 1024 * 256;
+  size_t      step = 1024 * 1024 * 16;
+  size_t      pos;
+  struct stat statbuf;
+  off_t       offset;
+  size_t      len;
+  void        *map;
+  int         fd;
+
+  fd = open (fn, O_RDONLY);
+  if (fd < 0) {
+    return 3;
+  }
+  if (fstat (fd, &statbuf) != 0 ||
+      ! S_ISREG (statbuf.st_mode) ||
+      statbuf.st_size == 0) {
+    close (fd);
+    return -1;
+  }
+
+  for (offset = 0; offset < statbuf.st_size; offset += (off_t) len) {
+    len = mapwindow;
+    if ((off_t) len > statbuf.st_size - offset) {
+      len = (size_t) (statbuf.st_size - offset);
+    }
+    map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, offset);
+    if (map == MAP_FAILED) {
+      close (fd);
+      /* nothing has been hashed yet, the caller can still read the file */
+      return offset == 0 ? -1 : 3;
+    }
+# if defined(MADV_SEQUENTIAL)
+    madvise (map, len, MADV_SEQUENTIAL);
+# endif
+    for (pos = 0; pos < len; pos += step) {
+      if (cancel != NULL && *cancel) {
+        munmap (map, len);
+        close (fd);
+        return 4;
+      }
+      if (shamapupdate (ctx, (buff_t *) map + pos,
+          len - pos < step ? len - pos : step) != 0) {
+        munmap (map, len);
+        close (fd);
+        return 3;
+      }
+    }
+    munmap (map, len);
+  }
+  close (fd);
+  return 0;
+}
+
+#endif
+
+static int
+shafile (shactx_t *ctx, const char *fn, volatile int *cancel)
+{
+  size_t      maxbuff = 1024 * 1024 * 5;
+  buff_t      *buf;
+  size_t      len;
+  FILE        *fh;
+
+#if SHA_USE_MMAP
+  {
+    int       rc;
+
+    rc = shafilemap (ctx, fn, cancel);
+    if (rc >= 0) {
+      return rc;
+    }
+  }
+#endif
+
+  buf = malloc (maxbuff);
+  if (buf == NULL) {
+    return 1;
+  }
+  fh = fopen (fn, "rb");
+  if (fh == (FILE *) NULL) {
+    free (buf);
+    return 3;
+  }
+  while ((len = fread (buf, 1, maxbuff, fh)) > 0) {
+    if (cancel != NULL && *cancel) {
+      fclose (fh);
+      free (buf);
+      return 4;
+    }
+    shaupdate (ctx, buf, len);
+  }
+  fclose (fh);
+  free (buf);
+  return 0;
+}
+
+static int
+shaupdatefile (shactx_t *ctx, const char *fn, volatile int *cancel)
+{
+  return shafile (ctx, fn, cancel);
+}
+
+static void
+shaformat (buff_t *digest, size_t dlen, int flags, char *ret, size_t *rlen)
+{
+  static const char hexchars [] = "0123456789abcdef";
+  size_t      i;
+
+  if ((flags & SHA_RETURN_RAW) == SHA_RETURN_RAW) {
+    memcpy (ret, digest, dlen);
+  } else {
+    for (i = 0; i < dlen; ++i) {
+      ret [i * 2] = hexchars [digest [i] >> 4];
+      ret [i * 2 + 1] = hexchars [digest [i] & 0x0f];
+    }
+    ret [dlen * 2] = '\0';
+  }
+  *rlen = dlen;
+}
+
+static int
+shahash (const shaalgo_t *algo, char *buf, size_t blen,
+    char *fn, int flags, char *ret, size_t *rlen)
+{
+  shactx_t    ctx;
+  buff_t      digest [SHA_MAXOUTLEN];
+  size_t      dlen;
+  int         rc;
+
+  if ((flags & SHA_RETURN_RAW) != SHA_RETURN_RAW) {
+    ret [0] = '\0';
+  }
+  shainit (&ctx, algo);
+
+  if ((flags & SHA_HAVEFILE) == SHA_HAVEFILE && fn != NULL) {
+    rc = shafile (&ctx, fn, NULL);
+    if (rc != 0) {
+      return rc;
+    }
+  } else {
+    shaupdate (&ctx, (buff_t *) buf, blen);
+  }
+
+  shafinal (&ctx, digest, &dlen);
+  shaformat (digest, dlen, flags, ret, rlen);
+  return 0;
+}
+
+/*
+ * Tree hash, layout version SHA_TREE_VERSION.  The file is split into
+ * leaves of leafsize bytes; an empty file has one empty leaf.
+ *   leaf = H(0x00 || leaf data)
+ *   node = H(0x01 || left || right); an odd node is carried up as is
+ *   root = H(0x02 || version || leafsize || file size || top node)
+ * The version is one byte and the sizes are 64-bit big endian.  The
+ * leaves are independent, so the caller may hash them in any order.
+ * shatreeinfo() in shadisp.c gives the number of leaves.
+ */
+static int
+shafileregion (shactx_t *ctx, const char *fn, uint64_t offset, size_t len)
+{
+  size_t      maxbuff = 1024 * 1024 * 5;
+  buff_t      *buf;
+  size_t      rlen;
+  FILE        *fh;
+  int         rc;
+
+  if (len == 0) {
+    return 0;
+  }
+#if SHA_USE_MMAP
+  {
+    struct stat statbuf;
+    off_t       base;
+    size_t      delta;
+    void        *map;
+    int         fd;
+
+    fd = open (fn, O_RDONLY);
+    if (fd < 0) {
+      return 3;
+    }
+    if (fstat (fd, &statbuf) != 0) {
+      close (fd);
+      return 3;
+    }
+    /* the file has shrunk since its size was taken */
+    if (offset >= (uint64_t) statbuf.st_size ||
+        (uint64_t) len > (uint64_t) statbuf.st_size - offset) {
+      close (fd);
+      errno = EIO;
+      return 3;
+    }
+    base = (off_t) offset & ~((off_t) sysconf (_SC_PAGESIZE) - 1);
+    delta = (size_t) ((off_t) offset - base);
+    map = mmap (NULL, len + delta, PROT_READ, MAP_PRIVATE, fd, base);
+    close (fd);
+    if (map != MAP_FAILED) {
+# if defined(MADV_SEQUENTIAL)
+      madvise (map, len + delta, MADV_SEQUENTIAL);
+# endif
+      rc = shamapupdate (ctx, (buff_t *) map + delta, len);
+      munmap (map, len + delta);
+      return rc;
+    }
+  }
+#endif
+
+  buf = malloc (len < maxbuff ? len + 1 : maxbuff);
+  if (buf == NULL) {
+    return 1;
+  }
+  fh = fopen (fn, "rb");
+  if (fh == (FILE *) NULL) {
+    free (buf);
+    return 3;
+  }
+#if defined(_WIN32)
+  rc = _fseeki64 (fh, (__int64) offset, SEEK_SET);
+#else
+  rc = fseeko (fh, (off_t) offset, SEEK_SET);
+#endif
+  while (rc == 0 && len > 0 &&
+      (rlen = fread (buf, 1, len < maxbuff ? len : maxbuff, fh)) > 0) {
+    shaupdate (ctx, buf, rlen);
+    len -= rlen;
+  }
+  fclose (fh);
+  free (buf);
+  if (rc == 0 && len > 0) {
+    errno = EIO;
+    return 3;
+  }
+  return rc == 0 ? 0 : 3;
+}
+
+static int
+shatreeleaf (const shaalgo_t *algo, const char *fn, size_t leafsize,
+    uint64_t flen, size_t idx, buff_t *digest, size_t *dlen)
+{
+  shactx_t    ctx;
+  uint64_t    offset = (uint64_t) idx * leafsize;
+  size_t      len = 0;
+  int         rc;
+
+  if (offset < flen) {
+    len = flen - offset < (uint64_t) leafsize ?
+        (size_t) (flen - offset) : leafsize;
+  }
+  shainit (&ctx, algo);
+  shaupdate (&ctx, (const buff_t *) "\x00", 1);
+  rc = shafileregion (&ctx, fn, offset, len);
+  if (rc != 0) {
+    return rc;
+  }
+  shafinal (&ctx, digest, dlen);
+  return 0;
+}
+
+static int
+shatreeroot (const shaalgo_t *algo, size_t leafsize, uint64_t flen,
+    size_t nleaves, const buff_t *leaves, size_t stride,
+    buff_t *root, size_t *dlen)
+{
+  shactx_t    ctx;
+  buff_t      *level;
+  buff_t      hdr [18];
+  size_t      hlen;
+  size_t      n;
+  size_t      i;
+  size_t      j;
+
+  if (nleaves == 0) {
+    return 2;
+  }
+  shainit (&ctx, algo);
+  hlen = ctx.dlen;
+  if (nleaves > SIZE_MAX / hlen) {
+    return 1;
+  }
+  level = malloc (nleaves * hlen);
+  if (level == NULL) {
+    return 1;
+  }
+  for (i = 0; i < nleaves; ++i) {
+    memcpy (level + i * hlen, leaves + i * stride, hlen);
+  }
+
+  for (n = nleaves; n > 1; n = j) {
+    for (i = 0, j = 0; i + 1 < n; i += 2, ++j) {
+      shainit (&ctx, algo);
+      shaupdate (&ctx, (const buff_t *) "\x01", 1);
+      shaupdate (&ctx, level + i * hlen, hlen);
+      shaupdate (&ctx, level + (i + 1) * hlen, hlen);
+      shafinal (&ctx, level + j * hlen, dlen);
+    }
+    if (i < n) {
+      memmove (level + j * hlen, level + i * hlen, hlen);
+      ++j;
+    }
+  }
+
+  hdr[0] = 0x02;
+  hdr[1] = SHA_TREE_VERSION;
+  for (i = 0; i < 8; ++i) {
+    hdr[2 + i] = (buff_t) ((uint64_t) leafsize >> (56 - i * 8));
+    hdr[10 + i] = (buff_t) (flen >> (56 - i * 8));
+  }
+  shainit (&ctx, algo);
+  shaupdate (&ctx, hdr, sizeof (hdr));
+  shaupdate (&ctx, level, hlen);
+  shafinal (&ctx, root, dlen);
+  free (level);
+  return 0;
+}
+
+static void
+hmacpad (buff_t *key, size_t bsize, buff_t xorvalue, buff_t *ret)
+{
+  size_t      i;
+
+  for (i = 0; i < bsize; ++i) {
+    ret[i] = key[i] ^ xorvalue;
+  }
+#if SHA_DEBUG
+  dump ("hmac-key", ret, bsize);
+#endif
+}
+
+static void
+hmacinit (hmacctx_t *hctx, const shaalgo_t *algo,
+    const buff_t *key, size_t klen)
+{
+  buff_t      k0 [CHARSINCHUNK];
+  buff_t      pad [CHARSINCHUNK];
+  size_t      bsize = algo->blocksize;
+
+  shainit (&hctx->ipad, algo);
+
+  memset (k0, '\0', CHARSINCHUNK);
+  if (klen > bsize) {
+    /* long keys are replaced by their hash */
+    shaupdate (&hctx->ipad, key, klen);
+    shafinal (&hctx->ipad, k0, &klen);
+    shareset (&hctx->ipad);
+  } else if (klen > 0) {
+    memcpy (k0, key, klen);
+  }
+#if SHA_DEBUG
+  dump ("key", k0, bsize);
+#endif
+
+  memcpy (&hctx->opad, &hctx->ipad, sizeof (shactx_t));
+  hmacpad (k0, bsize, 0x36, pad);
+  shaupdate (&hctx->ipad, pad, bsize);
+  hmacpad (k0, bsize, 0x5c, pad);
+  shaupdate (&hctx->opad, pad, bsize);
+  memcpy (&hctx->ictx, &hctx->ipad, sizeof (shactx_t));
+}
+
+static hmacctx_t *
+hmacnew (const shaalgo_t *algo, const buff_t *key, size_t klen)
+{
+  hmacctx_t   *hctx;
+
+  /* hmac is not defined for shake */
+  if (algo->xof) {
+    return NULL;
+  }
+  hctx = malloc (sizeof (hmacctx_t));
+  if (hctx == NULL) {
+    return NULL;
+  }
+  hmacinit (hctx, algo, key, klen);
+  return hctx;
+}
+
+static void
+hmacfree (hmacctx_t *hctx)
+{
+  free (hctx);
+}
+
+static void
+hmacreset (hmacctx_t *hctx)
+{
+  memcpy (&hctx->ictx, &hctx->ipad, sizeof (shactx_t));
+}
+
+static hmacctx_t *
+hmacclone (const hmacctx_t *hctx)
+{
+  hmacctx_t   *nhctx;
+
+  nhctx = malloc (sizeof (hmacctx_t));
+  if (nhctx != NULL) {
+    memcpy (nhctx, hctx, sizeof (hmacctx_t));
+  }
+  return nhctx;
+}
+
+static void
+hmacupdate (hmacctx_t *hctx, const buff_t *buf, size_t blen)
+{
+  shaupdate (&hctx->ictx, buf, blen);
+}
+
+static int
+hmacupdatefile (hmacctx_t *hctx, const char *fn, volatile int *cancel)
+{
+  return shafile (&hctx->ictx, fn, cancel);
+}
+
+static void
+hmacfinal (hmacctx_t *hctx, buff_t *digest, size_t *dlen)
+{
+  shactx_t    octx;
+  buff_t      ihash [SHA_CHARSINHASH];
+  size_t      ilen;
+
+  shafinal (&hctx->ictx, ihash, &ilen);
+#if SHA_DEBUG
+  dump ("hmac-ret", ihash, ilen);
+#endif
+  memcpy (&octx, &hctx->opad, sizeof (shactx_t));
+  shaupdate (&octx, ihash, ilen);
+  shafinal (&octx, digest, dlen);
+}
+
+static int
+hmackeyfile (const shaalgo_t *algo, char *fn, buff_t *key, size_t *klen)
+{
+  FILE        *fh;
+  struct stat statbuf;
+  int         rc;
+
+#if SHA_DEBUG
+  printf ("keyfile: %s\n", fn);
+#endif
+  fh = fopen (fn, "rb");
+  if (fh == (FILE *) NULL) {
+    return 1;
+  }
+  stat (fn, &statbuf);
+  if ((size_t) statbuf.st_size > algo->blocksize) {
+#if SHA_DEBUG
+    printf ("hmac: %d > %d : key by hash \n", statbuf.st_size, algo->blocksize);
+#endif
+    rc = shahash (algo, NULL, 0, fn,
+        SHA_HAVEFILE | SHA_RETURN_RAW, (char *) key, klen);
+    if (rc != 0) {
+      fclose (fh);
+      return rc;
+    }
+  } else {
+#if SHA_DEBUG
+    printf ("key from file\n");
+#endif
+    *klen = fread (key, 1, algo->blocksize, fh);
+  }
+  fclose (fh);
+  return 0;
+}
+
+static int
+hmac (const shaalgo_t *algo, char *buf, size_t blen,
+    char *inkey, size_t inklen, char *fn, int flags, char *ret, size_t *rlen)
+{
+  int           rc;
+  hmacctx_t     hctx;
+  buff_t        key [CHARSINCHUNK];
+  buff_t        *kptr;
+  size_t        klen;
+  buff_t        digest [SHA_CHARSINHASH];
+  size_t        dlen;
+
+  if (algo->xof) {
+    return 2;
+  }
+  kptr = (buff_t *) inkey;
+  klen = inklen;
+  if ((flags & SHA_KEYISFILE) == SHA_KEYISFILE) {
+    rc = hmackeyfile (algo, inkey, key, &klen);
+    if (rc != 0) {
+      return rc;
+    }
+    kptr = key;
+  }
+
+  hmacinit (&hctx, algo, kptr, klen);
+
+  if ((flags & SHA_HAVEFILE) == SHA_HAVEFILE && fn != NULL) {
+    rc = shafile (&hctx.ictx, fn, NULL);
+    if (rc != 0) {
+      return rc;
+    }
+  } else {
+    hmacupdate (&hctx, (buff_t *) buf, blen);
+  }
+
+  hmacfinal (&hctx, digest, &dlen);
+  shaformat (digest, dlen, flags, ret, rlen);
+  return 0;
+}
+
+/*
+ * PBKDF2 with hmac (RFC 8018).  Writes the output blocks first ..
+ * first + nblocks - 1 (numbered from 1), dlen bytes each, to out.
+ *
+ * The key is padded and hashed once.  After U1 every hmac input is a
+ * single chunk following the key chunk, so the padding and length are
+ * set up once and each iteration is one inner and one outer
+ * compression from the saved states.  U2 .. Un are xored as words.
+ */
+static int
+pbkdf2 (const shaalgo_t *algo, const buff_t *pw, size_t pwlen,
+    const buff_t *salt, size_t slen, unsigned long iter,
+    size_t first, size_t nblocks, buff_t *out)
+{
+  hmacctx_t   hctx;
+  buff_t      iblk [CHARSINCHUNK];
+  buff_t      oblk [CHARSINCHUNK];
+  hash_t      h [SHA_STATEWORDS];
+  hash_t      t [SHA_STATEWORDS];
+  buff_t      cnt [4];
+  size_t      bsize = algo->blocksize;
+  size_t      dlen = algo->dlen;
+  size_t      nwords = (dlen + sizeof (hash_t) - 1) / sizeof (hash_t);
+  size_t      b;
+  size_t      i;
+  unsigned long j;
+#if BASEHASHSIZE != 3
+  buff_t      zero [SHA_CHARSINHASH];
+#endif
+
+  if (algo->xof || iter == 0) {
+    return 2;
+  }
+  hmacinit (&hctx, algo, pw, pwlen);
+#if BASEHASHSIZE == 3
+  memset (iblk, '\0', bsize);
+  iblk [dlen] = 0x06;
+  iblk [bsize - 1] |= 0x80;
+#else
+  memset (zero, '\0', dlen);
+  shapad (iblk, zero, dlen, bsize + dlen);
+#endif
+  memcpy (oblk, iblk, bsize);
+
+  for (b = 0; b < nblocks; ++b) {
+    cnt [0] = (buff_t) ((first + b) >> 24);
+    cnt [1] = (buff_t) ((first + b) >> 16);
+    cnt [2] = (buff_t) ((first + b) >> 8);
+    cnt [3] = (buff_t) (first + b);
+    hmacreset (&hctx);
+    hmacupdate (&hctx, salt, slen);
+    hmacupdate (&hctx, cnt, sizeof (cnt));
+    hmacfinal (&hctx, iblk, &i);
+    memcpy (out + b * dlen, iblk, dlen);
+
+    memset (t, '\0', sizeof (t));
+    for (j = 1; j < iter; ++j) {
+      memcpy (h, hctx.ipad.sha_h, sizeof (h));
+      SHACOMPRESS1 (hctx.ipad.compress, h, iblk, bsize);
+      shaoutput (h, oblk, dlen);
+      memcpy (h, hctx.opad.sha_h, sizeof (h));
+      SHACOMPRESS1 (hctx.opad.compress, h, oblk, bsize);
+      shaoutput (h, iblk, dlen);
+      for (i = 0; i < nwords; ++i) {
+        t [i] ^= h [i];
+      }
+    }
+    shaoutput (t, oblk, dlen);
+    for (i = 0; i < dlen; ++i) {
+      out [b * dlen + i] ^= oblk [i];
+    }
+  }
+  return 0;
+}
+
+static const shaalgo_t shaalgos [] = {
+#if BASEHASHSIZE == 512
+  { "512", &SHA_NAME(family), sha_h512_init, 8, 128, 64, 0 },
+  { "384", &SHA_NAME(family), sha_h384_init, 8, 128, 48, 0 },
+  { "512/224", &SHA_NAME(family), sha_h512_224_init, 8, 128, 28, 0 },
+  { "512/256", &SHA_NAME(family), sha_h512_256_init, 8, 128, 32, 0 },
+#endif
+#if BASEHASHSIZE == 256
+  { "256", &SHA_NAME(family), sha_h256_init, 4, 64, 32, 0 },
+  { "224", &SHA_NAME(family), sha_h224_init, 4, 64, 28, 0 },
+#endif
+#if BASEHASHSIZE == 1
+  { "1", &SHA_NAME(family), sha_h1_init, 4, 64, 20, 0 },
+#endif
+#if BASEHASHSIZE == 3
+  /* the block size is the rate; shake gives dlen bytes by default */
+  { "3-256", &SHA_NAME(family), sha_h3_init, 8, 136, 32, 0 },
+  { "3-224", &SHA_NAME(family), sha_h3_init, 8, 144, 28, 0 },
+  { "3-384", &SHA_NAME(family), sha_h3_init, 8, 104, 48, 0 },
+  { "3-512", &SHA_NAME(family), sha_h3_init, 8, 72, 64, 0 },
+  { "shake128", &SHA_NAME(family), sha_h3_init, 8, 168, 32, 1 },
+  { "shake256", &SHA_NAME(family), sha_h3_init, 8, 136, 64, 1 },
+#endif
+  { NULL, NULL, NULL, 0, 0, 0, 0 }
+};
+
+const shafamily_t SHA_NAME(family) = {
+  shaalgos,
+  shahash, hmac,
+  shanew, shafree, shareset, shaclone, shaupdate, shafinal, shaupdatefile,
+  hmacnew, hmacfree, hmacreset, hmacclone, hmacupdate, hmacupdatefile,
+  hmacfinal,
+  shabackend, shabackendname, shabackendlist,
+  shambbackend, shambbackendname, shambbackendlist,
+  shahashlist, shatreeleaf, shatreeroot, hmackeyfile, pbkdf2
+};
@@ -6,26 +6,39 @@
 #ifndef _INC_SHA_H
 #define _INC_SHA_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-/* one of 256, 512 */
+/*
+ * one of 1, 256, 512, 3; sha-1 uses the sha-256 word and chunk sizes,
+ * and 3 is the sha-3/shake (keccak) build
+ */
 #if ! defined(BASEHASHSIZE)
 # define BASEHASHSIZE 512
 #endif
 
-#if BASEHASHSIZE == 512
+#if BASEHASHSIZE == 512 || BASEHASHSIZE == 3
   typedef uint64_t hash_t;
 #endif
-#if BASEHASHSIZE == 256
+#if BASEHASHSIZE == 256 || BASEHASHSIZE == 1
   typedef uint32_t hash_t;
 #endif
 
 #define SHA_VALSINHASH 8
 #define SHA_CHARSINHASH (sizeof(hash_t)*SHA_VALSINHASH)
-#define SHA_DIGESTSIZE (SHA_CHARSINHASH*2+1)
+/* the largest digest; shake can be asked for up to this many bytes */
+#define SHA_MAXOUTLEN 512
+#define SHA_DIGESTSIZE (SHA_MAXOUTLEN*2+1)
 
-#define VALSINCHUNK 16
+/* for sha-3 the chunk is the largest rate, and a context uses its own */
+#if BASEHASHSIZE == 3
+# define VALSINCHUNK 21
+#else
+# define VALSINCHUNK 16
+#endif
 #define CHARSINCHUNK (sizeof(hash_t)*VALSINCHUNK)
+/* the largest chunk of any family (shake128) */
+#define SHA_MAXBLOCKSIZE 168
 
 typedef unsigned char buff_t;
 
@@ -35,11 +48,172 @@ typedef unsigned char buff_t;
 #define SHA_HAVEDATA     0x00000008
 #define SHA_HAVEBITS     0x00000010
 #define SHA_BUFFER_ALLOC 0x00000020
+#define SHA_HAVECHANNEL  0x00000040
+#define SHA_HAVELIST     0x00000080
+#define SHA_HAVEFILES    0x00000100
+
+/* incremental hashing; the context layout is private to sha.c */
+typedef struct shactx shactx_t;
+typedef struct hmacctx hmacctx_t;
+
+struct shafamily;
+
+/*
+ * An algorithm descriptor.  The -bits string is looked up once
+ * (shaalgo) and the descriptor carries everything the hash needs.
+ */
+typedef struct shaalgo {
+  const char  *name;                /* hsize, e.g. "512/256"           */
+  const struct shafamily *fam;      /* the variant that implements it  */
+  const void  *iv;                  /* initial hash values             */
+  size_t      wordsize;             /* bytes per state word            */
+  size_t      blocksize;            /* bytes per chunk                 */
+  size_t      dlen;                 /* digest length, after truncation */
+  int         xof;                  /* shake: the output length is free */
+} shaalgo_t;
 
-int shahash (char *hsize, char *buf, size_t blen, buff_t *predata,
+/*
+ * sha.c is compiled once per word size with SHA_VARIANT defined and
+ * exports only its shafamily_t; shadisp.c provides the names below.
+ */
+#if defined(SHA_VARIANT)
+# if BASEHASHSIZE == 256
+#  define SHA_NAME(n) sha256_##n
+# elif BASEHASHSIZE == 1
+#  define SHA_NAME(n) sha1_##n
+# elif BASEHASHSIZE == 3
+#  define SHA_NAME(n) sha3_##n
+# else
+#  define SHA_NAME(n) sha512_##n
+# endif
+#else
+
+/* returns NULL if hsize is not known */
+const shaalgo_t *shaalgo (const char *hsize);
+
+int shahash (char *hsize, char *buf, size_t blen,
     char *fn, int flags, char *ret, size_t *rlen);
 int hmac (char *hsize, char *buf, size_t blen,
     char *inkey, size_t inklen,
     char *fn, int flags, char *ret, size_t *rlen);
+int shahashalgo (const shaalgo_t *algo, char *buf, size_t blen,
+    char *fn, int flags, char *ret, size_t *rlen);
+int hmacalgo (const shaalgo_t *algo, char *buf, size_t blen,
+    char *inkey, size_t inklen,
+    char *fn, int flags, char *ret, size_t *rlen);
+
+shactx_t *shanew (const char *hsize);
+shactx_t *shanewalgo (const shaalgo_t *algo);
+void shafree (shactx_t *ctx);
+void shareset (shactx_t *ctx);
+shactx_t *shaclone (const shactx_t *ctx);
+void shaupdate (shactx_t *ctx, const buff_t *buf, size_t blen);
+void shafinal (shactx_t *ctx, buff_t *digest, size_t *dlen);
+/* returns 4 if *cancel was set while the file was being read */
+int shaupdatefile (shactx_t *ctx, const char *fn, volatile int *cancel);
+
+hmacctx_t *hmacnew (const char *hsize, const buff_t *key, size_t klen);
+hmacctx_t *hmacnewalgo (const shaalgo_t *algo, const buff_t *key, size_t klen);
+void hmacfree (hmacctx_t *hctx);
+void hmacreset (hmacctx_t *hctx);
+hmacctx_t *hmacclone (const hmacctx_t *hctx);
+void hmacupdate (hmacctx_t *hctx, const buff_t *buf, size_t blen);
+int hmacupdatefile (hmacctx_t *hctx, const char *fn, volatile int *cancel);
+void hmacfinal (hmacctx_t *hctx, buff_t *digest, size_t *dlen);
+/*
+ * A NULL hsize selects every family when setting a backend, the
+ * SHA-256 family when asking for the current one, and all families
+ * when listing them.
+ */
+int shabackend (const char *hsize, const char *name);
+const char *shabackendname (const char *hsize);
+int shabackendlist (const char *hsize, const char **names, int max);
+int shambbackend (const char *hsize, const char *name);
+const char *shambbackendname (const char *hsize);
+int shambbackendlist (const char *hsize, const char **names, int max);
+int shahashlist (char *hsize, size_t count, const buff_t **bufs,
+    const size_t *blens, buff_t *digests, size_t *dlen);
+
+/* tree hash, see sha.c for the layout */
+int shatreeinfo (const char *fn, size_t leafsize,
+    uint64_t *flen, size_t *nleaves);
+/* flen is the size from shatreeinfo; a leaf that is short is an error */
+int shatreeleaf (char *hsize, const char *fn, size_t leafsize, uint64_t flen,
+    size_t idx, buff_t *digest, size_t *dlen);
+/* leaf i is at leaves + i * stride */
+int shatreeroot (char *hsize, size_t leafsize, uint64_t flen, size_t nleaves,
+    const buff_t *leaves, size_t stride, buff_t *root, size_t *dlen);
+
+/* key must have room for SHA_MAXBLOCKSIZE bytes */
+int hmackeyfile (char *hsize, char *fn, buff_t *key, size_t *klen);
+
+/*
+ * PBKDF2-HMAC.  Output blocks first .. first + nblocks - 1 (numbered
+ * from 1) are written to out, dlen bytes each; the last one may be
+ * cut short by the caller.  Not for shake.
+ */
+int shapbkdf2 (char *hsize, const buff_t *pw, size_t pwlen,
+    const buff_t *salt, size_t slen, unsigned long iter,
+    size_t first, size_t nblocks, buff_t *out);
+int shapbkdf2algo (const shaalgo_t *algo, const buff_t *pw, size_t pwlen,
+    const buff_t *salt, size_t slen, unsigned long iter,
+    size_t first, size_t nblocks, buff_t *out);
+
+/* HKDF (RFC 5869), not for shake; expand gives at most 255 digests */
+int shahkdfextract (const shaalgo_t *algo, const buff_t *salt, size_t slen,
+    const buff_t *ikm, size_t ilen, buff_t *prk, size_t *plen);
+int shahkdfexpand (const shaalgo_t *algo, const buff_t *prk, size_t plen,
+    const buff_t *info, size_t ilen, buff_t *out, size_t olen);
+
+/* constant time compare, returns 1 if the digests are the same */
+int shaverify (const buff_t *digest, size_t dlen,
+    const buff_t *expected, size_t elen);
+
+#endif
+
+#define SHA_TREE_VERSION 1
+
+typedef struct shafamily {
+  const shaalgo_t *algos;           /* NULL name terminated            */
+  int         (*hash) (const shaalgo_t *, char *, size_t,
+                  char *, int, char *, size_t *);
+  int         (*mac) (const shaalgo_t *, char *, size_t, char *, size_t,
+                  char *, int, char *, size_t *);
+  shactx_t    *(*ctxnew) (const shaalgo_t *);
+  void        (*ctxfree) (shactx_t *);
+  void        (*ctxreset) (shactx_t *);
+  shactx_t    *(*ctxclone) (const shactx_t *);
+  void        (*ctxupdate) (shactx_t *, const buff_t *, size_t);
+  void        (*ctxfinal) (shactx_t *, buff_t *, size_t *);
+  int         (*ctxupdatefile) (shactx_t *, const char *, volatile int *);
+  hmacctx_t   *(*macnew) (const shaalgo_t *, const buff_t *, size_t);
+  void        (*macfree) (hmacctx_t *);
+  void        (*macreset) (hmacctx_t *);
+  hmacctx_t   *(*macclone) (const hmacctx_t *);
+  void        (*macupdate) (hmacctx_t *, const buff_t *, size_t);
+  int         (*macupdatefile) (hmacctx_t *, const char *, volatile int *);
+  void        (*macfinal) (hmacctx_t *, buff_t *, size_t *);
+  int         (*backend) (const char *);
+  const char  *(*backendname) (void);
+  int         (*backendlist) (const char **, int);
+  int         (*mbbackend) (const char *);
+  const char  *(*mbbackendname) (void);
+  int         (*mbbackendlist) (const char **, int);
+  int         (*hashlist) (const shaalgo_t *, size_t, const buff_t **,
+                  const size_t *, buff_t *, size_t *);
+  int         (*treeleaf) (const shaalgo_t *, const char *, size_t,
+                  uint64_t, size_t, buff_t *, size_t *);
+  int         (*treeroot) (const shaalgo_t *, size_t, uint64_t, size_t,
+                  const buff_t *, size_t, buff_t *, size_t *);
+  int         (*keyfile) (const shaalgo_t *, char *, buff_t *, size_t *);
+  int         (*pbkdf2) (const shaalgo_t *, const buff_t *, size_t,
+                  const buff_t *, size_t, unsigned long, size_t, size_t,
+                  buff_t *);
+} shafamily_t;
+
+extern const shafamily_t sha256_family;
+extern const shafamily_t sha512_family;
+extern const shafamily_t sha1_family;
+extern const shafamily_t sha3_family;
 
 #endif
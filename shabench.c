@@ -0,0 +1,400 @@
+/*
+ * Copyright 2018 Brad Lanam Walnut Creek CA
+ * Copyright 2020 Brad Lanam Pleasant Hill CA
+ * Copyright 2021 Eckhard Lehmann Norderstedt Germany
+ *
+ * Throughput benchmark.  Every hash size, compression backend, mode
+ * and message size selected is timed for at least -time seconds and
+ * reported in MB/s and cycles per byte (the time stamp counter, on
+ * x86 only).
+ *
+ *   shabench [-bits 256,512,...] [-backends c,shani,...]
+ *       [-modes oneshot,stream,file,hmac] [-sizes 0,64,1K,...,1G]
+ *       [-chunk <n>] [-time <seconds>] [-format text|csv|json]
+ *
+ * Modes:
+ *   oneshot   shahash on an in-memory buffer
+ *   stream    shaupdate in -chunk byte pieces (default 4096)
+ *   file      shahash -file on a temporary file (page cache warm)
+ *   hmac      hmac on an in-memory buffer, including the key setup
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define SHA_HAVE_TSC 1
+#endif
+
+#include "sha.h"
+
+#define BENCH_FILE "shabench.tmp"
+#define BENCH_MAXLIST 40
+
+enum {
+  BENCH_TEXT,
+  BENCH_CSV,
+  BENCH_JSON
+};
+
+static const char *benchmodes [] = {
+  "oneshot", "stream", "file", "hmac", NULL
+};
+
+static const shafamily_t *benchfamilies [] = {
+  &sha256_family,
+  &sha512_family,
+  &sha1_family,
+  &sha3_family,
+  NULL
+};
+
+typedef struct {
+  const char  *bits [BENCH_MAXLIST];
+  int         nbits;
+  const char  *backends [BENCH_MAXLIST];
+  int         nbackends;
+  const char  *modes [BENCH_MAXLIST];
+  int         nmodes;
+  size_t      sizes [BENCH_MAXLIST];
+  int         nsizes;
+  size_t      chunk;
+  double      mintime;
+  int         format;
+  int         count;              /* results printed so far            */
+} benchopts_t;
+
+static double
+benchnow (void)
+{
+#if defined(_WIN32)
+  LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  QueryPerformanceFrequency (&freq);
+  QueryPerformanceCounter (&now);
+  return (double) now.QuadPart / (double) freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint64_t
+benchcycles (void)
+{
+#if defined(SHA_HAVE_TSC)
+  return (uint64_t) __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+/* splits a comma separated list in place */
+static int
+benchsplit (char *str, const char **list)
+{
+  char        *p;
+  int         count = 0;
+
+  for (p = strtok (str, ","); p != NULL && count < BENCH_MAXLIST;
+      p = strtok (NULL, ",")) {
+    list [count++] = p;
+  }
+  return count;
+}
+
+static int
+benchinlist (const char *name, const char **list, int count)
+{
+  int         i;
+
+  if (count == 0) {
+    return 1;
+  }
+  for (i = 0; i < count; ++i) {
+    if (strcmp (name, list [i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* 64, 1K, 4M, 1G */
+static size_t
+benchsize (const char *str)
+{
+  char        *end;
+  size_t      sz;
+
+  sz = (size_t) strtoull (str, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': { sz *= 1024; break; }
+    case 'm': case 'M': { sz *= 1024 * 1024; break; }
+    case 'g': case 'G': { sz *= (size_t) 1024 * 1024 * 1024; break; }
+  }
+  return sz;
+}
+
+static int
+benchwritefile (const buff_t *buf, size_t len)
+{
+  FILE        *fh;
+  int         rc = 0;
+
+  fh = fopen (BENCH_FILE, "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+  if (len > 0 && fwrite (buf, 1, len, fh) != len) {
+    rc = -1;
+  }
+  if (fclose (fh) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+/* runs one hash of buf according to mode; returns 0 if ok */
+static int
+benchrun (const shaalgo_t *algo, const char *mode, shactx_t *ctx,
+    buff_t *buf, size_t len, size_t chunk)
+{
+  buff_t      digest [SHA_MAXOUTLEN];
+  size_t      dlen;
+  size_t      off;
+  size_t      n;
+
+  if (strcmp (mode, "oneshot") == 0) {
+    return shahashalgo (algo, (char *) buf, len, NULL,
+        SHA_HAVEDATA | SHA_RETURN_RAW, (char *) digest, &dlen);
+  }
+  if (strcmp (mode, "stream") == 0) {
+    shareset (ctx);
+    for (off = 0; off < len; off += n) {
+      n = len - off < chunk ? len - off : chunk;
+      shaupdate (ctx, buf + off, n);
+    }
+    shafinal (ctx, digest, &dlen);
+    return 0;
+  }
+  if (strcmp (mode, "file") == 0) {
+    return shahashalgo (algo, NULL, 0, BENCH_FILE,
+        SHA_HAVEFILE | SHA_RETURN_RAW, (char *) digest, &dlen);
+  }
+  if (strcmp (mode, "hmac") == 0) {
+    return hmacalgo (algo, (char *) buf, len, "benchmark key", 13, NULL,
+        SHA_HAVEDATA | SHA_RETURN_RAW, (char *) digest, &dlen);
+  }
+  return 2;
+}
+
+static void
+benchprint (benchopts_t *opts, const char *bits, const char *backend,
+    const char *mode, size_t size, long iters, double secs, uint64_t cycles)
+{
+  double      total = (double) size * (double) iters;
+  double      mbs = secs > 0.0 ? total / secs / 1e6 : 0.0;
+  double      cpb = total > 0.0 ? (double) cycles / total : 0.0;
+  double      nsop = iters > 0 ? secs * 1e9 / (double) iters : 0.0;
+
+  switch (opts->format) {
+    case BENCH_CSV: {
+      if (opts->count == 0) {
+        printf ("bits,backend,mode,size,iterations,mbps,cyclesperbyte,nsperop\n");
+      }
+      printf ("%s,%s,%s,%lu,%ld,%.2f,%.2f,%.1f\n", bits, backend, mode,
+          (unsigned long) size, iters, mbs, cpb, nsop);
+      break;
+    }
+    case BENCH_JSON: {
+      printf ("%s\n  {\"bits\": \"%s\", \"backend\": \"%s\", \"mode\": \"%s\", "
+          "\"size\": %lu, \"iterations\": %ld, \"mbps\": %.2f, "
+          "\"cyclesperbyte\": %.2f, \"nsperop\": %.1f}",
+          opts->count == 0 ? "[" : ",", bits, backend, mode,
+          (unsigned long) size, iters, mbs, cpb, nsop);
+      break;
+    }
+    default: {
+      if (opts->count == 0) {
+        printf ("%-8s %-8s %-8s %12s %10s %10s %8s %12s\n",
+            "bits", "backend", "mode", "size", "iters", "MB/s", "cpb", "ns/op");
+      }
+      printf ("%-8s %-8s %-8s %12lu %10ld %10.2f %8.2f %12.1f\n",
+          bits, backend, mode, (unsigned long) size, iters, mbs, cpb, nsop);
+      break;
+    }
+  }
+  ++opts->count;
+  fflush (stdout);
+}
+
+static void
+benchalgo (benchopts_t *opts, const shaalgo_t *algo, const char *backend,
+    buff_t *buf)
+{
+  shactx_t    *ctx;
+  const char  *mode;
+  size_t      size;
+  long        iters;
+  double      start;
+  double      secs = 0.0;
+  uint64_t    cstart;
+  int         i;
+  int         j;
+
+  ctx = shanewalgo (algo);
+  if (ctx == NULL) {
+    return;
+  }
+  for (i = 0; i < opts->nsizes; ++i) {
+    size = opts->sizes [i];
+    for (j = 0; benchmodes [j] != NULL; ++j) {
+      mode = benchmodes [j];
+      if (! benchinlist (mode, opts->modes, opts->nmodes)) {
+        continue;
+      }
+      /* shake has no hmac */
+      if (strcmp (mode, "hmac") == 0 && algo->xof) {
+        continue;
+      }
+      if (strcmp (mode, "file") == 0 && benchwritefile (buf, size) != 0) {
+        fprintf (stderr, "shabench: unable to write %s\n", BENCH_FILE);
+        continue;
+      }
+      /* warm up, then time whole runs for at least mintime */
+      benchrun (algo, mode, ctx, buf, size, opts->chunk);
+      iters = 0;
+      cstart = benchcycles ();
+      start = benchnow ();
+      do {
+        if (benchrun (algo, mode, ctx, buf, size, opts->chunk) != 0) {
+          break;
+        }
+        ++iters;
+        secs = benchnow () - start;
+      } while (secs < opts->mintime);
+      benchprint (opts, algo->name, backend, mode, size, iters, secs,
+          benchcycles () - cstart);
+    }
+  }
+  shafree (ctx);
+  remove (BENCH_FILE);
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-bits <list>] [-backends <list>] "
+      "[-modes oneshot,stream,file,hmac] [-sizes <list>] [-chunk <n>] "
+      "[-time <seconds>] [-format text|csv|json]\n", prog);
+  exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  benchopts_t       opts;
+  const shafamily_t **fam;
+  const shaalgo_t   *algo;
+  const char        *names [20];
+  const char        *sizes [BENCH_MAXLIST];
+  int               nnames;
+  buff_t            *buf;
+  size_t            maxsize = 0;
+  size_t            i;
+  int               j;
+  int               k;
+
+  memset (&opts, '\0', sizeof (opts));
+  opts.chunk = 4096;
+  opts.mintime = 0.5;
+  opts.format = BENCH_TEXT;
+  opts.nsizes = benchsplit (strdup ("0,64,1K,64K,1M,64M,1G"), sizes);
+
+  for (j = 1; j < argc; j += 2) {
+    if (j + 1 >= argc) {
+      usage (argv[0]);
+    }
+    if (strcmp (argv[j], "-bits") == 0) {
+      opts.nbits = benchsplit (argv[j + 1], opts.bits);
+    } else if (strcmp (argv[j], "-backends") == 0) {
+      opts.nbackends = benchsplit (argv[j + 1], opts.backends);
+    } else if (strcmp (argv[j], "-modes") == 0) {
+      opts.nmodes = benchsplit (argv[j + 1], opts.modes);
+    } else if (strcmp (argv[j], "-sizes") == 0) {
+      opts.nsizes = benchsplit (argv[j + 1], sizes);
+    } else if (strcmp (argv[j], "-chunk") == 0) {
+      opts.chunk = benchsize (argv[j + 1]);
+    } else if (strcmp (argv[j], "-time") == 0) {
+      opts.mintime = atof (argv[j + 1]);
+    } else if (strcmp (argv[j], "-format") == 0) {
+      if (strcmp (argv[j + 1], "csv") == 0) {
+        opts.format = BENCH_CSV;
+      } else if (strcmp (argv[j + 1], "json") == 0) {
+        opts.format = BENCH_JSON;
+      } else if (strcmp (argv[j + 1], "text") != 0) {
+        usage (argv[0]);
+      }
+    } else {
+      usage (argv[0]);
+    }
+  }
+  for (j = 0; j < opts.nsizes; ++j) {
+    opts.sizes [j] = benchsize (sizes [j]);
+    if (opts.sizes [j] > maxsize) {
+      maxsize = opts.sizes [j];
+    }
+  }
+  if (opts.chunk == 0) {
+    opts.chunk = 4096;
+  }
+  for (j = 0; j < opts.nbits; ++j) {
+    if (shaalgo (opts.bits [j]) == NULL) {
+      fprintf (stderr, "%s: unknown bits %s\n", argv[0], opts.bits [j]);
+      exit (1);
+    }
+  }
+
+  buf = malloc (maxsize > 0 ? maxsize : 1);
+  if (buf == NULL) {
+    fprintf (stderr, "%s: unable to allocate %lu bytes\n", argv[0],
+        (unsigned long) maxsize);
+    exit (1);
+  }
+  for (i = 0; i < maxsize; ++i) {
+    buf [i] = (buff_t) (i * 131 + 7);
+  }
+
+  for (fam = benchfamilies; *fam != NULL; ++fam) {
+    for (algo = (*fam)->algos; algo->name != NULL; ++algo) {
+      if (! benchinlist (algo->name, opts.bits, opts.nbits)) {
+        continue;
+      }
+      nnames = shabackendlist (algo->name, names, 20);
+      for (k = 0; k < nnames; ++k) {
+        if (! benchinlist (names [k], opts.backends, opts.nbackends) ||
+            shabackend (algo->name, names [k]) != 0) {
+          continue;
+        }
+        benchalgo (&opts, algo, names [k], buf);
+      }
+      shabackend (algo->name, NULL);
+    }
+  }
+  if (opts.format == BENCH_JSON) {
+    printf ("%s\n", opts.count == 0 ? "[]" : "\n]");
+  }
+
+  free (buf);
+  return 0;
+}
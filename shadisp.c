@@ -0,0 +1,485 @@
+/*
+ * Copyright 2018 Brad Lanam Walnut Creek CA
+ * Copyright 2020 Brad Lanam Pleasant Hill CA
+ * Copyright 2021 Eckhard Lehmann Norderstedt Germany
+ *
+ * The public entry points.  sha.c is built once each for the SHA-256
+ * family, the SHA-512 family, SHA-1 and SHA-3/SHAKE (keccak); the calls
+ * are routed by hash size, or by the family recorded at the start of a
+ * context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sha.h"
+
+#define SHA_CTXFAM(ctx) (*(const shafamily_t * const *) (ctx))
+
+static const shafamily_t *shafamilies [] = {
+  &sha256_family,
+  &sha512_family,
+  &sha1_family,
+  &sha3_family,
+  NULL
+};
+
+/*
+ * Resolves a hash size ("1", "256", "512/224", "3-256", "shake128") or
+ * an algorithm name ("sha1", "sha512/224", "sha3-256") to its descriptor.
+ * Callers that hash repeatedly with the same size should keep the
+ * descriptor and use the *algo calls.
+ */
+const shaalgo_t *
+shaalgo (const char *hsize)
+{
+  const shafamily_t **fam;
+  const shaalgo_t   *algo;
+
+  if (hsize == NULL) {
+    return NULL;
+  }
+  for (fam = shafamilies; *fam != NULL; ++fam) {
+    for (algo = (*fam)->algos; algo->name != NULL; ++algo) {
+      if (strcmp (hsize, algo->name) == 0 ||
+          (strncmp (hsize, "sha", 3) == 0 &&
+          strcmp (hsize + 3, algo->name) == 0)) {
+        return algo;
+      }
+    }
+  }
+  return NULL;
+}
+
+static const shafamily_t *
+shafamily (const char *hsize)
+{
+  const shaalgo_t *algo;
+
+  algo = shaalgo (hsize);
+  return algo == NULL ? NULL : algo->fam;
+}
+
+int
+shahashalgo (const shaalgo_t *algo, char *buf, size_t blen,
+    char *fn, int flags, char *ret, size_t *rlen)
+{
+  if (algo == NULL) {
+    if ((flags & SHA_RETURN_RAW) != SHA_RETURN_RAW) {
+      ret [0] = '\0';
+    }
+    return 2;
+  }
+  return algo->fam->hash (algo, buf, blen, fn, flags, ret, rlen);
+}
+
+int
+shahash (char *hsize, char *buf, size_t blen,
+    char *fn, int flags, char *ret, size_t *rlen)
+{
+  return shahashalgo (shaalgo (hsize), buf, blen, fn, flags, ret, rlen);
+}
+
+int
+hmacalgo (const shaalgo_t *algo, char *buf, size_t blen,
+    char *inkey, size_t inklen, char *fn, int flags, char *ret, size_t *rlen)
+{
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->mac (algo, buf, blen, inkey, inklen, fn, flags, ret, rlen);
+}
+
+int
+hmac (char *hsize, char *buf, size_t blen, char *inkey, size_t inklen,
+    char *fn, int flags, char *ret, size_t *rlen)
+{
+  return hmacalgo (shaalgo (hsize), buf, blen, inkey, inklen,
+      fn, flags, ret, rlen);
+}
+
+shactx_t *
+shanewalgo (const shaalgo_t *algo)
+{
+  if (algo == NULL) {
+    return NULL;
+  }
+  return algo->fam->ctxnew (algo);
+}
+
+shactx_t *
+shanew (const char *hsize)
+{
+  return shanewalgo (shaalgo (hsize));
+}
+
+void
+shafree (shactx_t *ctx)
+{
+  if (ctx != NULL) {
+    SHA_CTXFAM (ctx)->ctxfree (ctx);
+  }
+}
+
+void
+shareset (shactx_t *ctx)
+{
+  SHA_CTXFAM (ctx)->ctxreset (ctx);
+}
+
+shactx_t *
+shaclone (const shactx_t *ctx)
+{
+  return SHA_CTXFAM (ctx)->ctxclone (ctx);
+}
+
+void
+shaupdate (shactx_t *ctx, const buff_t *buf, size_t blen)
+{
+  SHA_CTXFAM (ctx)->ctxupdate (ctx, buf, blen);
+}
+
+void
+shafinal (shactx_t *ctx, buff_t *digest, size_t *dlen)
+{
+  SHA_CTXFAM (ctx)->ctxfinal (ctx, digest, dlen);
+}
+
+int
+shaupdatefile (shactx_t *ctx, const char *fn, volatile int *cancel)
+{
+  return SHA_CTXFAM (ctx)->ctxupdatefile (ctx, fn, cancel);
+}
+
+hmacctx_t *
+hmacnewalgo (const shaalgo_t *algo, const buff_t *key, size_t klen)
+{
+  if (algo == NULL) {
+    return NULL;
+  }
+  return algo->fam->macnew (algo, key, klen);
+}
+
+hmacctx_t *
+hmacnew (const char *hsize, const buff_t *key, size_t klen)
+{
+  return hmacnewalgo (shaalgo (hsize), key, klen);
+}
+
+void
+hmacfree (hmacctx_t *hctx)
+{
+  if (hctx != NULL) {
+    SHA_CTXFAM (hctx)->macfree (hctx);
+  }
+}
+
+void
+hmacreset (hmacctx_t *hctx)
+{
+  SHA_CTXFAM (hctx)->macreset (hctx);
+}
+
+hmacctx_t *
+hmacclone (const hmacctx_t *hctx)
+{
+  return SHA_CTXFAM (hctx)->macclone (hctx);
+}
+
+void
+hmacupdate (hmacctx_t *hctx, const buff_t *buf, size_t blen)
+{
+  SHA_CTXFAM (hctx)->macupdate (hctx, buf, blen);
+}
+
+int
+hmacupdatefile (hmacctx_t *hctx, const char *fn, volatile int *cancel)
+{
+  return SHA_CTXFAM (hctx)->macupdatefile (hctx, fn, cancel);
+}
+
+void
+hmacfinal (hmacctx_t *hctx, buff_t *digest, size_t *dlen)
+{
+  SHA_CTXFAM (hctx)->macfinal (hctx, digest, dlen);
+}
+
+int
+hmackeyfile (char *hsize, char *fn, buff_t *key, size_t *klen)
+{
+  const shaalgo_t *algo;
+
+  algo = shaalgo (hsize);
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->keyfile (algo, fn, key, klen);
+}
+
+int
+shapbkdf2algo (const shaalgo_t *algo, const buff_t *pw, size_t pwlen,
+    const buff_t *salt, size_t slen, unsigned long iter,
+    size_t first, size_t nblocks, buff_t *out)
+{
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->pbkdf2 (algo, pw, pwlen, salt, slen, iter,
+      first, nblocks, out);
+}
+
+int
+shapbkdf2 (char *hsize, const buff_t *pw, size_t pwlen,
+    const buff_t *salt, size_t slen, unsigned long iter,
+    size_t first, size_t nblocks, buff_t *out)
+{
+  return shapbkdf2algo (shaalgo (hsize), pw, pwlen, salt, slen, iter,
+      first, nblocks, out);
+}
+
+int
+shahashlist (char *hsize, size_t count, const buff_t **bufs,
+    const size_t *blens, buff_t *digests, size_t *dlen)
+{
+  const shaalgo_t *algo;
+
+  algo = shaalgo (hsize);
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->hashlist (algo, count, bufs, blens, digests, dlen);
+}
+
+/*
+ * HKDF (RFC 5869) on the hmac calls.  An empty salt is the same as
+ * dlen zero bytes, as the key is zero padded.
+ */
+int
+shahkdfextract (const shaalgo_t *algo, const buff_t *salt, size_t slen,
+    const buff_t *ikm, size_t ilen, buff_t *prk, size_t *plen)
+{
+  hmacctx_t       *hctx;
+
+  if (algo == NULL || algo->xof) {
+    return 2;
+  }
+  hctx = hmacnewalgo (algo, salt, slen);
+  if (hctx == NULL) {
+    return 1;
+  }
+  hmacupdate (hctx, ikm, ilen);
+  hmacfinal (hctx, prk, plen);
+  hmacfree (hctx);
+  return 0;
+}
+
+/*
+ * The prk is keyed once; each T(i) = hmac(T(i-1) || info || i) starts
+ * from a reset of the same state.  olen is at most 255 digests.
+ */
+int
+shahkdfexpand (const shaalgo_t *algo, const buff_t *prk, size_t plen,
+    const buff_t *info, size_t ilen, buff_t *out, size_t olen)
+{
+  hmacctx_t       *hctx;
+  buff_t          t [SHA_MAXOUTLEN];
+  size_t          tlen = 0;
+  size_t          off;
+  size_t          n;
+  buff_t          i;
+
+  if (algo == NULL || algo->xof || olen > 255 * algo->dlen) {
+    return 2;
+  }
+  hctx = hmacnewalgo (algo, prk, plen);
+  if (hctx == NULL) {
+    return 1;
+  }
+  for (off = 0, i = 1; off < olen; off += n, ++i) {
+    hmacreset (hctx);
+    hmacupdate (hctx, t, tlen);
+    hmacupdate (hctx, info, ilen);
+    hmacupdate (hctx, &i, 1);
+    hmacfinal (hctx, t, &tlen);
+    n = olen - off < tlen ? olen - off : tlen;
+    memcpy (out + off, t, n);
+  }
+  memset (t, '\0', sizeof (t));
+  hmacfree (hctx);
+  return 0;
+}
+
+/*
+ * Compares a digest with the expected one in time that depends only
+ * on the length.  Returns 1 if they are the same.
+ */
+int
+shaverify (const buff_t *digest, size_t dlen,
+    const buff_t *expected, size_t elen)
+{
+  volatile buff_t diff = 0;
+  size_t          i;
+
+  if (dlen != elen) {
+    return 0;
+  }
+  for (i = 0; i < dlen; ++i) {
+    diff |= digest [i] ^ expected [i];
+  }
+  return diff == 0;
+}
+
+int
+shatreeinfo (const char *fn, size_t leafsize, uint64_t *flen, size_t *nleaves)
+{
+  struct stat statbuf;
+
+  if (leafsize == 0) {
+    return 2;
+  }
+  if (stat (fn, &statbuf) != 0) {
+    return 3;
+  }
+  *flen = (uint64_t) statbuf.st_size;
+  if ((*flen + leafsize - 1) / leafsize > (uint64_t) SIZE_MAX) {
+    return 2;
+  }
+  *nleaves = (size_t) ((*flen + leafsize - 1) / leafsize);
+  if (*nleaves == 0) {
+    *nleaves = 1;
+  }
+  return 0;
+}
+
+int
+shatreeleaf (char *hsize, const char *fn, size_t leafsize, uint64_t flen,
+    size_t idx, buff_t *digest, size_t *dlen)
+{
+  const shaalgo_t *algo;
+
+  algo = shaalgo (hsize);
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->treeleaf (algo, fn, leafsize, flen, idx, digest, dlen);
+}
+
+int
+shatreeroot (char *hsize, size_t leafsize, uint64_t flen, size_t nleaves,
+    const buff_t *leaves, size_t stride, buff_t *root, size_t *dlen)
+{
+  const shaalgo_t *algo;
+
+  algo = shaalgo (hsize);
+  if (algo == NULL) {
+    return 2;
+  }
+  return algo->fam->treeroot (algo, leafsize, flen, nleaves, leaves, stride,
+      root, dlen);
+}
+
+/*
+ * Backends.  The families share backend names ("c" is always there),
+ * so a name given without a hash size is applied to every family that
+ * has it.
+ */
+static int
+shabackendset (const char *hsize, const char *name, int multi)
+{
+  const shafamily_t **fam;
+  int               rc = 1;
+
+  if (hsize != NULL) {
+    if (shafamily (hsize) == NULL) {
+      return 1;
+    }
+    return multi ? shafamily (hsize)->mbbackend (name) :
+        shafamily (hsize)->backend (name);
+  }
+  for (fam = shafamilies; *fam != NULL; ++fam) {
+    if ((multi ? (*fam)->mbbackend (name) :
+        (*fam)->backend (name)) == 0) {
+      rc = 0;
+    }
+  }
+  return rc;
+}
+
+static int
+shabackendnames (const char *hsize, const char **names, int max, int multi)
+{
+  const shafamily_t **fam;
+  const char        *fnames [20];
+  int               fcount;
+  int               count = 0;
+  int               i;
+  int               j;
+
+  if (hsize != NULL) {
+    if (shafamily (hsize) == NULL) {
+      return 0;
+    }
+    return multi ? shafamily (hsize)->mbbackendlist (names, max) :
+        shafamily (hsize)->backendlist (names, max);
+  }
+  for (fam = shafamilies; *fam != NULL; ++fam) {
+    fcount = multi ? (*fam)->mbbackendlist (fnames, 20) :
+        (*fam)->backendlist (fnames, 20);
+    for (i = 0; i < fcount && count < max; ++i) {
+      for (j = 0; j < count; ++j) {
+        if (strcmp (names [j], fnames [i]) == 0) {
+          break;
+        }
+      }
+      if (j == count) {
+        names [count++] = fnames [i];
+      }
+    }
+  }
+  return count;
+}
+
+int
+shabackend (const char *hsize, const char *name)
+{
+  return shabackendset (hsize, name, 0);
+}
+
+const char *
+shabackendname (const char *hsize)
+{
+  const shafamily_t *fam;
+
+  fam = hsize == NULL ? shafamilies [0] : shafamily (hsize);
+  return fam == NULL ? NULL : fam->backendname ();
+}
+
+int
+shabackendlist (const char *hsize, const char **names, int max)
+{
+  return shabackendnames (hsize, names, max, 0);
+}
+
+int
+shambbackend (const char *hsize, const char *name)
+{
+  return shabackendset (hsize, name, 1);
+}
+
+const char *
+shambbackendname (const char *hsize)
+{
+  const shafamily_t *fam;
+
+  fam = hsize == NULL ? shafamilies [0] : shafamily (hsize);
+  return fam == NULL ? NULL : fam->mbbackendname ();
+}
+
+int
+shambbackendlist (const char *hsize, const char **names, int max)
+{
+  return shabackendnames (hsize, names, max, 1);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2018 Brad Lanam Walnut Creek CA
+ * Copyright 2020 Brad Lanam Pleasant Hill CA
+ * Copyright 2021 Eckhard Lehmann Norderstedt Germany
+ *
+ * Multi-buffer compression template, included by sha.c once per
+ * vector width.  The including file defines:
+ *   MB_FUNC    name of the function
+ *   MB_TARGET  target attribute string
+ *   MB_BYTES   vector size in bytes
+ *
+ * The state is stored as st[word * lanes + lane] and each lane
+ * compresses one block from blk[lane].  The round macros from sha.c
+ * are applied to whole vectors.
+ */
+
+#define MB_LANES (MB_BYTES / sizeof (hash_t))
+
+__attribute__((target(MB_TARGET)))
+static void
+MB_FUNC (hash_t *st, const buff_t **blk)
+{
+  typedef hash_t mbvec_t __attribute__((vector_size(MB_BYTES)));
+  mbvec_t     w [VALSINCHUNK];
+  mbvec_t     a, b, c, d, e, f, g, h;
+  mbvec_t     t1;
+  size_t      i;
+  size_t      j;
+
+  for (j = 0; j < VALSINCHUNK; ++j) {
+    for (i = 0; i < MB_LANES; ++i) {
+      w[j][i] = LOADBE (blk[i] + j * sizeof (hash_t));
+    }
+  }
+
+  memcpy (&a, st + 0 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&b, st + 1 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&c, st + 2 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&d, st + 3 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&e, st + 4 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&f, st + 5 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&g, st + 6 * MB_LANES, sizeof (mbvec_t));
+  memcpy (&h, st + 7 * MB_LANES, sizeof (mbvec_t));
+
+#define MB_W(j) w[j]
+  RND16(0, MB_W)
+#undef MB_W
+  for (i = 16; i < MAXLOOP; i += 16) {
+    RND16(i, WSCHED)
+  }
+
+#define MB_ADD(v,n) \
+  memcpy (&t1, st + (n) * MB_LANES, sizeof (mbvec_t)); \
+  t1 += v; \
+  memcpy (st + (n) * MB_LANES, &t1, sizeof (mbvec_t));
+  MB_ADD(a, 0)
+  MB_ADD(b, 1)
+  MB_ADD(c, 2)
+  MB_ADD(d, 3)
+  MB_ADD(e, 4)
+  MB_ADD(f, 5)
+  MB_ADD(g, 6)
+  MB_ADD(h, 7)
+#undef MB_ADD
+}
+
+#undef MB_LANES
@@ -0,0 +1,736 @@
+/*
+ * Copyright 2018 Brad Lanam Walnut Creek CA
+ * Copyright 2020 Brad Lanam Pleasant Hill CA
+ * Copyright 2021 Eckhard Lehmann Norderstedt Germany
+ *
+ * Runs the NIST vectors in test.dir against every backend.
+ *
+ *   shatest [-bits <size>] [<test.dir>]
+ *
+ * The ShortMsg and LongMsg vectors are checked with shahash on the
+ * data, with a file, and with shaupdate in uneven pieces; ShortMsg is
+ * also run through shahashlist with every multi-buffer backend.  The
+ * Monte Carlo chains are run on the data and with a reused context.
+ * HMAC.rsp is checked with hmac on the data and a file, and with
+ * hmacupdate on a reused key, for the sizes it has sections for.
+ * SHA-3 and SHAKE are also checked against the FIPS 202 examples.
+ * Exits with 1 if anything fails.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha.h"
+
+#define TEST_MAXLINE (1024 * 1024)
+#define TEST_MONTE_ITER 1000
+
+typedef struct {
+  buff_t      *msg;
+  size_t      mlen;
+  buff_t      *key;
+  size_t      klen;
+  buff_t      md [SHA_MAXOUTLEN];
+  size_t      mdlen;
+} shavec_t;
+
+typedef struct {
+  shavec_t    *vec;
+  size_t      count;
+  size_t      alloc;
+  buff_t      seed [SHA_CHARSINHASH];
+  size_t      slen;
+  size_t      minout;           /* shake monte output lengths, bytes  */
+  size_t      maxout;
+} shavecs_t;
+
+static const shafamily_t *testfamilies [] = {
+  &sha256_family,
+  &sha512_family,
+  &sha1_family,
+  &sha3_family,
+  NULL
+};
+
+typedef struct {
+  const char  *name;
+  const char  *msg;
+  size_t      rep;              /* msg is repeated this many times     */
+  const char  *md;
+} shakat_t;
+
+static const shakat_t testkats [] = {
+  { "3-224", "", 1,
+    "6b4e03423667dbb73b6e15454f0eb1abd4597f9a1b078e3f5b5a6bc7" },
+  { "3-224", "abc", 1,
+    "e642824c3f8cf24ad09234ee7d3c766fc9a3a5168d0c94ad73b46fdf" },
+  { "3-224", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "8a24108b154ada21c9fd5574494479ba5c7e7ab76ef264ead0fcce33" },
+  { "3-224", "\xa3", 200,
+    "9376816aba503f72f96ce7eb65ac095deee3be4bf9bbc2a1cb7e11e0" },
+  { "3-256", "", 1,
+    "a7ffc6f8bf1ed76651c14756a061d662f580ff4de43b49fa82d80a4b80f8434a" },
+  { "3-256", "abc", 1,
+    "3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532" },
+  { "3-256", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "41c0dba2a9d6240849100376a8235e2c82e1b9998a999e21db32dd97496d3376" },
+  { "3-256", "\xa3", 200,
+    "79f38adec5c20307a98ef76e8324afbfd46cfd81b22e3973c65fa1bd9de31787" },
+  { "3-384", "", 1,
+    "0c63a75b845e4f7d01107d852e4c2485c51a50aaaa94fc61995e71bbee983a2a"
+    "c3713831264adb47fb6bd1e058d5f004" },
+  { "3-384", "abc", 1,
+    "ec01498288516fc926459f58e2c6ad8df9b473cb0fc08c2596da7cf0e49be4b2"
+    "98d88cea927ac7f539f1edf228376d25" },
+  { "3-384", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "991c665755eb3a4b6bbdfb75c78a492e8c56a22c5c4d7e429bfdbc32b9d4ad5a"
+    "a04a1f076e62fea19eef51acd0657c22" },
+  { "3-384", "\xa3", 200,
+    "1881de2ca7e41ef95dc4732b8f5f002b189cc1e42b74168ed1732649ce1dbcdd"
+    "76197a31fd55ee989f2d7050dd473e8f" },
+  { "3-512", "", 1,
+    "a69f73cca23a9ac5c8b567dc185a756e97c982164fe25859e0d1dcc1475c80a6"
+    "15b2123af1f5f94c11e3e9402c3ac558f500199d95b6d3e301758586281dcd26" },
+  { "3-512", "abc", 1,
+    "b751850b1a57168a5693cd924b6b096e08f621827444f70d884f5d0240d2712e"
+    "10e116e9192af3c91a7ec57647e3934057340b4cf408d5a56592f8274eec53f0" },
+  { "3-512", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "04a371e84ecfb5b8b77cb48610fca8182dd457ce6f326a0fd3d7ec2f1e91636d"
+    "ee691fbe0c985302ba1b0d8dc78c086346b533b49c030d99a27daf1139d6e75e" },
+  { "3-512", "\xa3", 200,
+    "e76dfad22084a8b1467fcf2ffa58361bec7628edf5f3fdc0e4805dc48caeeca8"
+    "1b7c13c30adf52a3659584739a2df46be589c51ca1a4a8416df6545a1ce8ba00" },
+  { "shake128", "", 1,
+    "7f9c2ba4e88f827d616045507605853ed73b8093f6efbc88eb1a6eacfa66ef26" },
+  { "shake128", "abc", 1,
+    "5881092dd818bf5cf8a3ddb793fbcba74097d5c526a6d35f97b83351940f2cc8" },
+  { "shake128", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "1a96182b50fb8c7e74e0a707788f55e98209b8d91fade8f32f8dd5cff7bf21f5" },
+  { "shake128", "\xa3", 200,
+    "131ab8d2b594946b9c81333f9bb6e0ce75c3b93104fa3469d3917457385da037" },
+  { "shake256", "", 1,
+    "46b9dd2b0ba88d13233b3feb743eeb243fcd52ea62b81b82b50c27646ed5762f"
+    "d75dc4ddd8c0f200cb05019d67b592f6fc821c49479ab48640292eacb3b7c4be" },
+  { "shake256", "abc", 1,
+    "483366601360a8771c6863080cc4114d8db44530f8f1e1ee4f94ea37e78b5739"
+    "d5a15bef186a5386c75744c0527e1faa9f8726e462a12a4feb06bd8801e751e4" },
+  { "shake256", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "4d8c2dd2435a0128eefbb8c36f6f87133a7911e18d979ee1ae6be5d4fd2e3329"
+    "40d8688a4e6a59aa8060f1f9bc996c05aca3c696a8b66279dc672c740bb224ec" },
+  { "shake256", "\xa3", 200,
+    "cd8a920ed141aa0407a22d59288652e9d9f1a7ee0c1e7c1ca699424da84a904d"
+    "2d700caae7396ece96604440577da4f3aa22aeb8857f961c4cd8e06f0ae6610b" },
+  { NULL, NULL, 0, NULL }
+};
+
+/* stream piece sizes; uneven so the block buffering gets exercised */
+static const size_t testchunks [] = { 1, 3, 64, 17, 128, 200, 1000 };
+
+static char   testfn [80];
+static char   *testline;
+
+static size_t
+hextobin (const char *hex, buff_t *out)
+{
+  size_t      len = 0;
+  int         hi;
+  int         lo;
+
+  while (hex [0] != '\0' && hex [1] != '\0') {
+    if (sscanf (hex, "%1x%1x", &hi, &lo) != 2) {
+      break;
+    }
+    out [len++] = (buff_t) (hi << 4 | lo);
+    hex += 2;
+  }
+  return len;
+}
+
+static shavec_t *
+vecadd (shavecs_t *vecs)
+{
+  shavec_t    *vec;
+
+  if (vecs->count == vecs->alloc) {
+    vecs->alloc = vecs->alloc == 0 ? 64 : vecs->alloc * 2;
+    vecs->vec = realloc (vecs->vec, vecs->alloc * sizeof (shavec_t));
+  }
+  vec = &vecs->vec [vecs->count++];
+  memset (vec, '\0', sizeof (shavec_t));
+  return vec;
+}
+
+static void
+vecfree (shavecs_t *vecs)
+{
+  size_t      i;
+
+  for (i = 0; i < vecs->count; ++i) {
+    free (vecs->vec [i].msg);
+    free (vecs->vec [i].key);
+  }
+  free (vecs->vec);
+  memset (vecs, '\0', sizeof (shavecs_t));
+}
+
+/*
+ * Loads a .rsp file.  A vector is complete at its MD, Output or Mac
+ * line.  For HMAC.rsp only the [L=dlen] section is kept.  A Msg before
+ * any Len is the seed of a SHAKE Monte file.
+ */
+static int
+rspload (const char *dir, const char *name, size_t dlen, int ishmac,
+    shavecs_t *vecs)
+{
+  FILE        *fh;
+  char        fn [1024];
+  char        *val;
+  char        *p;
+  buff_t      *msg = NULL;
+  size_t      mlen = 0;
+  buff_t      *key = NULL;
+  size_t      klen = 0;
+  size_t      tlen = 0;
+  size_t      len = 0;
+  int         havelen = 0;
+  int         insect = ! ishmac;
+  shavec_t    *vec;
+
+  memset (vecs, '\0', sizeof (shavecs_t));
+  snprintf (fn, sizeof (fn), "%s/%s", dir, name);
+  fh = fopen (fn, "r");
+  if (fh == NULL) {
+    fprintf (stderr, "shatest: unable to open %s\n", fn);
+    return -1;
+  }
+
+  while (fgets (testline, TEST_MAXLINE, fh) != NULL) {
+    p = testline + strcspn (testline, "\r\n");
+    *p = '\0';
+    if (strncmp (testline, "[L", 2) == 0) {
+      p = testline + strcspn (testline, "0123456789");
+      insect = ! ishmac || (size_t) atoi (p) == dlen;
+      continue;
+    }
+    if (strncmp (testline, "[Minimum", 8) == 0) {
+      p = testline + strcspn (testline, "0123456789");
+      vecs->minout = (size_t) atoi (p) / 8;
+      continue;
+    }
+    if (strncmp (testline, "[Maximum", 8) == 0) {
+      p = testline + strcspn (testline, "0123456789");
+      vecs->maxout = (size_t) atoi (p) / 8;
+      continue;
+    }
+    val = strstr (testline, " = ");
+    if (val == NULL || ! insect) {
+      continue;
+    }
+    val += 3;
+    if (strncmp (testline, "Len ", 4) == 0) {
+      len = (size_t) strtoul (val, NULL, 10) / 8;
+      havelen = 1;
+    } else if (strncmp (testline, "Tlen ", 5) == 0) {
+      tlen = (size_t) strtoul (val, NULL, 10);
+    } else if (strncmp (testline, "Seed ", 5) == 0) {
+      vecs->slen = hextobin (val, vecs->seed);
+    } else if (strncmp (testline, "Key ", 4) == 0) {
+      free (key);
+      key = malloc (strlen (val) / 2 + 1);
+      klen = hextobin (val, key);
+    } else if (strncmp (testline, "Msg ", 4) == 0 && ! ishmac && ! havelen) {
+      vecs->slen = hextobin (val, vecs->seed);
+    } else if (strncmp (testline, "Msg ", 4) == 0) {
+      free (msg);
+      msg = malloc (strlen (val) / 2 + 1);
+      mlen = hextobin (val, msg);
+      if (! ishmac) {
+        mlen = len;
+      }
+    } else if (strncmp (testline, "MD ", 3) == 0 ||
+        strncmp (testline, "Output ", 7) == 0 ||
+        strncmp (testline, "Mac ", 4) == 0) {
+      vec = vecadd (vecs);
+      vec->mdlen = hextobin (val, vec->md);
+      if (ishmac && tlen < vec->mdlen) {
+        vec->mdlen = tlen;
+      }
+      vec->msg = msg;
+      vec->mlen = mlen;
+      vec->key = key;
+      vec->klen = klen;
+      msg = NULL;
+      mlen = 0;
+      key = NULL;
+      klen = 0;
+    }
+  }
+  free (msg);
+  free (key);
+  fclose (fh);
+  return 0;
+}
+
+/* the built-in FIPS 202 examples for algo */
+static void
+katload (const shaalgo_t *algo, shavecs_t *vecs)
+{
+  const shakat_t  *kat;
+  shavec_t        *vec;
+  size_t          len;
+  size_t          i;
+
+  memset (vecs, '\0', sizeof (shavecs_t));
+  for (kat = testkats; kat->name != NULL; ++kat) {
+    if (strcmp (kat->name, algo->name) != 0) {
+      continue;
+    }
+    vec = vecadd (vecs);
+    len = strlen (kat->msg);
+    vec->mlen = len * kat->rep;
+    vec->msg = malloc (vec->mlen + 1);
+    for (i = 0; i < kat->rep; ++i) {
+      memcpy (vec->msg + i * len, kat->msg, len);
+    }
+    vec->mdlen = hextobin (kat->md, vec->md);
+  }
+}
+
+static int
+writefile (const buff_t *buf, size_t len)
+{
+  FILE        *fh;
+  int         rc = 0;
+
+  fh = fopen (testfn, "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+  if (len > 0 && fwrite (buf, 1, len, fh) != len) {
+    rc = -1;
+  }
+  if (fclose (fh) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+static void
+streamdata (shactx_t *ctx, hmacctx_t *hctx, const buff_t *buf, size_t len)
+{
+  size_t      off;
+  size_t      n;
+  size_t      c = 0;
+
+  for (off = 0; off < len; off += n) {
+    n = testchunks [c++ % (sizeof (testchunks) / sizeof (size_t))];
+    if (n > len - off) {
+      n = len - off;
+    }
+    if (ctx != NULL) {
+      shaupdate (ctx, buf + off, n);
+    } else {
+      hmacupdate (hctx, buf + off, n);
+    }
+  }
+}
+
+static int
+report (const shaalgo_t *algo, const char *backend, const char *name,
+    const char *path, size_t ok, size_t count)
+{
+  printf ("%-8s %-8s %-12s %-7s %4lu/%-4lu %s\n", algo->name, backend, name,
+      path, (unsigned long) ok, (unsigned long) count,
+      ok == count ? "ok" : "FAIL");
+  return ok == count ? 0 : 1;
+}
+
+static int
+testmsg (const shaalgo_t *algo, const char *backend, const char *name,
+    shavecs_t *vecs)
+{
+  shactx_t    *ctx;
+  buff_t      digest [SHA_MAXOUTLEN];
+  size_t      dlen;
+  size_t      okdata = 0;
+  size_t      okfile = 0;
+  size_t      okstream = 0;
+  size_t      i;
+  shavec_t    *vec;
+  int         rc = 0;
+
+  ctx = shanewalgo (algo);
+  for (i = 0; i < vecs->count; ++i) {
+    vec = &vecs->vec [i];
+
+    if (shahashalgo (algo, (char *) vec->msg, vec->mlen, NULL,
+        SHA_HAVEDATA | SHA_RETURN_RAW, (char *) digest, &dlen) == 0 &&
+        memcmp (digest, vec->md, vec->mdlen) == 0) {
+      ++okdata;
+    }
+
+    if (writefile (vec->msg, vec->mlen) == 0 &&
+        shahashalgo (algo, NULL, 0, testfn,
+        SHA_HAVEFILE | SHA_RETURN_RAW, (char *) digest, &dlen) == 0 &&
+        memcmp (digest, vec->md, vec->mdlen) == 0) {
+      ++okfile;
+    }
+
+    shareset (ctx);
+    streamdata (ctx, NULL, vec->msg, vec->mlen);
+    shafinal (ctx, digest, &dlen);
+    if (memcmp (digest, vec->md, vec->mdlen) == 0) {
+      ++okstream;
+    }
+  }
+  shafree (ctx);
+
+  rc |= report (algo, backend, name, "data", okdata, vecs->count);
+  rc |= report (algo, backend, name, "file", okfile, vecs->count);
+  rc |= report (algo, backend, name, "stream", okstream, vecs->count);
+  return rc;
+}
+
+static int
+testlist (const shaalgo_t *algo, const char *backend, const char *name,
+    shavecs_t *vecs)
+{
+  const buff_t  **bufs;
+  size_t        *blens;
+  buff_t        *digests;
+  size_t        dlen;
+  size_t        ok = 0;
+  size_t        i;
+
+  bufs = malloc (vecs->count * sizeof (buff_t *));
+  blens = malloc (vecs->count * sizeof (size_t));
+  digests = malloc (vecs->count * SHA_MAXOUTLEN);
+  for (i = 0; i < vecs->count; ++i) {
+    bufs [i] = vecs->vec [i].msg;
+    blens [i] = vecs->vec [i].mlen;
+  }
+  if (shahashlist ((char *) algo->name, vecs->count, bufs, blens,
+      digests, &dlen) == 0) {
+    for (i = 0; i < vecs->count; ++i) {
+      if (memcmp (digests + i * dlen, vecs->vec [i].md,
+          vecs->vec [i].mdlen) == 0) {
+        ++ok;
+      }
+    }
+  }
+  free (bufs);
+  free (blens);
+  free (digests);
+  return report (algo, backend, name, "list", ok, vecs->count);
+}
+
+/*
+ * SHAVS Monte Carlo: each digest is the hash of the previous three,
+ * and every 1000th one is checked and becomes the next seed.
+ */
+static int
+testmonte (const shaalgo_t *algo, const char *backend, const char *name,
+    shavecs_t *vecs)
+{
+  shactx_t    *ctx;
+  buff_t      md [3][SHA_CHARSINHASH];
+  buff_t      m [SHA_CHARSINHASH * 3];
+  buff_t      seed [2][SHA_CHARSINHASH];
+  size_t      dlen = vecs->slen;
+  size_t      ok [2] = { 0, 0 };
+  size_t      i;
+  size_t      j;
+  int         path;
+  int         rc = 0;
+
+  ctx = shanewalgo (algo);
+  for (path = 0; path < 2; ++path) {
+    memcpy (seed [path], vecs->seed, dlen);
+    for (j = 0; j < vecs->count; ++j) {
+      memcpy (md [0], seed [path], dlen);
+      memcpy (md [1], seed [path], dlen);
+      memcpy (md [2], seed [path], dlen);
+      for (i = 0; i < TEST_MONTE_ITER; ++i) {
+        memcpy (m, md [0], dlen);
+        memcpy (m + dlen, md [1], dlen);
+        memcpy (m + dlen * 2, md [2], dlen);
+        memcpy (md [0], md [1], dlen);
+        memcpy (md [1], md [2], dlen);
+        if (path == 0) {
+          shahashalgo (algo, (char *) m, dlen * 3, NULL,
+              SHA_HAVEDATA | SHA_RETURN_RAW, (char *) md [2], &dlen);
+        } else {
+          shareset (ctx);
+          shaupdate (ctx, m, dlen * 3);
+          shafinal (ctx, md [2], &dlen);
+        }
+      }
+      if (memcmp (md [2], vecs->vec [j].md, vecs->vec [j].mdlen) == 0) {
+        ++ok [path];
+      }
+      memcpy (seed [path], md [2], dlen);
+    }
+  }
+  shafree (ctx);
+
+  rc |= report (algo, backend, name, "data", ok [0], vecs->count);
+  rc |= report (algo, backend, name, "stream", ok [1], vecs->count);
+  return rc;
+}
+
+/*
+ * SHA3VS Monte Carlo: each digest is the hash of the previous one.
+ * For shake the message is the first 16 bytes of the last output,
+ * and its last two bytes pick the next output length.
+ */
+static int
+testmonte3 (const shaalgo_t *algo, const char *backend, const char *name,
+    shavecs_t *vecs)
+{
+  shaalgo_t   xalgo = *algo;
+  shactx_t    *ctx;
+  buff_t      md [SHA_MAXOUTLEN];
+  buff_t      m [SHA_MAXOUTLEN];
+  size_t      mlen;
+  size_t      dlen;
+  size_t      range = vecs->maxout - vecs->minout + 1;
+  size_t      ok [2] = { 0, 0 };
+  size_t      i;
+  size_t      j;
+  int         path;
+  int         rc = 0;
+
+  ctx = shanewalgo (algo);
+  for (path = 0; path < 2; ++path) {
+    memcpy (md, vecs->seed, vecs->slen);
+    dlen = vecs->slen;
+    if (algo->xof) {
+      xalgo.dlen = vecs->maxout;
+    }
+    for (j = 0; j < vecs->count; ++j) {
+      for (i = 0; i < TEST_MONTE_ITER; ++i) {
+        mlen = dlen;
+        if (algo->xof) {
+          mlen = 16;
+          memset (m, '\0', mlen);
+        }
+        memcpy (m, md, dlen < mlen ? dlen : mlen);
+        if (path == 0) {
+          shahashalgo (&xalgo, (char *) m, mlen, NULL,
+              SHA_HAVEDATA | SHA_RETURN_RAW, (char *) md, &dlen);
+        } else if (algo->xof) {
+          shafree (ctx);
+          ctx = shanewalgo (&xalgo);
+          shaupdate (ctx, m, mlen);
+          shafinal (ctx, md, &dlen);
+        } else {
+          shareset (ctx);
+          shaupdate (ctx, m, mlen);
+          shafinal (ctx, md, &dlen);
+        }
+        if (algo->xof) {
+          xalgo.dlen = vecs->minout +
+              ((size_t) md [dlen - 2] << 8 | md [dlen - 1]) % range;
+        }
+      }
+      if (dlen == vecs->vec [j].mdlen &&
+          memcmp (md, vecs->vec [j].md, dlen) == 0) {
+        ++ok [path];
+      }
+    }
+  }
+  shafree (ctx);
+
+  rc |= report (algo, backend, name, "data", ok [0], vecs->count);
+  rc |= report (algo, backend, name, "stream", ok [1], vecs->count);
+  return rc;
+}
+
+static int
+testhmac (const shaalgo_t *algo, const char *backend, shavecs_t *vecs)
+{
+  hmacctx_t   *hctx;
+  buff_t      digest [SHA_CHARSINHASH];
+  size_t      dlen;
+  size_t      okdata = 0;
+  size_t      okfile = 0;
+  size_t      okstream = 0;
+  size_t      i;
+  int         pass;
+  int         good;
+  shavec_t    *vec;
+  int         rc = 0;
+
+  for (i = 0; i < vecs->count; ++i) {
+    vec = &vecs->vec [i];
+
+    if (hmacalgo (algo, (char *) vec->msg, vec->mlen,
+        (char *) vec->key, vec->klen, NULL,
+        SHA_HAVEDATA | SHA_RETURN_RAW, (char *) digest, &dlen) == 0 &&
+        memcmp (digest, vec->md, vec->mdlen) == 0) {
+      ++okdata;
+    }
+
+    if (writefile (vec->msg, vec->mlen) == 0 &&
+        hmacalgo (algo, NULL, 0, (char *) vec->key, vec->klen, testfn,
+        SHA_HAVEFILE | SHA_RETURN_RAW, (char *) digest, &dlen) == 0 &&
+        memcmp (digest, vec->md, vec->mdlen) == 0) {
+      ++okfile;
+    }
+
+    /* the second pass checks that a reset key is reusable */
+    hctx = hmacnewalgo (algo, vec->key, vec->klen);
+    good = hctx != NULL;
+    for (pass = 0; good && pass < 2; ++pass) {
+      streamdata (NULL, hctx, vec->msg, vec->mlen);
+      hmacfinal (hctx, digest, &dlen);
+      hmacreset (hctx);
+      good = memcmp (digest, vec->md, vec->mdlen) == 0;
+    }
+    if (good) {
+      ++okstream;
+    }
+    hmacfree (hctx);
+  }
+
+  rc |= report (algo, backend, "HMAC", "data", okdata, vecs->count);
+  rc |= report (algo, backend, "HMAC", "file", okfile, vecs->count);
+  rc |= report (algo, backend, "HMAC", "stream", okstream, vecs->count);
+  return rc;
+}
+
+static int
+testalgo (const char *dir, const shaalgo_t *algo)
+{
+  static const char *msgfiles [] = { "ShortMsg", "LongMsg", NULL };
+  shavecs_t   vecs [3];
+  shavecs_t   kats;
+  shavecs_t   monte;
+  shavecs_t   hvecs;
+  char        name [80];
+  char        prefix [40];
+  const char  *names [20];
+  int         nnames;
+  char        *p;
+  int         i;
+  int         k;
+  int         issha3 = algo->fam == &sha3_family;
+  int         rc = 0;
+
+  /*
+   * 512/224 is in SHA512_224ShortMsg.rsp, 3-256 in SHA3_256ShortMsg.rsp
+   * and shake128 in SHAKE128ShortMsg.rsp
+   */
+  snprintf (prefix, sizeof (prefix), "%s%s",
+      algo->xof ? "" : "SHA", algo->name);
+  for (p = prefix; *p != '\0'; ++p) {
+    if (*p == '/' || *p == '-') {
+      *p = '_';
+    }
+    if (*p >= 'a' && *p <= 'z') {
+      *p = (char) (*p - 'a' + 'A');
+    }
+  }
+  snprintf (testfn, sizeof (testfn), "shatest_%s.bin",
+      prefix + (algo->xof ? 0 : 3));
+
+  for (i = 0; msgfiles [i] != NULL; ++i) {
+    snprintf (name, sizeof (name), "%s%s.rsp", prefix, msgfiles [i]);
+    if (rspload (dir, name, 0, 0, &vecs [i]) != 0) {
+      return 1;
+    }
+  }
+  katload (algo, &kats);
+  snprintf (name, sizeof (name), "%sMonte.rsp", prefix);
+  if (rspload (dir, name, 0, 0, &monte) != 0) {
+    return 1;
+  }
+  /*
+   * HMAC.rsp is for SHA-1 and SHA-2, and its sections go by digest
+   * length; 512/t has none of its own
+   */
+  memset (&hvecs, '\0', sizeof (hvecs));
+  if (! issha3 && strchr (algo->name, '/') == NULL &&
+      rspload (dir, "HMAC.rsp", algo->dlen, 1, &hvecs) != 0) {
+    return 1;
+  }
+
+  nnames = shabackendlist (algo->name, names, 20);
+  for (k = 0; k < nnames; ++k) {
+    if (shabackend (algo->name, names [k]) != 0) {
+      continue;
+    }
+    for (i = 0; msgfiles [i] != NULL; ++i) {
+      rc |= testmsg (algo, names [k], msgfiles [i], &vecs [i]);
+    }
+    if (kats.count > 0) {
+      rc |= testmsg (algo, names [k], "KAT", &kats);
+    }
+    if (issha3) {
+      rc |= testmonte3 (algo, names [k], "Monte", &monte);
+    } else {
+      rc |= testmonte (algo, names [k], "Monte", &monte);
+    }
+    if (hvecs.count > 0) {
+      rc |= testhmac (algo, names [k], &hvecs);
+    }
+  }
+  shabackend (algo->name, NULL);
+
+  nnames = shambbackendlist (algo->name, names, 20);
+  for (k = 0; k < nnames; ++k) {
+    if (shambbackend (algo->name, names [k]) != 0) {
+      continue;
+    }
+    rc |= testlist (algo, names [k], msgfiles [0], &vecs [0]);
+  }
+  shambbackend (algo->name, NULL);
+
+  for (i = 0; msgfiles [i] != NULL; ++i) {
+    vecfree (&vecs [i]);
+  }
+  vecfree (&kats);
+  vecfree (&monte);
+  vecfree (&hvecs);
+  remove (testfn);
+  return rc;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const shafamily_t **fam;
+  const shaalgo_t   *algo;
+  const char        *bits = NULL;
+  const char        *dir = "test.dir";
+  int               i;
+  int               rc = 0;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp (argv[i], "-bits") == 0 && i + 1 < argc) {
+      bits = argv[++i];
+    } else if (argv[i][0] != '-') {
+      dir = argv[i];
+    } else {
+      fprintf (stderr, "usage: %s [-bits <size>] [<test.dir>]\n", argv[0]);
+      exit (1);
+    }
+  }
+  if (bits != NULL && shaalgo (bits) == NULL) {
+    fprintf (stderr, "%s: unknown bits %s\n", argv[0], bits);
+    exit (1);
+  }
+
+  testline = malloc (TEST_MAXLINE);
+  for (fam = testfamilies; *fam != NULL; ++fam) {
+    for (algo = (*fam)->algos; algo->name != NULL; ++algo) {
+      if (bits == NULL || strcmp (bits, algo->name) == 0) {
+        rc |= testalgo (dir, algo);
+      }
+    }
+  }
+  free (testline);
+  return rc;
+}
@@ -13,8 +13,20 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
 #include <tcl.h>
 
+#if ! defined(ECANCELED)
+# define ECANCELED EINTR
+#endif
+
 #include "sha.h"
 
 static const char* OutputFormats[] = {
@@ -30,135 +42,3150 @@ enum OutputFormatsIndex {
     OutputFormatBase64Ix
 };
 
-/*
- * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
- */
-const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char* ShaOptions[] = {
+    "-algo",
+    "-async",
+    "-bits",
+    "-callback",
+    "-channel",
+    "-data",
+    "-databin",
+    "-datahex",
+    "-errors",
+    "-file",
+    "-files",
+    "-hmackey",
+    "-key",
+    "-keybin",
+    "-keyfile",
+    "-keyhex",
+    "-leafsize",
+    "-leaves",
+    "-list",
+    "-mac",
+    "-offset",
+    "-outlen",
+    "-output",
+    "-size",
+    "-threads",
+    "-tree",
+    "-verify",
+    NULL
+};
+
+enum ShaOptionsIndex {
+    ShaOptAlgoIx,
+    ShaOptAsyncIx,
+    ShaOptBitsIx,
+    ShaOptCallbackIx,
+    ShaOptChannelIx,
+    ShaOptDataIx,
+    ShaOptDatabinIx,
+    ShaOptDatahexIx,
+    ShaOptErrorsIx,
+    ShaOptFileIx,
+    ShaOptFilesIx,
+    ShaOptHmackeyIx,
+    ShaOptKeyIx,
+    ShaOptKeybinIx,
+    ShaOptKeyfileIx,
+    ShaOptKeyhexIx,
+    ShaOptLeafsizeIx,
+    ShaOptLeavesIx,
+    ShaOptListIx,
+    ShaOptMacIx,
+    ShaOptOffsetIx,
+    ShaOptOutlenIx,
+    ShaOptOutputIx,
+    ShaOptSizeIx,
+    ShaOptThreadsIx,
+    ShaOptTreeIx,
+    ShaOptVerifyIx
+};
+
+/*
+ * Allocates count items of size bytes, or returns NULL if there is not
+ * enough memory or the total does not fit the size Tcl_Alloc takes.
+ */
+static void *
+shaAttemptAlloc (size_t count, size_t size)
+{
+  if (size != 0 && count > (size_t) UINT_MAX / size) {
+    return NULL;
+  }
+  return (void *) attemptckalloc ((unsigned int) (count * size));
+}
+
+/*
+ * The -bits value keeps its algorithm descriptor as the internal
+ * representation, so a literal that is used again is not looked up.
+ * -algo is the same option; shaalgo() takes "sha1" as well as "1".
+ */
+static int shaBitsSetFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType shaBitsType = {
+  "sha-bits",
+  NULL,
+  NULL,
+  NULL,
+  shaBitsSetFromAny
+};
+
+static int
+shaBitsSetFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+  const shaalgo_t   *algo;
+  const char        *sz;
+
+  sz = Tcl_GetString (objPtr);
+  algo = shaalgo (sz);
+  if (algo == NULL) {
+    if (interp != NULL) {
+      Tcl_AppendResult (interp, "invalid bits \"", sz, "\"", NULL);
+    }
+    return TCL_ERROR;
+  }
+  if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+    objPtr->typePtr->freeIntRepProc (objPtr);
+  }
+  objPtr->internalRep.twoPtrValue.ptr1 = (void *) algo;
+  objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+  objPtr->typePtr = &shaBitsType;
+  return TCL_OK;
+}
+
+static int
+shaGetAlgoFromObj (Tcl_Interp *interp, Tcl_Obj *objPtr,
+    const shaalgo_t **algoPtr)
+{
+  if (objPtr->typePtr != &shaBitsType &&
+      shaBitsSetFromAny (interp, objPtr) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  *algoPtr = (const shaalgo_t *) objPtr->internalRep.twoPtrValue.ptr1;
+  return TCL_OK;
+}
+
+/*
+ * -outlen: a shake descriptor with a different digest length.  The
+ * copies are kept for the life of the process, named e.g.
+ * "shake128/100" so that cache entries stay apart.
+ */
+TCL_DECLARE_MUTEX(shaXofMutex)
+static int shaXofInit = 0;
+static Tcl_HashTable shaXofTable;
+
+static const shaalgo_t *
+shaXofAlgo (const shaalgo_t *algo, size_t outlen)
+{
+  Tcl_HashEntry     *hentry;
+  Tcl_DString       name;
+  shaalgo_t         *xalgo;
+  char              *nm;
+  char              tbuf [40];
+  int               isnew;
+
+  if (outlen == algo->dlen) {
+    return algo;
+  }
+  Tcl_DStringInit (&name);
+  Tcl_DStringAppend (&name, algo->name, -1);
+  sprintf (tbuf, "/%u", (unsigned int) outlen);
+  Tcl_DStringAppend (&name, tbuf, -1);
+
+  Tcl_MutexLock (&shaXofMutex);
+  if (! shaXofInit) {
+    Tcl_InitHashTable (&shaXofTable, TCL_STRING_KEYS);
+    shaXofInit = 1;
+  }
+  hentry = Tcl_CreateHashEntry (&shaXofTable, Tcl_DStringValue (&name),
+      &isnew);
+  if (isnew) {
+    xalgo = (shaalgo_t *) ckalloc (sizeof (shaalgo_t));
+    *xalgo = *algo;
+    nm = ckalloc (Tcl_DStringLength (&name) + 1);
+    strcpy (nm, Tcl_DStringValue (&name));
+    xalgo->name = nm;
+    xalgo->dlen = outlen;
+    Tcl_SetHashValue (hentry, (ClientData) xalgo);
+  }
+  xalgo = (shaalgo_t *) Tcl_GetHashValue (hentry);
+  Tcl_MutexUnlock (&shaXofMutex);
+  Tcl_DStringFree (&name);
+  return xalgo;
+}
+
+static int
+shaGetOutlenAlgo (Tcl_Interp *interp, const shaalgo_t *algo,
+    Tcl_Obj *outlenObj, const shaalgo_t **algoPtr)
+{
+  int               outlen;
+
+  *algoPtr = algo;
+  if (outlenObj == NULL) {
+    return TCL_OK;
+  }
+  if (! algo->xof) {
+    Tcl_AppendResult (interp, "-outlen is only valid for shake", NULL);
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIntFromObj (interp, outlenObj, &outlen) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (outlen < 1 || outlen > SHA_MAXOUTLEN) {
+    char    tbuf [40];
+
+    sprintf (tbuf, "%d", SHA_MAXOUTLEN);
+    Tcl_AppendResult (interp, "-outlen must be from 1 to ", tbuf, NULL);
+    return TCL_ERROR;
+  }
+  *algoPtr = shaXofAlgo (algo, (size_t) outlen);
+  return TCL_OK;
+}
+
+/* as shaalgo(), and also takes the "shake128/100" names used above */
+static const shaalgo_t *
+shaAlgoByName (const char *name)
+{
+  const shaalgo_t   *algo;
+  const char        *p;
+  char              base [20];
+  char              *end;
+  unsigned long     outlen;
+
+  algo = shaalgo (name);
+  p = strrchr (name, '/');
+  if (algo != NULL || p == NULL || (size_t) (p - name) >= sizeof (base)) {
+    return algo;
+  }
+  memcpy (base, name, p - name);
+  base [p - name] = '\0';
+  algo = shaalgo (base);
+  outlen = strtoul (p + 1, &end, 10);
+  if (algo == NULL || ! algo->xof || *end != '\0' ||
+      outlen < 1 || outlen > SHA_MAXOUTLEN) {
+    return NULL;
+  }
+  return shaXofAlgo (algo, (size_t) outlen);
+}
+
+/*
+ * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
+ */
+const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
+ */
+size_t b64_encoded_size(size_t inlen)
+{
+    size_t ret;
+
+    ret = inlen;
+    if (inlen % 3 != 0)
+        ret += 3 - (inlen % 3);
+    ret /= 3;
+    ret *= 4;
+
+    return ret;
+}
+
+/*
+ * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
+ * out must have room for b64_encoded_size(len) + 1 bytes.
+ */
+static void b64_encode(const unsigned char* in, size_t len, char* out)
+{
+    size_t  i;
+    size_t  j;
+    size_t  v;
+
+    for (i = 0, j = 0; i < len; i += 3, j += 4) {
+        v = in[i];
+        v = i + 1 < len ? v << 8 | in[i + 1] : v << 8;
+        v = i + 2 < len ? v << 8 | in[i + 2] : v << 8;
+
+        out[j] = b64chars[(v >> 18) & 0x3F];
+        out[j + 1] = b64chars[(v >> 12) & 0x3F];
+        out[j + 2] = i + 1 < len ? b64chars[(v >> 6) & 0x3F] : '=';
+        out[j + 3] = i + 2 < len ? b64chars[v & 0x3F] : '=';
+    }
+    out[j] = '\0';
+}
+
+/*
+ * Decodes at most max bytes.  Returns the decoded length, or -1 if
+ * the input is not base64 or does not fit.
+ */
+static int b64_decode(const char* in, size_t len, unsigned char* out, size_t max)
+{
+    const char* p;
+    size_t  i;
+    size_t  j;
+    size_t  v;
+    int     n;
+
+    if (len % 4 != 0) {
+        return -1;
+    }
+    for (i = 0, j = 0; i < len; i += 4) {
+        v = 0;
+        for (n = 0; n < 4; n++) {
+            /* padding: "xx==" or "xxx=" at the end */
+            if (in[i + n] == '=' && i + 4 == len && n >= 2 &&
+                    (n == 3 || in[i + 3] == '=')) {
+                break;
+            }
+            p = strchr(b64chars, in[i + n]);
+            if (in[i + n] == '\0' || p == NULL) {
+                return -1;
+            }
+            v |= (size_t) (p - b64chars) << (18 - 6 * n);
+        }
+        if (j + n - 1 > max) {
+            return -1;
+        }
+        out[j++] = (v >> 16) & 0xFF;
+        if (n > 2) {
+            out[j++] = (v >> 8) & 0xFF;
+        }
+        if (n > 3) {
+            out[j++] = v & 0xFF;
+        }
+    }
+    return (int) j;
+}
+
+/*
+ * Gracefully taken from https://nachtimwald.com/2017/09/24/hex-encode-and-decode-in-c/
+ */
+static int hexchr2bin(const char hex, char* out)
+{
+    if (out == NULL)
+        return 0;
+
+    if (hex >= '0' && hex <= '9') {
+        *out = hex - '0';
+    }
+    else if (hex >= 'A' && hex <= 'F') {
+        *out = hex - 'A' + 10;
+    }
+    else if (hex >= 'a' && hex <= 'f') {
+        *out = hex - 'a' + 10;
+    }
+    else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Gracefully taken from https://nachtimwald.com/2017/09/24/hex-encode-and-decode-in-c/
+ */
+static int hexs2bin(const char* hex, char** out, int* doFree)
+{
+    size_t len;
+    char   b1;
+    char   b2;
+    size_t i;
+
+    if (hex == NULL || *hex == '\0' || out == NULL) {
+        return 0;
+    }
+
+    len = strlen(hex);
+    if (len % 2 != 0) {
+        return 0;
+    }
+    len /= 2;
+
+    *out = ckalloc(len);
+    *doFree = 1;
+    memset(*out, 'A', len);
+    for (i = 0; i < len; i++) {
+        if (!hexchr2bin(hex[i * 2], &b1) || !hexchr2bin(hex[i * 2 + 1], &b2)) {
+            return 0;
+        }
+        (*out)[i] = (b1 << 4) | b2;
+    }
+    return len;
+}
+
+/*
+ * Returns the byte array storage of the object itself; nothing is
+ * copied.  The pointer is only good until the object changes type,
+ * so callers fetch it after any other argument has been converted.
+ */
+static int convert_to_binary(Tcl_Obj* tclObj, char** bufOut, int* doFree) {
+    int len;
+    *bufOut = (char*) Tcl_GetByteArrayFromObj(tclObj, &len);
+    *doFree = 0;
+    return len;
+}
+
+typedef struct {
+  Tcl_Command       token;
+  const shaalgo_t   *algo;
+  shactx_t          *ctx;         /* set for a plain hash               */
+  hmacctx_t         *hctx;        /* set for an hmac                    */
+} shaCtxData;
+
+static const char* CtxSubCmds[] = {
+    "copy",
+    "destroy",
+    "digest",
+    "reset",
+    "update",
+    NULL
+};
+
+enum CtxSubCmdsIndex {
+    CtxCopyIx,
+    CtxDestroyIx,
+    CtxDigestIx,
+    CtxResetIx,
+    CtxUpdateIx
+};
+
+static int shaCtxObjCmd (ClientData cd, Tcl_Interp* interp,
+    int objc, Tcl_Obj * const objv[]);
+
+static Tcl_Obj *
+shaDigestObj (buff_t *digest, size_t dlen, int outputFormatIdx)
+{
+  static const char hexchars [] = "0123456789abcdef";
+  Tcl_Obj           *res;
+  char              hex [SHA_DIGESTSIZE];
+  char              b64 [(SHA_MAXOUTLEN + 2) / 3 * 4 + 1];
+  char              *buf;
+  size_t            i;
+
+  switch (outputFormatIdx) {
+    case OutputFormatBinaryIx: {
+      res = Tcl_NewByteArrayObj (digest, (int) dlen);
+      break;
+    }
+    case OutputFormatBase64Ix: {
+      /* only a long sha::pbkdf2 key needs more than SHA_MAXOUTLEN */
+      buf = dlen > SHA_MAXOUTLEN ? ckalloc (b64_encoded_size (dlen) + 1) : b64;
+      b64_encode (digest, dlen, buf);
+      res = Tcl_NewStringObj (buf, -1);
+      if (buf != b64) {
+        ckfree (buf);
+      }
+      break;
+    }
+    case OutputFormatHexIx:
+    default: {
+      buf = dlen > SHA_MAXOUTLEN ? ckalloc (dlen * 2) : hex;
+      for (i = 0; i < dlen; ++i) {
+        buf [i * 2] = hexchars [digest [i] >> 4];
+        buf [i * 2 + 1] = hexchars [digest [i] & 0x0f];
+      }
+      res = Tcl_NewStringObj (buf, (int) (dlen * 2));
+      if (buf != hex) {
+        ckfree (buf);
+      }
+      break;
+    }
+  }
+  return res;
+}
+
+/*
+ * Sets the digest as the result or, with -verify, whether it is the
+ * same as verifyObj, which is in the -output format.
+ */
+static int
+shaDigestResult (Tcl_Interp *interp, buff_t *digest, size_t dlen,
+    int outputFormatIdx, Tcl_Obj *verifyObj)
+{
+  buff_t            ebuf [SHA_MAXOUTLEN];
+  const buff_t      *expected = ebuf;
+  char              *str;
+  char              b1;
+  char              b2;
+  int               len;
+  int               elen = 0;
+  int               i;
+
+  if (verifyObj == NULL) {
+    Tcl_SetObjResult (interp, shaDigestObj (digest, dlen, outputFormatIdx));
+    return TCL_OK;
+  }
+
+  switch (outputFormatIdx) {
+    case OutputFormatBinaryIx: {
+      expected = Tcl_GetByteArrayFromObj (verifyObj, &elen);
+      break;
+    }
+    case OutputFormatBase64Ix: {
+      str = Tcl_GetStringFromObj (verifyObj, &len);
+      elen = b64_decode (str, (size_t) len, ebuf, sizeof (ebuf));
+      break;
+    }
+    case OutputFormatHexIx:
+    default: {
+      str = Tcl_GetStringFromObj (verifyObj, &len);
+      elen = len % 2 == 0 && len / 2 <= (int) sizeof (ebuf) ? len / 2 : -1;
+      for (i = 0; i < elen; ++i) {
+        if (! hexchr2bin (str [i * 2], &b1) ||
+            ! hexchr2bin (str [i * 2 + 1], &b2)) {
+          elen = -1;
+          break;
+        }
+        ebuf [i] = (buff_t) ((b1 << 4) | b2);
+      }
+      break;
+    }
+  }
+  if (elen < 0) {
+    Tcl_AppendResult (interp, "invalid digest \"",
+        Tcl_GetString (verifyObj), "\"", NULL);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult (interp, Tcl_NewBooleanObj (
+      shaverify (digest, dlen, expected, (size_t) elen)));
+  return TCL_OK;
+}
+
+static void
+shaCtxDelete (ClientData cd)
+{
+  shaCtxData        *cdata = (shaCtxData *) cd;
+
+  if (cdata->ctx != NULL) {
+    shafree (cdata->ctx);
+  }
+  if (cdata->hctx != NULL) {
+    hmacfree (cdata->hctx);
+  }
+  ckfree ((char *) cdata);
+}
+
+static int
+shaCtxRegister (Tcl_Interp *interp, shaCtxData *cdata,
+    const char *prefix, Tcl_ObjCmdProc *proc)
+{
+  static unsigned long  ctxcount = 0;
+  char                  name [40];
+  Tcl_CmdInfo           info;
+
+  do {
+    sprintf (name, "%s%lu", prefix, ++ctxcount);
+  } while (Tcl_GetCommandInfo (interp, name, &info));
+  cdata->token = Tcl_CreateObjCommand (interp, name, proc,
+      (ClientData) cdata, shaCtxDelete);
+  Tcl_SetObjResult (interp, Tcl_NewStringObj (name, -1));
+  return TCL_OK;
+}
+
+static int
+shaCtxMake (Tcl_Interp *interp, const shaalgo_t *algo, int ismac,
+    char *key, int klen, int keyisfile, shaCtxData **cdataPtr)
+{
+  shaCtxData        *cdata;
+
+  if (ismac && algo->xof) {
+    Tcl_AppendResult (interp, "hmac is not defined for ", algo->name, NULL);
+    return TCL_ERROR;
+  }
+  cdata = (shaCtxData *) ckalloc (sizeof (shaCtxData));
+  cdata->token = NULL;
+  cdata->algo = algo;
+  cdata->ctx = NULL;
+  cdata->hctx = NULL;
+  if (ismac) {
+    buff_t    kbuf [SHA_MAXBLOCKSIZE];
+    size_t    kflen;
+
+    if (keyisfile) {
+      if (algo->fam->keyfile (algo, key, kbuf, &kflen) != 0) {
+        ckfree ((char *) cdata);
+        Tcl_AppendResult (interp, "unable to read key file \"", key, "\"", NULL);
+        return TCL_ERROR;
+      }
+      cdata->hctx = hmacnewalgo (algo, kbuf, kflen);
+    } else {
+      cdata->hctx = hmacnewalgo (algo, (buff_t *) key, (size_t) klen);
+    }
+  } else {
+    cdata->ctx = shanewalgo (algo);
+  }
+  if (cdata->ctx == NULL && cdata->hctx == NULL) {
+    ckfree ((char *) cdata);
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    return TCL_ERROR;
+  }
+
+  *cdataPtr = cdata;
+  return TCL_OK;
+}
+
+static int
+shaCtxClone (Tcl_Interp *interp, shaCtxData *cdata, shaCtxData **cdataPtr)
+{
+  shaCtxData        *ncdata;
+
+  ncdata = (shaCtxData *) ckalloc (sizeof (shaCtxData));
+  ncdata->token = NULL;
+  ncdata->algo = cdata->algo;
+  ncdata->ctx = NULL;
+  ncdata->hctx = NULL;
+  if (cdata->hctx != NULL) {
+    ncdata->hctx = hmacclone (cdata->hctx);
+  } else {
+    ncdata->ctx = shaclone (cdata->ctx);
+  }
+  if (ncdata->ctx == NULL && ncdata->hctx == NULL) {
+    ckfree ((char *) ncdata);
+    Tcl_SetResult (interp, "out of memory", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  *cdataPtr = ncdata;
+  return TCL_OK;
+}
+
+/*
+ * Parses -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key>|-keyfile <fn>} -mac hmac]
+ * starting at objv[argidx] and allocates the matching context.  With
+ * ismac set a key is required and -mac is not accepted.
+ */
+static int
+shaCtxNew (Tcl_Interp* interp, int objc, Tcl_Obj * const objv[],
+    int argidx, int wrongidx, const char *usagestr, int ismac,
+    shaCtxData **cdataPtr)
+{
+  Tcl_Obj           *bitsObj = NULL;
+  Tcl_Obj           *outlenObj = NULL;
+  Tcl_Obj           *keyBinObj = NULL;
+  const shaalgo_t   *algo;
+  char              *key = NULL;
+  int               keyDynAlloc = 0;
+  int               klen = 0;
+  int               keyisfile = 0;
+  int               havemac = ismac ? 1 : 0;
+  int               optIdx;
+  int               rc;
+
+  for ( ; argidx < objc; argidx += 2) {
+    if (argidx + 1 >= objc ||
+        Tcl_GetIndexFromObj (NULL, objv[argidx], ShaOptions, "option",
+        TCL_EXACT, &optIdx) != TCL_OK) {
+      optIdx = -1;
+    }
+    if ((optIdx == ShaOptKeyIx || optIdx == ShaOptKeybinIx ||
+        optIdx == ShaOptKeyhexIx || optIdx == ShaOptKeyfileIx) &&
+        (key != NULL || keyBinObj != NULL)) {
+      optIdx = -1;
+    }
+    switch (optIdx) {
+    case ShaOptAlgoIx:
+    case ShaOptBitsIx:
+      bitsObj = objv[argidx + 1];
+      break;
+    case ShaOptOutlenIx:
+      outlenObj = objv[argidx + 1];
+      break;
+    case ShaOptKeyIx:
+      key = Tcl_GetStringFromObj (objv[argidx + 1], &klen);
+      havemac += 1;
+      break;
+    case ShaOptKeybinIx:
+      keyBinObj = objv[argidx + 1];
+      havemac += 1;
+      break;
+    case ShaOptKeyhexIx:
+      klen = hexs2bin (Tcl_GetString (objv[argidx + 1]), &key, &keyDynAlloc);
+      havemac += 1;
+      break;
+    case ShaOptKeyfileIx:
+      key = Tcl_GetStringFromObj (objv[argidx + 1], &klen);
+      keyisfile = 1;
+      havemac += 1;
+      break;
+    case ShaOptMacIx:
+      if (! ismac && strcmp (Tcl_GetString (objv[argidx + 1]), "hmac") == 0) {
+        havemac += 1;
+        break;
+      }
+      /* fall through */
+    default:
+      Tcl_WrongNumArgs (interp, wrongidx, objv, usagestr);
+      rc = TCL_ERROR;
+      goto cleanupFinish;
+    }
+  }
+
+  if (bitsObj == NULL || (havemac != 0 && havemac != 2)) {
+    Tcl_WrongNumArgs (interp, wrongidx, objv, usagestr);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if (shaGetAlgoFromObj (interp, bitsObj, &algo) != TCL_OK ||
+      shaGetOutlenAlgo (interp, algo, outlenObj, &algo) != TCL_OK) {
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if (keyBinObj != NULL) {
+    klen = convert_to_binary (keyBinObj, &key, &keyDynAlloc);
+  }
+
+  rc = shaCtxMake (interp, algo, havemac == 2, key, klen, keyisfile, cdataPtr);
+
+cleanupFinish:
+  if (keyDynAlloc) {
+    ckfree (key);
+  }
+  return rc;
+}
+
+static void
+shaCtxUpdate (shaCtxData *cdata, const buff_t *buf, size_t blen)
+{
+  if (cdata->hctx != NULL) {
+    hmacupdate (cdata->hctx, buf, blen);
+  } else {
+    shaupdate (cdata->ctx, buf, blen);
+  }
+}
+
+/* finishes a copy so that more data may still be added */
+static int
+shaCtxDigest (Tcl_Interp *interp, shaCtxData *cdata, int outputFormatIdx,
+    Tcl_Obj *verifyObj)
+{
+  buff_t            digest [SHA_MAXOUTLEN];
+  size_t            dlen;
+
+  if (cdata->hctx != NULL) {
+    hmacctx_t   *hctx = hmacclone (cdata->hctx);
+
+    if (hctx == NULL) {
+      Tcl_SetResult (interp, "out of memory", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    hmacfinal (hctx, digest, &dlen);
+    hmacfree (hctx);
+  } else {
+    shactx_t    *ctx = shaclone (cdata->ctx);
+
+    if (ctx == NULL) {
+      Tcl_SetResult (interp, "out of memory", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    shafinal (ctx, digest, &dlen);
+    shafree (ctx);
+  }
+  return shaDigestResult (interp, digest, dlen, outputFormatIdx, verifyObj);
+}
+
+/*
+ * sha create -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key>|-keyfile <fn>} -mac hmac]
+ */
+static int
+shaCreateCmd (Tcl_Interp* interp, int objc, Tcl_Obj * const objv[])
+{
+  shaCtxData        *cdata;
+
+  if (shaCtxNew (interp, objc, objv, 2, 1,
+      "create -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key in hex format>|-keyfile <fn>} -mac hmac]",
+      0, &cdata) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  return shaCtxRegister (interp, cdata, "::sha::ctx", shaCtxObjCmd);
+}
+
+/*
+ * $ctx update ?-data|-databin|-datahex? <data>
+ * $ctx digest ?-output hex|base64|binary?
+ * $ctx copy
+ * $ctx reset
+ * $ctx destroy
+ */
+static int
+shaCtxObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  shaCtxData        *cdata = (shaCtxData *) cd;
+  shaCtxData        *ncdata;
+  int               cmdIdx;
+  int               outputFormatIdx = OutputFormatHexIx;
+  char              *dbuf;
+  char              *opt;
+  int               len;
+  int               dataDynAlloc = 0;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj (interp, objv[1], CtxSubCmds, "subcommand", 0,
+      &cmdIdx) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch (cmdIdx) {
+    case CtxUpdateIx: {
+      if (objc == 3) {
+        dbuf = Tcl_GetStringFromObj (objv[2], &len);
+      } else if (objc == 4) {
+        opt = Tcl_GetString (objv[2]);
+        if (strcmp (opt, "-data") == 0) {
+          dbuf = Tcl_GetStringFromObj (objv[3], &len);
+        } else if (strcmp (opt, "-databin") == 0) {
+          len = convert_to_binary (objv[3], &dbuf, &dataDynAlloc);
+        } else if (strcmp (opt, "-datahex") == 0) {
+          len = hexs2bin (Tcl_GetString (objv[3]), &dbuf, &dataDynAlloc);
+        } else {
+          Tcl_WrongNumArgs (interp, 2, objv, "?-data|-databin|-datahex? data");
+          return TCL_ERROR;
+        }
+      } else {
+        Tcl_WrongNumArgs (interp, 2, objv, "?-data|-databin|-datahex? data");
+        return TCL_ERROR;
+      }
+      shaCtxUpdate (cdata, (buff_t *) dbuf, (size_t) len);
+      if (dataDynAlloc) {
+        ckfree (dbuf);
+      }
+      break;
+    }
+    case CtxDigestIx: {
+      if (objc == 4 && strcmp (Tcl_GetString (objv[2]), "-output") == 0) {
+        if (Tcl_GetIndexFromObj (interp, objv[3], OutputFormats, "format", 0,
+            &outputFormatIdx) != TCL_OK) {
+          return TCL_ERROR;
+        }
+      } else if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, "?-output hex|base64|binary?");
+        return TCL_ERROR;
+      }
+      return shaCtxDigest (interp, cdata, outputFormatIdx, NULL);
+    }
+    case CtxCopyIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      if (shaCtxClone (interp, cdata, &ncdata) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      return shaCtxRegister (interp, ncdata, "::sha::ctx", shaCtxObjCmd);
+    }
+    case CtxResetIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      if (cdata->hctx != NULL) {
+        hmacreset (cdata->hctx);
+      } else {
+        shareset (cdata->ctx);
+      }
+      break;
+    }
+    case CtxDestroyIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_DeleteCommandFromToken (interp, cdata->token);
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+/*
+ * sha::hmackey -bits <bits> {-key <key>|-keybin <key>|-keyhex <key>|-keyfile <fn>}
+ *
+ * The key is padded and the inner and outer blocks are compressed
+ * once; sha -hmackey then only hashes the message.
+ *
+ * $key destroy
+ */
+static int
+shaHmacKeyObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  shaCtxData        *cdata = (shaCtxData *) cd;
+
+  if (objc != 2 || strcmp (Tcl_GetString (objv[1]), "destroy") != 0) {
+    Tcl_WrongNumArgs (interp, 1, objv, "destroy");
+    return TCL_ERROR;
+  }
+  Tcl_DeleteCommandFromToken (interp, cdata->token);
+  return TCL_OK;
+}
+
+static int
+shaHmacKeyCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  shaCtxData        *cdata;
+
+  if (shaCtxNew (interp, objc, objv, 1, 1,
+      "-bits <bits> {-key <key>|-keybin <key>|-keyhex <key in hex format>|-keyfile <fn>}",
+      1, &cdata) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  return shaCtxRegister (interp, cdata, "::sha::hmackey", shaHmacKeyObjCmd);
+}
+
+static int
+shaHmacKeyFind (Tcl_Interp *interp, Tcl_Obj *keyObj, shaCtxData **cdataPtr)
+{
+  Tcl_CmdInfo       info;
+
+  if (! Tcl_GetCommandInfo (interp, Tcl_GetString (keyObj), &info) ||
+      info.objProc != shaHmacKeyObjCmd) {
+    Tcl_AppendResult (interp, "invalid hmac key \"",
+        Tcl_GetString (keyObj), "\"", NULL);
+    return TCL_ERROR;
+  }
+  *cdataPtr = (shaCtxData *) info.objClientData;
+  return TCL_OK;
+}
+
+/*
+ * hmac of -data or -file with a sha::hmackey.  The key's inner
+ * context is used and then restored from the saved state, so the
+ * key can be cloned for -files, -channel and -async.
+ */
+static int
+shaHmacKeyHash (Tcl_Interp *interp, shaCtxData *cdata, char *fn,
+    char *dbuf, size_t blen, int outputFormatIdx, Tcl_Obj *verifyObj)
+{
+  buff_t            digest [SHA_MAXOUTLEN];
+  size_t            dlen;
+  int               rc;
+
+  if (fn != NULL) {
+    errno = 0;
+    rc = hmacupdatefile (cdata->hctx, fn, NULL);
+    if (rc != 0) {
+      hmacreset (cdata->hctx);
+      Tcl_SetErrno (errno != 0 ? errno : (rc == 1 ? ENOMEM : EIO));
+      Tcl_AppendResult (interp, "unable to read file \"", fn, "\": ",
+          Tcl_PosixError (interp), NULL);
+      return TCL_ERROR;
+    }
+  } else {
+    hmacupdate (cdata->hctx, (buff_t *) dbuf, blen);
+  }
+  hmacfinal (cdata->hctx, digest, &dlen);
+  hmacreset (cdata->hctx);
+  return shaDigestResult (interp, digest, dlen, outputFormatIdx, verifyObj);
+}
+
+/*
+ * Channel transform: bytes pass through unchanged and are added to
+ * the context in both directions.
+ */
+typedef struct {
+  Tcl_Channel       self;
+  Tcl_Channel       parent;
+  shaCtxData        *cdata;
+} shaChanData;
+
+static int
+shaChanClose (ClientData instanceData, Tcl_Interp *interp)
+{
+  shaChanData       *chdata = (shaChanData *) instanceData;
+
+  shaCtxDelete ((ClientData) chdata->cdata);
+  ckfree ((char *) chdata);
+  return 0;
+}
+
+static int
+shaChanInput (ClientData instanceData, char *buf, int toRead, int *errorCodePtr)
+{
+  shaChanData       *chdata = (shaChanData *) instanceData;
+  int               len;
+
+  len = Tcl_ReadRaw (chdata->parent, buf, toRead);
+  if (len < 0) {
+    *errorCodePtr = Tcl_GetErrno ();
+    return -1;
+  }
+  shaCtxUpdate (chdata->cdata, (buff_t *) buf, (size_t) len);
+  return len;
+}
+
+static int
+shaChanOutput (ClientData instanceData, const char *buf, int toWrite,
+    int *errorCodePtr)
+{
+  shaChanData       *chdata = (shaChanData *) instanceData;
+  int               len;
+
+  len = Tcl_WriteRaw (chdata->parent, buf, toWrite);
+  if (len < 0) {
+    *errorCodePtr = Tcl_GetErrno ();
+    return -1;
+  }
+  shaCtxUpdate (chdata->cdata, (buff_t *) buf, (size_t) len);
+  return len;
+}
+
+static int
+shaChanSetOption (ClientData instanceData, Tcl_Interp *interp,
+    const char *optionName, const char *value)
+{
+  shaChanData             *chdata = (shaChanData *) instanceData;
+  Tcl_DriverSetOptionProc *setOptionProc;
+
+  setOptionProc = Tcl_ChannelSetOptionProc (Tcl_GetChannelType (chdata->parent));
+  if (setOptionProc == NULL) {
+    return Tcl_BadChannelOption (interp, optionName, "");
+  }
+  return setOptionProc (Tcl_GetChannelInstanceData (chdata->parent),
+      interp, optionName, value);
+}
+
+static int
+shaChanGetOption (ClientData instanceData, Tcl_Interp *interp,
+    const char *optionName, Tcl_DString *dsPtr)
+{
+  shaChanData             *chdata = (shaChanData *) instanceData;
+  Tcl_DriverGetOptionProc *getOptionProc;
+
+  getOptionProc = Tcl_ChannelGetOptionProc (Tcl_GetChannelType (chdata->parent));
+  if (getOptionProc == NULL) {
+    if (optionName == NULL) {
+      return TCL_OK;
+    }
+    return Tcl_BadChannelOption (interp, optionName, "");
+  }
+  return getOptionProc (Tcl_GetChannelInstanceData (chdata->parent),
+      interp, optionName, dsPtr);
+}
+
+static void
+shaChanWatch (ClientData instanceData, int mask)
+{
+  shaChanData         *chdata = (shaChanData *) instanceData;
+  Tcl_DriverWatchProc *watchProc;
+
+  watchProc = Tcl_ChannelWatchProc (Tcl_GetChannelType (chdata->parent));
+  watchProc (Tcl_GetChannelInstanceData (chdata->parent), mask);
+}
+
+static int
+shaChanGetHandle (ClientData instanceData, int direction, ClientData *handlePtr)
+{
+  shaChanData       *chdata = (shaChanData *) instanceData;
+
+  return Tcl_GetChannelHandle (chdata->parent, direction, handlePtr);
+}
+
+static int
+shaChanBlockMode (ClientData instanceData, int mode)
+{
+  shaChanData             *chdata = (shaChanData *) instanceData;
+  Tcl_DriverBlockModeProc *blockModeProc;
+
+  blockModeProc = Tcl_ChannelBlockModeProc (Tcl_GetChannelType (chdata->parent));
+  if (blockModeProc == NULL) {
+    return 0;
+  }
+  return blockModeProc (Tcl_GetChannelInstanceData (chdata->parent), mode);
+}
+
+static int
+shaChanHandler (ClientData instanceData, int interestMask)
+{
+  return interestMask;
+}
+
+static Tcl_ChannelType shaChannelType = {
+  "sha",
+  TCL_CHANNEL_VERSION_4,
+  shaChanClose,
+  shaChanInput,
+  shaChanOutput,
+  NULL,                 /* seekProc */
+  shaChanSetOption,
+  shaChanGetOption,
+  shaChanWatch,
+  shaChanGetHandle,
+  NULL,                 /* close2Proc */
+  shaChanBlockMode,
+  NULL,                 /* flushProc */
+  shaChanHandler,
+  NULL,                 /* wideSeekProc */
+  NULL,                 /* threadActionProc */
+  NULL                  /* truncateProc */
+};
+
+static int
+shaChanFind (Tcl_Interp *interp, Tcl_Obj *chanObj, Tcl_Channel *chanPtr)
+{
+  Tcl_Channel       chan;
+  int               mode;
+
+  chan = Tcl_GetChannel (interp, Tcl_GetString (chanObj), &mode);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+  chan = Tcl_GetTopChannel (chan);
+  if (Tcl_GetChannelType (chan) != &shaChannelType) {
+    Tcl_AppendResult (interp, "channel \"", Tcl_GetString (chanObj),
+        "\" has no sha transform", NULL);
+    return TCL_ERROR;
+  }
+  *chanPtr = chan;
+  return TCL_OK;
+}
+
+/*
+ * sha::stack <chan> -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key>|-keyfile <fn>} -mac hmac]
+ */
+static int
+shaStackObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  Tcl_Channel       chan;
+  int               mode;
+  shaChanData       *chdata;
+  shaCtxData        *cdata;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv,
+        "channel -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key in hex format>|-keyfile <fn>} -mac hmac]");
+    return TCL_ERROR;
+  }
+  chan = Tcl_GetChannel (interp, Tcl_GetString (objv[1]), &mode);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+  if (shaCtxNew (interp, objc, objv, 2, 1,
+      "channel -bits <bits> [-outlen <n>] [{-key <key>|-keybin <key>|-keyhex <key in hex format>|-keyfile <fn>} -mac hmac]",
+      0, &cdata) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  chdata = (shaChanData *) ckalloc (sizeof (shaChanData));
+  chdata->cdata = cdata;
+  chdata->self = Tcl_StackChannel (interp, &shaChannelType,
+      (ClientData) chdata, mode, chan);
+  if (chdata->self == NULL) {
+    shaCtxDelete ((ClientData) cdata);
+    ckfree ((char *) chdata);
+    return TCL_ERROR;
+  }
+  chdata->parent = Tcl_GetStackedChannel (chdata->self);
+  Tcl_SetObjResult (interp, objv[1]);
+  return TCL_OK;
+}
+
+/*
+ * sha::digest <chan> ?-output hex|base64|binary?
+ * sha::unstack <chan> ?-output hex|base64|binary?
+ */
+static int
+shaChanDigestObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  int               unstack = (cd != NULL);
+  Tcl_Channel       chan;
+  shaChanData       *chdata;
+  int               outputFormatIdx = OutputFormatHexIx;
+  Tcl_Obj           *res;
+
+  if (objc == 4 && strcmp (Tcl_GetString (objv[2]), "-output") == 0) {
+    if (Tcl_GetIndexFromObj (interp, objv[3], OutputFormats, "format", 0,
+        &outputFormatIdx) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  } else if (objc != 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "channel ?-output hex|base64|binary?");
+    return TCL_ERROR;
+  }
+  if (shaChanFind (interp, objv[1], &chan) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  chdata = (shaChanData *) Tcl_GetChannelInstanceData (chan);
+
+  /* pending output must reach the transform before the digest is taken */
+  if ((Tcl_GetChannelMode (chan) & TCL_WRITABLE) == TCL_WRITABLE &&
+      Tcl_Flush (chan) != TCL_OK) {
+    Tcl_AppendResult (interp, "error flushing \"", Tcl_GetString (objv[1]),
+        "\": ", Tcl_PosixError (interp), NULL);
+    return TCL_ERROR;
+  }
+  if (shaCtxDigest (interp, chdata->cdata, outputFormatIdx, NULL) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (unstack) {
+    res = Tcl_GetObjResult (interp);
+    Tcl_IncrRefCount (res);
+    if (Tcl_UnstackChannel (interp, chan) != TCL_OK) {
+      Tcl_DecrRefCount (res);
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult (interp, res);
+    Tcl_DecrRefCount (res);
+  }
+  return TCL_OK;
+}
+
+/*
+ * Hashes -size bytes (all if negative) of an open channel starting
+ * at -offset (the current position if negative).
+ */
+static int
+shaChanHash (Tcl_Interp *interp, Tcl_Obj *chanObj,
+    Tcl_WideInt offset, Tcl_WideInt size,
+    shaCtxData *cdata, int outputFormatIdx, Tcl_Obj *verifyObj)
+{
+  Tcl_Channel       chan;
+  int               mode;
+  size_t            maxbuff = 1024 * 1024;
+  char              *buf;
+  int               toread;
+  int               len;
+  int               rc = TCL_OK;
+
+  chan = Tcl_GetChannel (interp, Tcl_GetString (chanObj), &mode);
+  if (chan == NULL) {
+    return TCL_ERROR;
+  }
+  if ((mode & TCL_READABLE) != TCL_READABLE) {
+    Tcl_AppendResult (interp, "channel \"", Tcl_GetString (chanObj),
+        "\" wasn't opened for reading", NULL);
+    return TCL_ERROR;
+  }
+  if (offset >= 0 && Tcl_Seek (chan, offset, SEEK_SET) < 0) {
+    Tcl_AppendResult (interp, "error during seek on \"",
+        Tcl_GetString (chanObj), "\": ", Tcl_PosixError (interp), NULL);
+    return TCL_ERROR;
+  }
+
+  buf = ckalloc (maxbuff);
+  while (size != 0) {
+    toread = (int) maxbuff;
+    if (size > 0 && size < (Tcl_WideInt) maxbuff) {
+      toread = (int) size;
+    }
+    len = Tcl_ReadRaw (chan, buf, toread);
+    if (len < 0) {
+      Tcl_AppendResult (interp, "error reading \"", Tcl_GetString (chanObj),
+          "\": ", Tcl_PosixError (interp), NULL);
+      rc = TCL_ERROR;
+      break;
+    }
+    if (len == 0) {
+      if (Tcl_Eof (chan)) {
+        if (size > 0) {
+          Tcl_AppendResult (interp, "short read on \"",
+              Tcl_GetString (chanObj), "\"", NULL);
+          rc = TCL_ERROR;
+        }
+        break;
+      }
+      if (Tcl_InputBlocked (chan)) {
+        Tcl_AppendResult (interp, "channel \"", Tcl_GetString (chanObj),
+            "\" is non-blocking", NULL);
+        rc = TCL_ERROR;
+        break;
+      }
+      continue;
+    }
+    shaCtxUpdate (cdata, (buff_t *) buf, (size_t) len);
+    if (size > 0) {
+      size -= len;
+    }
+  }
+  ckfree (buf);
+
+  if (rc == TCL_OK) {
+    rc = shaCtxDigest (interp, cdata, outputFormatIdx, verifyObj);
+  }
+  return rc;
+}
+
+/*
+ * Hashes each element of a list as a separate message, several at
+ * a time when a multi-buffer engine is available.
+ */
+static int
+shaListHash (Tcl_Interp *interp, const shaalgo_t *algo, Tcl_Obj *listObj,
+    int outputFormatIdx)
+{
+  Tcl_Obj           **elems;
+  int               count;
+  const buff_t      **bufs;
+  size_t            *blens;
+  buff_t            *digests;
+  size_t            dlen;
+  int               len;
+  int               i;
+  Tcl_Obj           *res;
+
+  if (Tcl_ListObjGetElements (interp, listObj, &count, &elems) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  bufs = shaAttemptAlloc ((size_t) count + 1, sizeof (buff_t *));
+  blens = shaAttemptAlloc ((size_t) count + 1, sizeof (size_t));
+  digests = shaAttemptAlloc ((size_t) count + 1, algo->dlen);
+  if (bufs == NULL || blens == NULL || digests == NULL) {
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    ckfree ((char *) bufs);
+    ckfree ((char *) blens);
+    ckfree ((char *) digests);
+    return TCL_ERROR;
+  }
+  for (i = 0; i < count; ++i) {
+    bufs[i] = (buff_t *) Tcl_GetStringFromObj (elems[i], &len);
+    blens[i] = (size_t) len;
+  }
+
+  if (algo->fam->hashlist (algo, (size_t) count, bufs, blens,
+      digests, &dlen) != 0) {
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    ckfree ((char *) bufs);
+    ckfree ((char *) blens);
+    ckfree ((char *) digests);
+    return TCL_ERROR;
+  }
+
+  res = Tcl_NewListObj (0, NULL);
+  for (i = 0; i < count; ++i) {
+    Tcl_ListObjAppendElement (interp, res,
+        shaDigestObj (digests + i * dlen, dlen, outputFormatIdx));
+  }
+  Tcl_SetObjResult (interp, res);
+  ckfree ((char *) bufs);
+  ckfree ((char *) blens);
+  ckfree ((char *) digests);
+  return TCL_OK;
+}
+
+/*
+ * Digest cache for -file and -files, shared by every interp in the
+ * process.  An entry is keyed on the file name and hash size, and is
+ * only used while the device, inode, size and modification time of
+ * the file are unchanged.  The cache holds at most max entries, least
+ * recently used first out; it is off while max is 0.  hmacs are not
+ * cached.
+ */
+typedef struct shaCacheEntry {
+  struct shaCacheEntry  *prev;
+  struct shaCacheEntry  *next;
+  Tcl_HashEntry     *hentry;
+  const shaalgo_t   *algo;
+  Tcl_WideUInt      dev;
+  Tcl_WideUInt      ino;
+  Tcl_WideInt       size;
+  Tcl_WideInt       mtime;        /* nanoseconds                        */
+  size_t            dlen;
+  buff_t            digest [SHA_MAXOUTLEN];
+} shaCacheEntry;
+
+typedef struct {
+  Tcl_WideUInt      dev;
+  Tcl_WideUInt      ino;
+  Tcl_WideInt       size;
+  Tcl_WideInt       mtime;
+} shaCacheStat;
+
+static struct {
+  Tcl_Mutex         mutex;
+  int               init;
+  Tcl_HashTable     table;
+  shaCacheEntry     *head;        /* most recently used                 */
+  shaCacheEntry     *tail;
+  size_t            count;
+  size_t            max;
+  Tcl_WideInt       hits;
+  Tcl_WideInt       misses;
+  char              *file;        /* sidecar, saved at exit             */
+} shaCache;
+
+static int
+shaCacheStatFile (const char *fn, shaCacheStat *cst)
+{
+  struct stat       statbuf;
+
+  if (stat (fn, &statbuf) != 0) {
+    return -1;
+  }
+  cst->dev = (Tcl_WideUInt) statbuf.st_dev;
+  cst->ino = (Tcl_WideUInt) statbuf.st_ino;
+  cst->size = (Tcl_WideInt) statbuf.st_size;
+  cst->mtime = (Tcl_WideInt) statbuf.st_mtime * 1000000000;
+#if defined(__APPLE__)
+  cst->mtime += statbuf.st_mtimespec.tv_nsec;
+#elif ! defined(_WIN32)
+  cst->mtime += statbuf.st_mtim.tv_nsec;
+#endif
+  return 0;
+}
+
+/* the key is "<bits> <filename>"; the caller frees it */
+static void
+shaCacheKey (const shaalgo_t *algo, const char *fn, Tcl_DString *key)
+{
+  Tcl_DStringInit (key);
+  Tcl_DStringAppend (key, algo->name, -1);
+  Tcl_DStringAppend (key, " ", 1);
+  Tcl_DStringAppend (key, fn, -1);
+}
+
+/* the following expect the mutex to be held */
+static void
+shaCacheUnlink (shaCacheEntry *ent)
+{
+  if (ent->prev != NULL) {
+    ent->prev->next = ent->next;
+  } else {
+    shaCache.head = ent->next;
+  }
+  if (ent->next != NULL) {
+    ent->next->prev = ent->prev;
+  } else {
+    shaCache.tail = ent->prev;
+  }
+}
+
+static void
+shaCacheLinkHead (shaCacheEntry *ent)
+{
+  ent->prev = NULL;
+  ent->next = shaCache.head;
+  if (shaCache.head != NULL) {
+    shaCache.head->prev = ent;
+  }
+  shaCache.head = ent;
+  if (shaCache.tail == NULL) {
+    shaCache.tail = ent;
+  }
+}
+
+static void
+shaCacheRemove (shaCacheEntry *ent)
+{
+  shaCacheUnlink (ent);
+  Tcl_DeleteHashEntry (ent->hentry);
+  ckfree ((char *) ent);
+  --shaCache.count;
+}
+
+static void
+shaCacheTrim (void)
+{
+  while (shaCache.count > shaCache.max) {
+    shaCacheRemove (shaCache.tail);
+  }
+}
+
+static void
+shaCacheStore (const shaalgo_t *algo, const char *fn,
+    const shaCacheStat *cst, const buff_t *digest, size_t dlen)
+{
+  shaCacheEntry     *ent;
+  Tcl_HashEntry     *hentry;
+  Tcl_DString       key;
+  int               isnew;
+
+  if (! shaCache.init) {
+    Tcl_InitHashTable (&shaCache.table, TCL_STRING_KEYS);
+    shaCache.init = 1;
+  }
+  shaCacheKey (algo, fn, &key);
+  hentry = Tcl_CreateHashEntry (&shaCache.table, Tcl_DStringValue (&key),
+      &isnew);
+  Tcl_DStringFree (&key);
+  if (isnew) {
+    ent = (shaCacheEntry *) ckalloc (sizeof (shaCacheEntry));
+    ent->hentry = hentry;
+    Tcl_SetHashValue (hentry, (ClientData) ent);
+    ++shaCache.count;
+  } else {
+    ent = (shaCacheEntry *) Tcl_GetHashValue (hentry);
+    shaCacheUnlink (ent);
+  }
+  shaCacheLinkHead (ent);
+  ent->algo = algo;
+  ent->dev = cst->dev;
+  ent->ino = cst->ino;
+  ent->size = cst->size;
+  ent->mtime = cst->mtime;
+  ent->dlen = dlen;
+  memcpy (ent->digest, digest, dlen);
+  shaCacheTrim ();
+}
+
+static void
+shaCacheFlush (void)
+{
+  while (shaCache.head != NULL) {
+    shaCacheRemove (shaCache.head);
+  }
+}
+
+/*
+ * Hashes a file, or returns the cached digest.  The return codes are
+ * those of shaupdatefile.
+ */
+static int
+shaCacheHash (const shaalgo_t *algo, const char *fn, volatile int *cancel,
+    buff_t *digest, size_t *dlen)
+{
+  shaCacheEntry     *ent = NULL;
+  shaCacheStat      cst;
+  Tcl_HashEntry     *hentry;
+  Tcl_DString       key;
+  shactx_t          *ctx;
+  int               rc;
+
+  if (shaCacheStatFile (fn, &cst) != 0) {
+    return 3;
+  }
+
+  Tcl_MutexLock (&shaCache.mutex);
+  if (shaCache.init) {
+    shaCacheKey (algo, fn, &key);
+    hentry = Tcl_FindHashEntry (&shaCache.table, Tcl_DStringValue (&key));
+    Tcl_DStringFree (&key);
+    if (hentry != NULL) {
+      ent = (shaCacheEntry *) Tcl_GetHashValue (hentry);
+      if (ent->dev != cst.dev || ent->ino != cst.ino ||
+          ent->size != cst.size || ent->mtime != cst.mtime) {
+        shaCacheRemove (ent);
+        ent = NULL;
+      }
+    }
+  }
+  if (ent != NULL) {
+    shaCacheUnlink (ent);
+    shaCacheLinkHead (ent);
+    memcpy (digest, ent->digest, ent->dlen);
+    *dlen = ent->dlen;
+    ++shaCache.hits;
+  } else {
+    ++shaCache.misses;
+  }
+  Tcl_MutexUnlock (&shaCache.mutex);
+  if (ent != NULL) {
+    return 0;
+  }
+
+  ctx = shanewalgo (algo);
+  if (ctx == NULL) {
+    return 1;
+  }
+  rc = shaupdatefile (ctx, fn, cancel);
+  if (rc == 0) {
+    shafinal (ctx, digest, dlen);
+    Tcl_MutexLock (&shaCache.mutex);
+    if (shaCache.max > 0) {
+      shaCacheStore (algo, fn, &cst, digest, *dlen);
+    }
+    Tcl_MutexUnlock (&shaCache.mutex);
+  }
+  shafree (ctx);
+  return rc;
+}
+
+static int
+shaCacheOn (void)
+{
+  int               on;
+
+  Tcl_MutexLock (&shaCache.mutex);
+  on = shaCache.max > 0;
+  Tcl_MutexUnlock (&shaCache.mutex);
+  return on;
+}
+
+/*
+ * Sidecar file: one line per entry,
+ *   bits dev inode size mtime-ns hexdigest filename
+ * Names containing a newline are not saved.
+ */
+static int
+shaCacheSave (const char *file)
+{
+  FILE              *fh;
+  shaCacheEntry     *ent;
+  size_t            i;
+  int               rc = 0;
+
+  fh = fopen (file, "w");
+  if (fh == NULL) {
+    return -1;
+  }
+  Tcl_MutexLock (&shaCache.mutex);
+  /* oldest first, so a load restores the same order */
+  for (ent = shaCache.tail; ent != NULL; ent = ent->prev) {
+    const char *fn = (const char *) Tcl_GetHashKey (&shaCache.table,
+        ent->hentry) + strlen (ent->algo->name) + 1;
+
+    if (strchr (fn, '\n') != NULL) {
+      continue;
+    }
+    fprintf (fh, "%s %" TCL_LL_MODIFIER "u %" TCL_LL_MODIFIER "u"
+        " %" TCL_LL_MODIFIER "d %" TCL_LL_MODIFIER "d ",
+        ent->algo->name, ent->dev, ent->ino, ent->size, ent->mtime);
+    for (i = 0; i < ent->dlen; ++i) {
+      fprintf (fh, "%02x", ent->digest [i]);
+    }
+    fprintf (fh, " %s\n", fn);
+  }
+  Tcl_MutexUnlock (&shaCache.mutex);
+  if (ferror (fh)) {
+    rc = -1;
+  }
+  if (fclose (fh) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+static int
+shaCacheLoad (const char *file)
+{
+  FILE              *fh;
+  char              line [8192];
+  char              bits [20];
+  char              hex [SHA_DIGESTSIZE];
+  int               pos;
+  size_t            len;
+  size_t            i;
+  unsigned int      byte;
+  const shaalgo_t   *algo;
+  shaCacheStat      cst;
+  buff_t            digest [SHA_MAXOUTLEN];
+
+  fh = fopen (file, "r");
+  if (fh == NULL) {
+    return -1;
+  }
+  Tcl_MutexLock (&shaCache.mutex);
+  while (fgets (line, sizeof (line), fh) != NULL) {
+    len = strlen (line);
+    if (len == 0 || line [len - 1] != '\n') {
+      /* too long, skip the rest of it */
+      while (len > 0 && line [len - 1] != '\n' &&
+          fgets (line, sizeof (line), fh) != NULL) {
+        len = strlen (line);
+      }
+      continue;
+    }
+    line [len - 1] = '\0';
+    if (sscanf (line, "%19s %" TCL_LL_MODIFIER "u %" TCL_LL_MODIFIER "u"
+        " %" TCL_LL_MODIFIER "d %" TCL_LL_MODIFIER "d %1024s %n",
+        bits, &cst.dev, &cst.ino, &cst.size, &cst.mtime, hex, &pos) != 6 ||
+        (algo = shaAlgoByName (bits)) == NULL ||
+        strlen (hex) != algo->dlen * 2 || line [pos] == '\0') {
+      continue;
+    }
+    for (i = 0; i < algo->dlen; ++i) {
+      if (sscanf (hex + i * 2, "%2x", &byte) != 1) {
+        break;
+      }
+      digest [i] = (buff_t) byte;
+    }
+    if (i == algo->dlen && shaCache.max > 0) {
+      shaCacheStore (algo, line + pos, &cst, digest, algo->dlen);
+    }
+  }
+  Tcl_MutexUnlock (&shaCache.mutex);
+  fclose (fh);
+  return 0;
+}
+
+static void
+shaCacheExit (ClientData cd)
+{
+  Tcl_MutexLock (&shaCache.mutex);
+  if (shaCache.file != NULL) {
+    /* a cache turned off since -file was set leaves the sidecar alone */
+    if (shaCache.max > 0) {
+      Tcl_MutexUnlock (&shaCache.mutex);
+      shaCacheSave (shaCache.file);
+      Tcl_MutexLock (&shaCache.mutex);
+    }
+    ckfree (shaCache.file);
+    shaCache.file = NULL;
+  }
+  shaCacheFlush ();
+  Tcl_MutexUnlock (&shaCache.mutex);
+}
+
+static const char* CacheSubCmds[] = {
+    "configure",
+    "entries",
+    "flush",
+    "load",
+    "save",
+    "stats",
+    NULL
+};
+
+enum CacheSubCmdsIndex {
+    CacheConfigureIx,
+    CacheEntriesIx,
+    CacheFlushIx,
+    CacheLoadIx,
+    CacheSaveIx,
+    CacheStatsIx
+};
+
+/*
+ * sha::cache configure ?-size <n>? ?-file <fn>?
+ * sha::cache stats
+ * sha::cache entries
+ * sha::cache flush
+ * sha::cache load ?<fn>?
+ * sha::cache save ?<fn>?
+ */
+static int
+shaCacheObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  static int        exitset = 0;
+  int               cmdIdx;
+  int               argidx;
+  int               size = -1;
+  Tcl_Obj           *fileObj = NULL;
+  Tcl_Obj           *res;
+  Tcl_Obj           *elem [3];
+  shaCacheEntry     *ent;
+  const char        *fn;
+  char              *file;
+  int               rc;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj (interp, objv[1], CacheSubCmds, "subcommand", 0,
+      &cmdIdx) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch (cmdIdx) {
+    case CacheConfigureIx: {
+      for (argidx = 2; argidx < objc; argidx += 2) {
+        fn = Tcl_GetString (objv[argidx]);
+        if (argidx + 1 < objc && strcmp (fn, "-size") == 0) {
+          if (Tcl_GetIntFromObj (interp, objv[argidx + 1], &size) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (size < 0) {
+            size = 0;
+          }
+        } else if (argidx + 1 < objc && strcmp (fn, "-file") == 0) {
+          fileObj = objv[argidx + 1];
+        } else {
+          Tcl_WrongNumArgs (interp, 2, objv, "?-size <n>? ?-file <fn>?");
+          return TCL_ERROR;
+        }
+      }
+      file = NULL;
+      if (fileObj != NULL && *Tcl_GetString (fileObj) != '\0') {
+        /* stored normalized so ~ and the cwd are resolved now, not at exit */
+        fileObj = Tcl_FSGetNormalizedPath (interp, fileObj);
+        if (fileObj == NULL) {
+          return TCL_ERROR;
+        }
+        file = Tcl_GetString (fileObj);
+      }
+      Tcl_MutexLock (&shaCache.mutex);
+      if (size >= 0) {
+        shaCache.max = (size_t) size;
+        shaCacheTrim ();
+      }
+      if (file != NULL && shaCache.max == 0) {
+        Tcl_MutexUnlock (&shaCache.mutex);
+        Tcl_SetResult (interp, "cache -size is 0, set -size to use -file",
+            TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (fileObj != NULL) {
+        if (shaCache.file != NULL) {
+          ckfree (shaCache.file);
+          shaCache.file = NULL;
+        }
+        if (file != NULL) {
+          shaCache.file = ckalloc (strlen (file) + 1);
+          strcpy (shaCache.file, file);
+        }
+        if (! exitset) {
+          Tcl_CreateExitHandler (shaCacheExit, NULL);
+          exitset = 1;
+        }
+      }
+      Tcl_MutexUnlock (&shaCache.mutex);
+      if (file != NULL) {
+        /* a missing sidecar is not an error; it is written at exit */
+        shaCacheLoad (file);
+      }
+      Tcl_MutexLock (&shaCache.mutex);
+      res = Tcl_NewListObj (0, NULL);
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("-size", -1));
+      Tcl_ListObjAppendElement (NULL, res,
+          Tcl_NewWideIntObj ((Tcl_WideInt) shaCache.max));
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("-file", -1));
+      Tcl_ListObjAppendElement (NULL, res,
+          Tcl_NewStringObj (shaCache.file == NULL ? "" : shaCache.file, -1));
+      Tcl_MutexUnlock (&shaCache.mutex);
+      Tcl_SetObjResult (interp, res);
+      break;
+    }
+    case CacheStatsIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_MutexLock (&shaCache.mutex);
+      res = Tcl_NewListObj (0, NULL);
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("entries", -1));
+      Tcl_ListObjAppendElement (NULL, res,
+          Tcl_NewWideIntObj ((Tcl_WideInt) shaCache.count));
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("size", -1));
+      Tcl_ListObjAppendElement (NULL, res,
+          Tcl_NewWideIntObj ((Tcl_WideInt) shaCache.max));
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("hits", -1));
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewWideIntObj (shaCache.hits));
+      Tcl_ListObjAppendElement (NULL, res, Tcl_NewStringObj ("misses", -1));
+      Tcl_ListObjAppendElement (NULL, res,
+          Tcl_NewWideIntObj (shaCache.misses));
+      Tcl_MutexUnlock (&shaCache.mutex);
+      Tcl_SetObjResult (interp, res);
+      break;
+    }
+    case CacheEntriesIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      res = Tcl_NewListObj (0, NULL);
+      Tcl_MutexLock (&shaCache.mutex);
+      for (ent = shaCache.head; ent != NULL; ent = ent->next) {
+        fn = (const char *) Tcl_GetHashKey (&shaCache.table, ent->hentry);
+        elem [0] = Tcl_NewStringObj (fn + strlen (ent->algo->name) + 1, -1);
+        elem [1] = Tcl_NewStringObj (ent->algo->name, -1);
+        elem [2] = shaDigestObj (ent->digest, ent->dlen, OutputFormatHexIx);
+        Tcl_ListObjAppendElement (NULL, res, Tcl_NewListObj (3, elem));
+      }
+      Tcl_MutexUnlock (&shaCache.mutex);
+      Tcl_SetObjResult (interp, res);
+      break;
+    }
+    case CacheFlushIx: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs (interp, 2, objv, NULL);
+        return TCL_ERROR;
+      }
+      Tcl_MutexLock (&shaCache.mutex);
+      shaCacheFlush ();
+      shaCache.hits = 0;
+      shaCache.misses = 0;
+      Tcl_MutexUnlock (&shaCache.mutex);
+      break;
+    }
+    case CacheLoadIx:
+    case CacheSaveIx: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs (interp, 2, objv, "?fn?");
+        return TCL_ERROR;
+      }
+      fileObj = NULL;
+      if (objc == 3) {
+        fileObj = Tcl_FSGetNormalizedPath (interp, objv[2]);
+        if (fileObj == NULL) {
+          return TCL_ERROR;
+        }
+      }
+      Tcl_MutexLock (&shaCache.mutex);
+      if (cmdIdx == CacheLoadIx && shaCache.max == 0) {
+        Tcl_MutexUnlock (&shaCache.mutex);
+        Tcl_SetResult (interp, "cache -size is 0, nothing to load",
+            TCL_STATIC);
+        return TCL_ERROR;
+      }
+      file = NULL;
+      if (fileObj != NULL) {
+        fn = Tcl_GetString (fileObj);
+      } else {
+        fn = shaCache.file;
+      }
+      if (fn != NULL) {
+        file = ckalloc (strlen (fn) + 1);
+        strcpy (file, fn);
+      }
+      Tcl_MutexUnlock (&shaCache.mutex);
+      if (file == NULL) {
+        Tcl_SetResult (interp, "no cache file", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (cmdIdx == CacheLoadIx) {
+        rc = shaCacheLoad (file);
+      } else {
+        rc = shaCacheSave (file);
+      }
+      if (rc != 0) {
+        Tcl_AppendResult (interp, "unable to ",
+            cmdIdx == CacheLoadIx ? "read" : "write", " \"", file, "\": ",
+            Tcl_PosixError (interp), NULL);
+        ckfree (file);
+        return TCL_ERROR;
+      }
+      ckfree (file);
+      break;
+    }
+  }
+  return TCL_OK;
+}
+
+static int
+shaNumCpus (void)
+{
+#if defined(_WIN32)
+  SYSTEM_INFO       sysinfo;
+
+  GetSystemInfo (&sysinfo);
+  return (int) sysinfo.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long              n;
+
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+#else
+  return 1;
+#endif
+}
+
+/*
+ * A batch of files shared by the worker threads.  Each worker takes
+ * the next file index under the mutex; the results are written to
+ * per file slots, so nothing else needs locking.  Every file is
+ * hashed with a copy of the template context.
+ */
+typedef struct {
+  Tcl_Mutex         mutex;
+  int               next;
+  int               count;
+  char              **fns;
+  shaCtxData        *cdata;       /* template context                   */
+  volatile int      *cancel;
+  buff_t            *digests;     /* count * dlen                       */
+  size_t            dlen;
+  size_t            *dlens;
+  int               *errs;        /* errno for each file, 0 if ok       */
+} shaBatch;
+
+static void shaBatchFree (shaBatch *batch);
+
+static int
+shaBatchInit (Tcl_Interp *interp, shaBatch *batch, Tcl_Obj *filesObj,
+    shaCtxData *cdata, volatile int *cancel)
+{
+  Tcl_Obj           **elems;
+  int               count;
+  int               i;
+
+  if (Tcl_ListObjGetElements (interp, filesObj, &count, &elems) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  memset (batch, '\0', sizeof (shaBatch));
+  batch->cdata = cdata;
+  batch->cancel = cancel;
+  batch->dlen = cdata->algo->dlen;
+  batch->fns = shaAttemptAlloc ((size_t) count + 1, sizeof (char *));
+  batch->digests = shaAttemptAlloc ((size_t) count + 1, batch->dlen);
+  batch->dlens = shaAttemptAlloc ((size_t) count + 1, sizeof (size_t));
+  batch->errs = shaAttemptAlloc ((size_t) count + 1, sizeof (int));
+  if (batch->fns == NULL || batch->digests == NULL ||
+      batch->dlens == NULL || batch->errs == NULL) {
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    shaBatchFree (batch);
+    return TCL_ERROR;
+  }
+  /* the names are copied, the workers may outlive the list */
+  batch->count = count;
+  for (i = 0; i < count; ++i) {
+    batch->fns[i] = ckalloc (strlen (Tcl_GetString (elems[i])) + 1);
+    strcpy (batch->fns[i], Tcl_GetString (elems[i]));
+  }
+  return TCL_OK;
+}
+
+static void
+shaBatchFree (shaBatch *batch)
+{
+  int               i;
+
+  for (i = 0; i < batch->count; ++i) {
+    ckfree (batch->fns[i]);
+  }
+  ckfree ((char *) batch->fns);
+  ckfree ((char *) batch->digests);
+  ckfree ((char *) batch->dlens);
+  ckfree ((char *) batch->errs);
+  Tcl_MutexFinalize (&batch->mutex);
+}
+
+static void
+shaBatchRun (ClientData cd)
+{
+  shaBatch          *batch = (shaBatch *) cd;
+  shactx_t          *ctx;
+  hmacctx_t         *hctx;
+  buff_t            *digest;
+  int               i;
+  int               rc;
+
+  for (;;) {
+    Tcl_MutexLock (&batch->mutex);
+    i = batch->next++;
+    Tcl_MutexUnlock (&batch->mutex);
+    if (i >= batch->count) {
+      break;
+    }
+
+    digest = batch->digests + i * batch->dlen;
+    errno = 0;
+    rc = 4;
+    if (batch->cancel != NULL && *batch->cancel) {
+      ;
+    } else if (batch->cdata->hctx != NULL) {
+      rc = 1;
+      hctx = hmacclone (batch->cdata->hctx);
+      if (hctx != NULL) {
+        rc = hmacupdatefile (hctx, batch->fns[i], batch->cancel);
+        if (rc == 0) {
+          hmacfinal (hctx, digest, &batch->dlens[i]);
+        }
+        hmacfree (hctx);
+      }
+    } else if (shaCacheOn ()) {
+      rc = shaCacheHash (batch->cdata->algo, batch->fns[i], batch->cancel,
+          digest, &batch->dlens[i]);
+    } else {
+      rc = 1;
+      ctx = shaclone (batch->cdata->ctx);
+      if (ctx != NULL) {
+        rc = shaupdatefile (ctx, batch->fns[i], batch->cancel);
+        if (rc == 0) {
+          shafinal (ctx, digest, &batch->dlens[i]);
+        }
+        shafree (ctx);
+      }
+    }
+    batch->errs[i] = 0;
+    if (rc == 4) {
+      batch->errs[i] = ECANCELED;
+    } else if (rc != 0) {
+      batch->errs[i] = errno != 0 ? errno : (rc == 1 ? ENOMEM : EIO);
+    }
+  }
+}
+
+/*
+ * Runs run(data) on nthreads threads (0 is one per cpu, at most count)
+ * and waits for them.  The calling thread is one of the threads.
+ */
+typedef struct {
+  void              (*run) (ClientData);
+  ClientData        data;
+} shaPoolTask;
+
+static Tcl_ThreadCreateType
+shaPoolWorker (ClientData cd)
+{
+  shaPoolTask       *task = (shaPoolTask *) cd;
+
+  task->run (task->data);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+static void
+shaPoolExec (void (*run) (ClientData), ClientData data,
+    size_t count, int nthreads)
+{
+  shaPoolTask       task;
+  Tcl_ThreadId      *tids;
+  int               started;
+  int               i;
+  int               rc;
+
+  if (nthreads == 0) {
+    nthreads = shaNumCpus ();
+  }
+  if ((size_t) nthreads > count) {
+    nthreads = (int) count;
+  }
+  --nthreads;
+  task.run = run;
+  task.data = data;
+  tids = (Tcl_ThreadId *) ckalloc (sizeof (Tcl_ThreadId) * (nthreads + 1));
+  started = 0;
+  for (i = 0; i < nthreads; ++i) {
+    if (Tcl_CreateThread (&tids[started], shaPoolWorker, (ClientData) &task,
+        TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK) {
+      ++started;
+    }
+  }
+  run (data);
+  for (i = 0; i < started; ++i) {
+    Tcl_JoinThread (tids[i], &rc);
+  }
+  ckfree ((char *) tids);
+}
+
+static void
+shaBatchExec (shaBatch *batch, int nthreads)
+{
+  shaPoolExec (shaBatchRun, (ClientData) batch, (size_t) batch->count,
+      nthreads);
+}
+
+/*
+ * Builds the filename -> digest dict and the filename -> {code message}
+ * dict of the files that failed.
+ */
+static void
+shaBatchResult (shaBatch *batch, int outputFormatIdx,
+    Tcl_Obj **resPtr, Tcl_Obj **errsPtr)
+{
+  Tcl_Obj           *err;
+  Tcl_Obj           *fnObj;
+  int               i;
+
+  *resPtr = Tcl_NewDictObj ();
+  *errsPtr = Tcl_NewDictObj ();
+  for (i = 0; i < batch->count; ++i) {
+    fnObj = Tcl_NewStringObj (batch->fns[i], -1);
+    if (batch->errs[i] == 0) {
+      Tcl_DictObjPut (NULL, *resPtr, fnObj,
+          shaDigestObj (batch->digests + i * batch->dlen, batch->dlens[i],
+          outputFormatIdx));
+    } else {
+      Tcl_SetErrno (batch->errs[i]);
+      err = Tcl_NewListObj (0, NULL);
+      Tcl_ListObjAppendElement (NULL, err, Tcl_NewStringObj (Tcl_ErrnoId (), -1));
+      Tcl_ListObjAppendElement (NULL, err,
+          Tcl_NewStringObj (Tcl_ErrnoMsg (batch->errs[i]), -1));
+      Tcl_DictObjPut (NULL, *errsPtr, fnObj, err);
+    }
+  }
+}
+
+/*
+ * sha -bits <bits> ?hmac options? -files <list> ?-threads n? ?-errors var?
+ *
+ * Returns a dict of filename -> digest.  Files that can't be hashed
+ * are left out; -errors receives a dict of filename -> {code message}.
+ */
+static int
+shaFilesHash (Tcl_Interp *interp, shaCtxData *cdata, Tcl_Obj *filesObj,
+    int nthreads, Tcl_Obj *errVarObj, int outputFormatIdx)
+{
+  shaBatch          batch;
+  Tcl_Obj           *res;
+  Tcl_Obj           *errs;
+
+  if (shaBatchInit (interp, &batch, filesObj, cdata, NULL) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  shaBatchExec (&batch, nthreads);
+  shaBatchResult (&batch, outputFormatIdx, &res, &errs);
+  shaBatchFree (&batch);
+
+  if (errVarObj != NULL) {
+    if (Tcl_ObjSetVar2 (interp, errVarObj, NULL, errs,
+        TCL_LEAVE_ERR_MSG) == NULL) {
+      Tcl_DecrRefCount (res);
+      return TCL_ERROR;
+    }
+  } else {
+    Tcl_DecrRefCount (errs);
+  }
+  Tcl_SetObjResult (interp, res);
+  return TCL_OK;
+}
+
+/*
+ * sha -bits <bits> -tree -file <fn> ?-leafsize n? ?-threads n? ?-leaves var?
+ *
+ * Returns the root of the tree hash (layout in sha.c); the leaves are
+ * hashed in parallel.  -leaves receives the list of leaf digests.
+ */
+typedef struct {
+  Tcl_Mutex         mutex;
+  size_t            next;
+  size_t            nleaves;
+  const shaalgo_t   *algo;
+  char              *fn;
+  size_t            leafsize;
+  uint64_t          flen;
+  buff_t            *leaves;      /* nleaves * algo->dlen               */
+  size_t            dlen;
+  int               err;          /* first errno, 0 if ok               */
+} shaTree;
+
+static void
+shaTreeRun (ClientData cd)
+{
+  shaTree           *tree = (shaTree *) cd;
+  size_t            i;
+  size_t            dlen;
+  int               rc;
+
+  for (;;) {
+    Tcl_MutexLock (&tree->mutex);
+    i = tree->next++;
+    if (tree->err != 0) {
+      i = tree->nleaves;
+    }
+    Tcl_MutexUnlock (&tree->mutex);
+    if (i >= tree->nleaves) {
+      break;
+    }
+
+    errno = 0;
+    rc = tree->algo->fam->treeleaf (tree->algo, tree->fn, tree->leafsize,
+        tree->flen, i, tree->leaves + i * tree->algo->dlen, &dlen);
+    Tcl_MutexLock (&tree->mutex);
+    if (rc == 0) {
+      tree->dlen = dlen;
+    } else if (tree->err == 0) {
+      tree->err = errno != 0 ? errno : (rc == 1 ? ENOMEM : EIO);
+    }
+    Tcl_MutexUnlock (&tree->mutex);
+  }
+}
+
+static int
+shaTreeHash (Tcl_Interp *interp, const shaalgo_t *algo, char *fn,
+    Tcl_WideInt leafsize, int nthreads, Tcl_Obj *leavesVarObj,
+    int outputFormatIdx, Tcl_Obj *verifyObj)
+{
+  shaTree           tree;
+  buff_t            root [SHA_MAXOUTLEN];
+  size_t            dlen;
+  size_t            i;
+  Tcl_Obj           *leaves;
+  int               rc;
+
+  memset (&tree, '\0', sizeof (tree));
+  tree.algo = algo;
+  tree.fn = fn;
+  tree.leafsize = (size_t) leafsize;
+  rc = shatreeinfo (fn, tree.leafsize, &tree.flen, &tree.nleaves);
+  if (rc == 3) {
+    Tcl_AppendResult (interp, "unable to read file \"", fn, "\": ",
+        Tcl_PosixError (interp), NULL);
+    return TCL_ERROR;
+  }
+  if (rc != 0 || tree.nleaves > UINT_MAX / algo->dlen) {
+    Tcl_AppendResult (interp, "too many leaves, use a larger -leafsize",
+        NULL);
+    return TCL_ERROR;
+  }
+  tree.leaves = shaAttemptAlloc (tree.nleaves, algo->dlen);
+  if (tree.leaves == NULL) {
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    return TCL_ERROR;
+  }
+  shaPoolExec (shaTreeRun, (ClientData) &tree, tree.nleaves, nthreads);
+  Tcl_MutexFinalize (&tree.mutex);
+
+  rc = TCL_OK;
+  if (tree.err != 0) {
+    Tcl_SetErrno (tree.err);
+    Tcl_AppendResult (interp, "unable to read file \"", fn, "\": ",
+        Tcl_PosixError (interp), NULL);
+    rc = TCL_ERROR;
+  } else if (algo->fam->treeroot (algo, tree.leafsize, tree.flen,
+      tree.nleaves, tree.leaves, algo->dlen, root, &dlen) != 0) {
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    rc = TCL_ERROR;
+  }
+
+  if (rc == TCL_OK && leavesVarObj != NULL) {
+    leaves = Tcl_NewListObj (0, NULL);
+    for (i = 0; i < tree.nleaves; ++i) {
+      Tcl_ListObjAppendElement (NULL, leaves,
+          shaDigestObj (tree.leaves + i * algo->dlen, tree.dlen,
+          outputFormatIdx));
+    }
+    if (Tcl_ObjSetVar2 (interp, leavesVarObj, NULL, leaves,
+        TCL_LEAVE_ERR_MSG) == NULL) {
+      rc = TCL_ERROR;
+    }
+  }
+  if (rc == TCL_OK) {
+    rc = shaDigestResult (interp, root, dlen, outputFormatIdx, verifyObj);
+  }
+  ckfree ((char *) tree.leaves);
+  return rc;
+}
+
+/*
+ * sha::pbkdf2 -bits <bits> {-password <p>|-passwordbin <p>}
+ *     {-salt <s>|-saltbin <s>} -iterations <n> -length <n>
+ *     ?-threads <n>? ?-output hex|base64|binary?
+ *
+ * PBKDF2-HMAC (RFC 8018).  The iterations run in C on the padded key
+ * states; when -length needs more than one digest, the blocks are
+ * computed in parallel.
+ */
+static const char* Pbkdf2Options[] = {
+    "-algo",
+    "-bits",
+    "-iterations",
+    "-length",
+    "-output",
+    "-password",
+    "-passwordbin",
+    "-salt",
+    "-saltbin",
+    "-threads",
+    NULL
+};
+
+enum Pbkdf2OptionsIndex {
+    Pbkdf2AlgoIx,
+    Pbkdf2BitsIx,
+    Pbkdf2IterationsIx,
+    Pbkdf2LengthIx,
+    Pbkdf2OutputIx,
+    Pbkdf2PasswordIx,
+    Pbkdf2PasswordbinIx,
+    Pbkdf2SaltIx,
+    Pbkdf2SaltbinIx,
+    Pbkdf2ThreadsIx
+};
+
+typedef struct {
+  Tcl_Mutex         mutex;
+  size_t            next;
+  size_t            nblocks;
+  const shaalgo_t   *algo;
+  const buff_t      *pw;
+  size_t            pwlen;
+  const buff_t      *salt;
+  size_t            slen;
+  unsigned long     iter;
+  buff_t            *out;         /* nblocks * dlen                     */
+} shaPbkdf2;
+
+static void
+shaPbkdf2Run (ClientData cd)
+{
+  shaPbkdf2         *kdf = (shaPbkdf2 *) cd;
+  size_t            i;
+
+  for (;;) {
+    Tcl_MutexLock (&kdf->mutex);
+    i = kdf->next++;
+    Tcl_MutexUnlock (&kdf->mutex);
+    if (i >= kdf->nblocks) {
+      break;
+    }
+    kdf->algo->fam->pbkdf2 (kdf->algo, kdf->pw, kdf->pwlen,
+        kdf->salt, kdf->slen, kdf->iter, i + 1, 1,
+        kdf->out + i * kdf->algo->dlen);
+  }
+}
+
+static int
+shaPbkdf2ObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  Tcl_Obj           *bitsObj = NULL;
+  Tcl_Obj           *pwObj = NULL;
+  Tcl_Obj           *saltObj = NULL;
+  int               pwbin = 0;
+  int               saltbin = 0;
+  int               iter = 0;
+  Tcl_WideInt       length = 0;
+  int               nthreads = 0;
+  int               outputFormatIdx = OutputFormatHexIx;
+  int               optIdx;
+  int               argidx;
+  int               len;
+  shaPbkdf2         kdf;
+  const char        *usagestr =
+      "-bits <bits> {-password <p>|-passwordbin <p>} {-salt <s>|-saltbin <s>} -iterations <n> -length <n> [-threads <n>] [-output hex|base64|binary]";
+
+  for (argidx = 1; argidx < objc; argidx += 2) {
+    if (argidx + 1 >= objc ||
+        Tcl_GetIndexFromObj (NULL, objv[argidx], Pbkdf2Options, "option",
+        TCL_EXACT, &optIdx) != TCL_OK) {
+      Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+      return TCL_ERROR;
+    }
+    switch (optIdx) {
+      case Pbkdf2AlgoIx:
+      case Pbkdf2BitsIx:
+        bitsObj = objv[argidx + 1];
+        break;
+      case Pbkdf2PasswordIx:
+      case Pbkdf2PasswordbinIx:
+        pwObj = objv[argidx + 1];
+        pwbin = optIdx == Pbkdf2PasswordbinIx;
+        break;
+      case Pbkdf2SaltIx:
+      case Pbkdf2SaltbinIx:
+        saltObj = objv[argidx + 1];
+        saltbin = optIdx == Pbkdf2SaltbinIx;
+        break;
+      case Pbkdf2IterationsIx:
+        if (Tcl_GetIntFromObj (interp, objv[argidx + 1], &iter) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        break;
+      case Pbkdf2LengthIx:
+        if (Tcl_GetWideIntFromObj (interp, objv[argidx + 1], &length)
+            != TCL_OK) {
+          return TCL_ERROR;
+        }
+        break;
+      case Pbkdf2ThreadsIx:
+        if (Tcl_GetIntFromObj (interp, objv[argidx + 1], &nthreads) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        break;
+      case Pbkdf2OutputIx:
+        if (Tcl_GetIndexFromObj (interp, objv[argidx + 1], OutputFormats,
+            "format", 0, &outputFormatIdx) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        break;
+    }
+  }
+  if (bitsObj == NULL || pwObj == NULL || saltObj == NULL ||
+      iter < 1 || length < 1 || nthreads < 0) {
+    Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+    return TCL_ERROR;
+  }
+
+  memset (&kdf, '\0', sizeof (kdf));
+  if (shaGetAlgoFromObj (interp, bitsObj, &kdf.algo) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (kdf.algo->xof) {
+    Tcl_AppendResult (interp, "hmac is not defined for ", kdf.algo->name,
+        NULL);
+    return TCL_ERROR;
+  }
+  /* RFC 8018 allows (2^32 - 1) * hLen; a Tcl value holds less */
+  if ((Tcl_WideUInt) length > (Tcl_WideUInt) 0xffffffffUL * kdf.algo->dlen) {
+    Tcl_SetResult (interp, "-length is too long for -bits", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (length > INT_MAX / 2) {
+    Tcl_SetResult (interp, "-length is too long", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (pwbin) {
+    kdf.pw = Tcl_GetByteArrayFromObj (pwObj, &len);
+  } else {
+    kdf.pw = (buff_t *) Tcl_GetStringFromObj (pwObj, &len);
+  }
+  kdf.pwlen = (size_t) len;
+  if (saltbin) {
+    kdf.salt = Tcl_GetByteArrayFromObj (saltObj, &len);
+  } else {
+    kdf.salt = (buff_t *) Tcl_GetStringFromObj (saltObj, &len);
+  }
+  kdf.slen = (size_t) len;
+  kdf.iter = (unsigned long) iter;
+  kdf.nblocks = ((size_t) length + kdf.algo->dlen - 1) / kdf.algo->dlen;
+  kdf.out = (buff_t *) shaAttemptAlloc (kdf.nblocks, kdf.algo->dlen);
+  if (kdf.out == NULL) {
+    Tcl_SetResult (interp, "out of memory", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  shaPoolExec (shaPbkdf2Run, (ClientData) &kdf, kdf.nblocks, nthreads);
+  Tcl_MutexFinalize (&kdf.mutex);
+
+  Tcl_SetObjResult (interp,
+      shaDigestObj (kdf.out, (size_t) length, outputFormatIdx));
+  memset (kdf.out, '\0', kdf.nblocks * kdf.algo->dlen);
+  ckfree ((char *) kdf.out);
+  return TCL_OK;
+}
+
+/*
+ * sha::hkdf extract -bits <bits> ?-salt <s>|-saltbin <s>? {-ikm <k>|-ikmbin <k>}
+ * sha::hkdf expand -bits <bits> -prk <prk> ?-info <i>|-infobin <i>? -length <n>
+ * sha::hkdf derive -bits <bits> ?-salt|-saltbin? {-ikm|-ikmbin}
+ *     ?-info|-infobin? -length <n>
+ *
+ * HKDF (RFC 5869).  The results are byte arrays.  -prk is taken as a
+ * byte array, as returned by extract.
+ */
+static const char* HkdfSubCmds[] = {
+    "derive",
+    "expand",
+    "extract",
+    NULL
+};
+
+enum HkdfSubCmdsIndex {
+    HkdfDeriveIx,
+    HkdfExpandIx,
+    HkdfExtractIx
+};
+
+static const char* HkdfOptions[] = {
+    "-algo",
+    "-bits",
+    "-ikm",
+    "-ikmbin",
+    "-info",
+    "-infobin",
+    "-length",
+    "-prk",
+    "-salt",
+    "-saltbin",
+    NULL
+};
+
+enum HkdfOptionsIndex {
+    HkdfAlgoIx,
+    HkdfBitsIx,
+    HkdfIkmIx,
+    HkdfIkmbinIx,
+    HkdfInfoIx,
+    HkdfInfobinIx,
+    HkdfLengthIx,
+    HkdfPrkIx,
+    HkdfSaltIx,
+    HkdfSaltbinIx
+};
+
+/* the bytes of a text (-salt) or byte array (-saltbin) option */
+static const buff_t *
+shaHkdfBytes (Tcl_Obj *objPtr, int isbin, size_t *lenPtr)
+{
+  const buff_t      *buf;
+  int               len;
+
+  if (objPtr == NULL) {
+    *lenPtr = 0;
+    return (const buff_t *) "";
+  }
+  if (isbin) {
+    buf = Tcl_GetByteArrayFromObj (objPtr, &len);
+  } else {
+    buf = (const buff_t *) Tcl_GetStringFromObj (objPtr, &len);
+  }
+  *lenPtr = (size_t) len;
+  return buf;
+}
+
+static int
+shaHkdfObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  static const char *usages[] = {
+    "derive -bits <bits> ?-salt <s>|-saltbin <s>? {-ikm <k>|-ikmbin <k>} ?-info <i>|-infobin <i>? -length <n>",
+    "expand -bits <bits> -prk <prk> ?-info <i>|-infobin <i>? -length <n>",
+    "extract -bits <bits> ?-salt <s>|-saltbin <s>? {-ikm <k>|-ikmbin <k>}"
+  };
+  Tcl_Obj           *bitsObj = NULL;
+  Tcl_Obj           *saltObj = NULL;
+  Tcl_Obj           *ikmObj = NULL;
+  Tcl_Obj           *infoObj = NULL;
+  Tcl_Obj           *prkObj = NULL;
+  int               saltbin = 0;
+  int               ikmbin = 0;
+  int               infobin = 0;
+  int               length = 0;
+  int               cmdIdx;
+  int               optIdx;
+  int               argidx;
+  int               len;
+  const shaalgo_t   *algo;
+  const buff_t      *salt;
+  const buff_t      *ikm;
+  const buff_t      *info;
+  const buff_t      *prk;
+  size_t            slen;
+  size_t            ilen;
+  size_t            plen;
+  buff_t            prkbuf [SHA_MAXOUTLEN];
+  buff_t            *out;
+  int               rc;
+
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?arg ...?");
+    return TCL_ERROR;
+  }
+  if (Tcl_GetIndexFromObj (interp, objv[1], HkdfSubCmds, "subcommand", 0,
+      &cmdIdx) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  for (argidx = 2; argidx < objc; argidx += 2) {
+    if (argidx + 1 >= objc ||
+        Tcl_GetIndexFromObj (NULL, objv[argidx], HkdfOptions, "option",
+        TCL_EXACT, &optIdx) != TCL_OK) {
+      optIdx = -1;
+    }
+    switch (optIdx) {
+      case HkdfAlgoIx:
+      case HkdfBitsIx:
+        bitsObj = objv[argidx + 1];
+        break;
+      case HkdfSaltIx:
+      case HkdfSaltbinIx:
+        saltObj = objv[argidx + 1];
+        saltbin = optIdx == HkdfSaltbinIx;
+        break;
+      case HkdfIkmIx:
+      case HkdfIkmbinIx:
+        ikmObj = objv[argidx + 1];
+        ikmbin = optIdx == HkdfIkmbinIx;
+        break;
+      case HkdfInfoIx:
+      case HkdfInfobinIx:
+        infoObj = objv[argidx + 1];
+        infobin = optIdx == HkdfInfobinIx;
+        break;
+      case HkdfPrkIx:
+        prkObj = objv[argidx + 1];
+        break;
+      case HkdfLengthIx:
+        if (Tcl_GetIntFromObj (interp, objv[argidx + 1], &length) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (length >= 1) {
+          break;
+        }
+        /* fall through */
+      default:
+        Tcl_WrongNumArgs (interp, 1, objv, usages [cmdIdx]);
+        return TCL_ERROR;
+    }
+  }
+
+  if (bitsObj == NULL ||
+      (cmdIdx == HkdfExpandIx) != (prkObj != NULL) ||
+      (cmdIdx == HkdfExpandIx) == (ikmObj != NULL) ||
+      (cmdIdx == HkdfExpandIx && saltObj != NULL) ||
+      (cmdIdx == HkdfExtractIx) != (length == 0) ||
+      (cmdIdx == HkdfExtractIx && infoObj != NULL)) {
+    Tcl_WrongNumArgs (interp, 1, objv, usages [cmdIdx]);
+    return TCL_ERROR;
+  }
+  if (shaGetAlgoFromObj (interp, bitsObj, &algo) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (algo->xof) {
+    Tcl_AppendResult (interp, "hmac is not defined for ", algo->name, NULL);
+    return TCL_ERROR;
+  }
+  if ((size_t) length > 255 * algo->dlen) {
+    char    tbuf [40];
+
+    sprintf (tbuf, "%lu", (unsigned long) (255 * algo->dlen));
+    Tcl_AppendResult (interp, "-length must be from 1 to ", tbuf, NULL);
+    return TCL_ERROR;
+  }
+
+  if (cmdIdx == HkdfExpandIx) {
+    prk = Tcl_GetByteArrayFromObj (prkObj, &len);
+    plen = (size_t) len;
+  } else {
+    salt = shaHkdfBytes (saltObj, saltbin, &slen);
+    ikm = shaHkdfBytes (ikmObj, ikmbin, &ilen);
+    if (shahkdfextract (algo, salt, slen, ikm, ilen, prkbuf, &plen) != 0) {
+      Tcl_AppendResult (interp, "out of memory", NULL);
+      return TCL_ERROR;
+    }
+    if (cmdIdx == HkdfExtractIx) {
+      Tcl_SetObjResult (interp, Tcl_NewByteArrayObj (prkbuf, (int) plen));
+      memset (prkbuf, '\0', sizeof (prkbuf));
+      return TCL_OK;
+    }
+    prk = prkbuf;
+  }
+
+  info = shaHkdfBytes (infoObj, infobin, &ilen);
+  out = (buff_t *) ckalloc ((size_t) length);
+  rc = shahkdfexpand (algo, prk, plen, info, ilen, out, (size_t) length);
+  memset (prkbuf, '\0', sizeof (prkbuf));
+  if (rc != 0) {
+    ckfree ((char *) out);
+    Tcl_AppendResult (interp, "out of memory", NULL);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult (interp, Tcl_NewByteArrayObj (out, length));
+  memset (out, '\0', (size_t) length);
+  ckfree ((char *) out);
+  return TCL_OK;
+}
+
+/*
+ * sha -async -callback <cmd> ...
+ *
+ * The hash is computed on a background thread and the result is
+ * posted back to the interp's thread as an event.  The callback is
+ * invoked at global level as: cmd handle status result, where status
+ * is ok, error or cancelled.
+ */
+typedef struct {
+  Tcl_Interp        *interp;      /* NULL once the interp is deleted    */
+  Tcl_ThreadId      owner;
+  Tcl_HashEntry     *entry;
+  Tcl_Obj           *nameObj;
+  Tcl_Obj           *cmdObj;
+  Tcl_Obj           *errVarObj;
+  int               outputFormatIdx;
+  int               isbatch;      /* -files, the result is a dict       */
+  int               nthreads;
+  shaCtxData        *cdata;
+  shaBatch          batch;        /* -file and -files                   */
+  buff_t            *data;        /* copy of -data                      */
+  size_t            datalen;
+  buff_t            digest [SHA_MAXOUTLEN];
+  size_t            dlen;
+  volatile int      cancel;
+} shaAsyncJob;
+
+typedef struct {
+  Tcl_Event         header;
+  shaAsyncJob       *job;
+} shaAsyncEvent;
+
+typedef struct {
+  Tcl_HashTable     jobs;
+  unsigned long     count;
+} shaAsyncState;
+
+static void
+shaAsyncStateDelete (ClientData cd, Tcl_Interp *interp)
+{
+  shaAsyncState     *state = (shaAsyncState *) cd;
+  Tcl_HashEntry     *entry;
+  Tcl_HashSearch    search;
+  shaAsyncJob       *job;
+
+  /* the pending events free their jobs when they fire */
+  for (entry = Tcl_FirstHashEntry (&state->jobs, &search);
+      entry != NULL; entry = Tcl_NextHashEntry (&search)) {
+    job = (shaAsyncJob *) Tcl_GetHashValue (entry);
+    job->interp = NULL;
+    job->cancel = 1;
+  }
+  Tcl_DeleteHashTable (&state->jobs);
+  ckfree ((char *) state);
+}
+
+static shaAsyncState *
+shaAsyncGetState (Tcl_Interp *interp)
+{
+  shaAsyncState     *state;
+
+  state = (shaAsyncState *) Tcl_GetAssocData (interp, "sha::async", NULL);
+  if (state == NULL) {
+    state = (shaAsyncState *) ckalloc (sizeof (shaAsyncState));
+    Tcl_InitHashTable (&state->jobs, TCL_STRING_KEYS);
+    state->count = 0;
+    Tcl_SetAssocData (interp, "sha::async", shaAsyncStateDelete,
+        (ClientData) state);
+  }
+  return state;
+}
+
+static void
+shaAsyncFree (shaAsyncJob *job)
+{
+  if (job->data != NULL) {
+    ckfree ((char *) job->data);
+  } else {
+    shaBatchFree (&job->batch);
+  }
+  shaCtxDelete ((ClientData) job->cdata);
+  Tcl_DecrRefCount (job->nameObj);
+  Tcl_DecrRefCount (job->cmdObj);
+  if (job->errVarObj != NULL) {
+    Tcl_DecrRefCount (job->errVarObj);
+  }
+  ckfree ((char *) job);
+}
+
+static int
+shaAsyncEventProc (Tcl_Event *evPtr, int flags)
+{
+  shaAsyncJob       *job = ((shaAsyncEvent *) evPtr)->job;
+  Tcl_Interp        *interp = job->interp;
+  Tcl_Obj           *cmd;
+  Tcl_Obj           *status;
+  Tcl_Obj           *res;
+  Tcl_Obj           *errs;
+  int               err;
+
+  if ((flags & TCL_FILE_EVENTS) == 0) {
+    return 0;
+  }
+  if (interp == NULL) {
+    shaAsyncFree (job);
+    return 1;
+  }
+
+  Tcl_DeleteHashEntry (job->entry);
+  errs = NULL;
+  if (job->cancel) {
+    status = Tcl_NewStringObj ("cancelled", -1);
+    res = Tcl_NewObj ();
+  } else if (job->isbatch) {
+    status = Tcl_NewStringObj ("ok", -1);
+    shaBatchResult (&job->batch, job->outputFormatIdx, &res, &errs);
+  } else if (job->data == NULL && job->batch.errs[0] != 0) {
+    err = job->batch.errs[0];
+    status = Tcl_NewStringObj ("error", -1);
+    res = Tcl_NewStringObj ("unable to read file \"", -1);
+    Tcl_AppendStringsToObj (res, job->batch.fns[0], "\": ",
+        Tcl_ErrnoMsg (err), NULL);
+  } else {
+    status = Tcl_NewStringObj ("ok", -1);
+    if (job->data == NULL) {
+      res = shaDigestObj (job->batch.digests, job->batch.dlens[0],
+          job->outputFormatIdx);
+    } else {
+      res = shaDigestObj (job->digest, job->dlen, job->outputFormatIdx);
+    }
+  }
+
+  cmd = Tcl_DuplicateObj (job->cmdObj);
+  Tcl_IncrRefCount (cmd);
+  Tcl_ListObjAppendElement (NULL, cmd, job->nameObj);
+  Tcl_ListObjAppendElement (NULL, cmd, status);
+  Tcl_ListObjAppendElement (NULL, cmd, res);
+
+  Tcl_Preserve ((ClientData) interp);
+  if (errs != NULL && job->errVarObj != NULL) {
+    if (Tcl_ObjSetVar2 (interp, job->errVarObj, NULL, errs,
+        TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+      Tcl_BackgroundError (interp);
+    }
+  } else if (errs != NULL) {
+    Tcl_DecrRefCount (errs);
+  }
+  if (Tcl_EvalObjEx (interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK) {
+    Tcl_BackgroundError (interp);
+  }
+  Tcl_DecrRefCount (cmd);
+  Tcl_Release ((ClientData) interp);
+
+  shaAsyncFree (job);
+  return 1;
+}
 
-/*
- * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
- */
-size_t b64_encoded_size(size_t inlen)
+static void
+shaAsyncRun (shaAsyncJob *job)
 {
-    size_t ret;
+  size_t            step = 1024 * 1024;
+  size_t            pos;
+  size_t            len;
 
-    ret = inlen;
-    if (inlen % 3 != 0)
-        ret += 3 - (inlen % 3);
-    ret /= 3;
-    ret *= 4;
+  if (job->data == NULL) {
+    shaBatchExec (&job->batch, job->nthreads);
+  } else {
+    for (pos = 0; pos < job->datalen && ! job->cancel; pos += len) {
+      len = job->datalen - pos < step ? job->datalen - pos : step;
+      if (job->cdata->hctx != NULL) {
+        hmacupdate (job->cdata->hctx, job->data + pos, len);
+      } else {
+        shaupdate (job->cdata->ctx, job->data + pos, len);
+      }
+    }
+    if (job->cdata->hctx != NULL) {
+      hmacfinal (job->cdata->hctx, job->digest, &job->dlen);
+    } else {
+      shafinal (job->cdata->ctx, job->digest, &job->dlen);
+    }
+  }
+}
 
-    return ret;
+static void
+shaAsyncPost (shaAsyncJob *job)
+{
+  shaAsyncEvent     *ev;
+
+  ev = (shaAsyncEvent *) ckalloc (sizeof (shaAsyncEvent));
+  ev->header.proc = shaAsyncEventProc;
+  ev->job = job;
+  Tcl_ThreadQueueEvent (job->owner, (Tcl_Event *) ev, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert (job->owner);
+}
+
+static Tcl_ThreadCreateType
+shaAsyncWorker (ClientData cd)
+{
+  shaAsyncJob       *job = (shaAsyncJob *) cd;
+
+  shaAsyncRun (job);
+  shaAsyncPost (job);
+  TCL_THREAD_CREATE_RETURN;
 }
 
 /*
- * Gracefully taken from https://nachtimwald.com/2017/11/18/base64-encode-and-decode-in-c/
+ * Starts the job and returns its handle.  Takes ownership of cdata.
+ * Exactly one of fn, data or filesObj is set.
  */
-static char* b64_encode(const unsigned char* in, size_t len)
+static int
+shaAsyncStart (Tcl_Interp *interp, shaCtxData *cdata, Tcl_Obj *cmdObj,
+    char *fn, char *data, size_t datalen, Tcl_Obj *filesObj,
+    int nthreads, Tcl_Obj *errVarObj, int outputFormatIdx)
 {
-    char* out;
-    size_t  elen;
-    size_t  i;
-    size_t  j;
-    size_t  v;
+  shaAsyncState     *state;
+  shaAsyncJob       *job;
+  Tcl_ThreadId      tid;
+  Tcl_Obj           *fnObj;
+  char              name [40];
+  int               isnew;
+  int               len;
+  int               rc;
 
-    if (in == NULL || len == 0)
-        return NULL;
+  if (Tcl_ListObjLength (interp, cmdObj, &len) != TCL_OK) {
+    shaCtxDelete ((ClientData) cdata);
+    return TCL_ERROR;
+  }
 
-    elen = b64_encoded_size(len);
-    out = ckalloc(elen + 1);
-    out[elen] = '\0';
+  job = (shaAsyncJob *) ckalloc (sizeof (shaAsyncJob));
+  memset (job, '\0', sizeof (shaAsyncJob));
+  job->cdata = cdata;
+  if (data != NULL) {
+    job->data = (buff_t *) ckalloc (datalen + 1);
+    memcpy (job->data, data, datalen);
+    job->datalen = datalen;
+  } else {
+    job->isbatch = filesObj != NULL;
+    if (filesObj == NULL) {
+      fnObj = Tcl_NewStringObj (fn, -1);
+      filesObj = Tcl_NewListObj (1, &fnObj);
+    }
+    Tcl_IncrRefCount (filesObj);
+    rc = shaBatchInit (interp, &job->batch, filesObj, cdata, &job->cancel);
+    Tcl_DecrRefCount (filesObj);
+    if (rc != TCL_OK) {
+      shaCtxDelete ((ClientData) cdata);
+      ckfree ((char *) job);
+      return TCL_ERROR;
+    }
+  }
 
-    for (i = 0, j = 0; i < len; i += 3, j += 4) {
-        v = in[i];
-        v = i + 1 < len ? v << 8 | in[i + 1] : v << 8;
-        v = i + 2 < len ? v << 8 | in[i + 2] : v << 8;
+  state = shaAsyncGetState (interp);
+  sprintf (name, "sha::job%lu", ++state->count);
+  job->interp = interp;
+  job->owner = Tcl_GetCurrentThread ();
+  job->entry = Tcl_CreateHashEntry (&state->jobs, name, &isnew);
+  Tcl_SetHashValue (job->entry, (ClientData) job);
+  job->nameObj = Tcl_NewStringObj (name, -1);
+  Tcl_IncrRefCount (job->nameObj);
+  job->cmdObj = cmdObj;
+  Tcl_IncrRefCount (job->cmdObj);
+  job->errVarObj = errVarObj;
+  if (errVarObj != NULL) {
+    Tcl_IncrRefCount (job->errVarObj);
+  }
+  job->nthreads = nthreads;
+  job->outputFormatIdx = outputFormatIdx;
 
-        out[j] = b64chars[(v >> 18) & 0x3F];
-        out[j + 1] = b64chars[(v >> 12) & 0x3F];
-        if (i + 1 < len) {
-            out[j + 2] = b64chars[(v >> 6) & 0x3F];
-        }
-        else {
-            out[j + 2] = '=';
-        }
-        if (i + 2 < len) {
-            out[j + 3] = b64chars[v & 0x3F];
-        }
-        else {
-            out[j + 3] = '=';
-        }
-    }
+  if (Tcl_CreateThread (&tid, shaAsyncWorker, (ClientData) job,
+      TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS) != TCL_OK) {
+    /* no threads: hash now, the callback still runs from the event loop */
+    shaAsyncRun (job);
+    shaAsyncPost (job);
+  }
 
-    return out;
+  Tcl_SetObjResult (interp, job->nameObj);
+  return TCL_OK;
 }
 
 /*
- * Gracefully taken from https://nachtimwald.com/2017/09/24/hex-encode-and-decode-in-c/
+ * sha::cancel <handle>
+ *
+ * Returns 1 if the job was still pending.  Its callback is invoked
+ * with a status of cancelled.
  */
-static int hexchr2bin(const char hex, char* out)
+static int
+shaCancelObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
 {
-    if (out == NULL)
-        return 0;
-
-    if (hex >= '0' && hex <= '9') {
-        *out = hex - '0';
-    }
-    else if (hex >= 'A' && hex <= 'F') {
-        *out = hex - 'A' + 10;
-    }
-    else if (hex >= 'a' && hex <= 'f') {
-        *out = hex - 'a' + 10;
-    }
-    else {
-        return 0;
-    }
+  shaAsyncState     *state;
+  Tcl_HashEntry     *entry;
+  shaAsyncJob       *job;
 
-    return 1;
+  if (objc != 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "handle");
+    return TCL_ERROR;
+  }
+  state = shaAsyncGetState (interp);
+  entry = Tcl_FindHashEntry (&state->jobs, Tcl_GetString (objv[1]));
+  if (entry == NULL) {
+    Tcl_SetObjResult (interp, Tcl_NewIntObj (0));
+    return TCL_OK;
+  }
+  job = (shaAsyncJob *) Tcl_GetHashValue (entry);
+  job->cancel = 1;
+  Tcl_SetObjResult (interp, Tcl_NewIntObj (1));
+  return TCL_OK;
 }
 
 /*
- * Gracefully taken from https://nachtimwald.com/2017/09/24/hex-encode-and-decode-in-c/
+ * Parses ?-multibuffer? ?-bits <bits>? for sha::backend and
+ * sha::backends.  Returns the index of the first other argument.
  */
-static int hexs2bin(const char* hex, char** out, int* doFree)
+static int
+shaBackendOpts (Tcl_Interp *interp, int objc, Tcl_Obj * const objv[],
+    int *multi, const char **hsize)
 {
-    size_t len;
-    char   b1;
-    char   b2;
-    size_t i;
+  const char        *buf;
+  int               argidx;
 
-    if (hex == NULL || *hex == '\0' || out == NULL) {
-        return 0;
+  *multi = 0;
+  *hsize = NULL;
+  for (argidx = 1; argidx < objc; ++argidx) {
+    buf = Tcl_GetString (objv[argidx]);
+    if (strcmp (buf, "-multibuffer") == 0) {
+      *multi = 1;
+    } else if ((strcmp (buf, "-bits") == 0 || strcmp (buf, "-algo") == 0) &&
+        argidx + 1 < objc) {
+      *hsize = Tcl_GetString (objv[++argidx]);
+      if (shabackendname (*hsize) == NULL) {
+        Tcl_AppendResult (interp, "invalid bits \"", *hsize, "\"", NULL);
+        return -1;
+      }
+    } else {
+      break;
     }
+  }
+  return argidx;
+}
 
-    len = strlen(hex);
-    if (len % 2 != 0) {
-        return 0;
-    }
-    len /= 2;
+/*
+ * sha::backend ?-multibuffer? ?-bits <bits>? ?name?
+ *
+ * Without -bits a new backend is used by every family that has it,
+ * and the one in use for sha-256 is returned.
+ */
+static int
+shaBackendObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  const char        *hsize;
+  int               multi;
+  int               argidx;
+  int               rc;
 
-    *out = ckalloc(len);
-    *doFree = 1;
-    memset(*out, 'A', len);
-    for (i = 0; i < len; i++) {
-        if (!hexchr2bin(hex[i * 2], &b1) || !hexchr2bin(hex[i * 2 + 1], &b2)) {
-            return 0;
-        }
-        (*out)[i] = (b1 << 4) | b2;
+  argidx = shaBackendOpts (interp, objc, objv, &multi, &hsize);
+  if (argidx < 0) {
+    return TCL_ERROR;
+  }
+  if (objc - argidx > 1) {
+    Tcl_WrongNumArgs (interp, 1, objv, "?-multibuffer? ?-bits <bits>? ?name?");
+    return TCL_ERROR;
+  }
+  if (argidx < objc) {
+    if (multi) {
+      rc = shambbackend (hsize, Tcl_GetString (objv[argidx]));
+    } else {
+      rc = shabackend (hsize, Tcl_GetString (objv[argidx]));
     }
-    return len;
+    if (rc != 0) {
+      Tcl_AppendResult (interp, "backend \"", Tcl_GetString (objv[argidx]),
+          "\" is not available", NULL);
+      return TCL_ERROR;
+    }
+  }
+  Tcl_SetObjResult (interp, Tcl_NewStringObj (
+      multi ? shambbackendname (hsize) : shabackendname (hsize), -1));
+  return TCL_OK;
 }
 
-static int convert_to_binary(Tcl_Obj* tclObj, char** bufOut, int* doFree) {
-    int i = 0;
-    int len;
-    Tcl_UniChar* uniStr = Tcl_GetUnicodeFromObj(tclObj, &len);
-    *bufOut = ckalloc(len);
-    *doFree = 1;
-    for (i = 0; i < len; i++) {
-        (*bufOut)[i] = (char)uniStr[i];
-    }
-    return len;
+/*
+ * sha::backends ?-multibuffer? ?-bits <bits>?
+ */
+static int
+shaBackendsObjCmd (
+  ClientData cd,
+  Tcl_Interp* interp,
+  int objc,
+  Tcl_Obj * const objv[]
+  )
+{
+  const char        *names [10];
+  const char        *hsize;
+  int               multi;
+  int               count;
+  int               i;
+  Tcl_Obj           *res;
+
+  i = shaBackendOpts (interp, objc, objv, &multi, &hsize);
+  if (i < 0) {
+    return TCL_ERROR;
+  }
+  if (i != objc) {
+    Tcl_WrongNumArgs (interp, 1, objv, "?-multibuffer? ?-bits <bits>?");
+    return TCL_ERROR;
+  }
+  if (multi) {
+    count = shambbackendlist (hsize, names, 10);
+  } else {
+    count = shabackendlist (hsize, names, 10);
+  }
+  res = Tcl_NewListObj (0, NULL);
+  for (i = 0; i < count; ++i) {
+    Tcl_ListObjAppendElement (interp, res, Tcl_NewStringObj (names[i], -1));
+  }
+  Tcl_SetObjResult (interp, res);
+  return TCL_OK;
 }
 
 static int
@@ -176,22 +3203,46 @@ shaObjCmd (
   int               keyDynAlloc = 0; /* if -keyhex is specified, the memory for key is ckalloc'ed and must be ckfree'd at the end. This flag takes care about that */
   char              *fn;          /* filename specified by -file        */
   int               len;
-  char              *sz;          /* hash type, number of bits          */
-  int               szlen;
+  Tcl_Obj           *bitsObj = NULL; /* hash type, number of bits       */
+  Tcl_Obj           *outlenObj = NULL; /* shake digest length, -outlen  */
+  const shaalgo_t   *algo = NULL;
+  int               optIdx;
+  Tcl_Obj           *hkeyObj = NULL; /* key made by sha::hmackey        */
+  Tcl_Obj           *dataBinObj = NULL; /* -databin, read in place      */
+  Tcl_Obj           *keyBinObj = NULL; /* -keybin, read in place        */
+  Tcl_Obj           *verifyObj = NULL; /* expected digest, -verify      */
+  shaCtxData        *hkey = NULL;
   int               klen;
   int               rc;
   int               argidx;
   int               argcount;
   int               havemac;
   int               flags;
-  size_t            msz;
-  char              dstr [SHA_DIGESTSIZE];
+  size_t            msz = 0;
+  buff_t            digest [SHA_MAXOUTLEN];
   size_t            dlen;
+  Tcl_Obj           *chanObj;     /* channel specified by -channel      */
+  Tcl_Obj           *listObj;     /* messages specified by -list        */
+  Tcl_Obj           *filesObj;    /* filenames specified by -files      */
+  Tcl_Obj           *errVarObj;   /* variable specified by -errors      */
+  Tcl_Obj           *cbObj;       /* command specified by -callback     */
+  int               async = 0;
+  int               treemode = 0;
+  Tcl_WideInt       leafsize = 0;
+  Tcl_Obj           *leavesVarObj = NULL;
+  int               nthreads = 0;
+  int               nsrc;
+  Tcl_WideInt       offset = -1;
+  Tcl_WideInt       size = -1;
   const char        *usagestr =
-      "-bits <bits> [{-key <key>|-keyhex <key in hex format>|-keyfile <fn>} -mac hmac] {-file <fn>|-data <string>}";
+      "[-async -callback <cmd>] {-bits <bits> [-outlen <n>] [{-key <key>|-keyhex <key in hex format>|-keyfile <fn>} -mac hmac]|-hmackey <key>} {-file <fn>|-data <string>|-channel <chan> [-offset <n>] [-size <n>]|-list <list>|-files <list> [-threads <n>] [-errors <var>]|-tree -file <fn> [-leafsize <n>] [-threads <n>] [-leaves <var>]} [-output hex|base64|binary] [-verify <digest>]";
   int               outputFormatIdx = OutputFormatHexIx;
 
-  if (objc < 3 || objc > 11) {
+  if (objc >= 2 && strcmp (Tcl_GetString (objv[1]), "create") == 0) {
+    return shaCreateCmd (interp, objc, objv);
+  }
+
+  if (objc < 3 || objc > 22) {
     Tcl_WrongNumArgs (interp, 1, objv, usagestr);
     return TCL_ERROR;
   }
@@ -214,100 +3265,161 @@ shaObjCmd (
   havemac = 0;
   dbuf = NULL;
   fn = NULL;
+  chanObj = NULL;
+  listObj = NULL;
+  filesObj = NULL;
+  errVarObj = NULL;
+  cbObj = NULL;
 
   while (argidx < objc) {
     buf = Tcl_GetStringFromObj (objv[argidx], &len);
     if (strncmp (buf, "-", 1) == 0) {
-      if (strcmp (buf, "-bits") == 0) {
+      if (Tcl_GetIndexFromObj (NULL, objv[argidx], ShaOptions, "option",
+          TCL_EXACT, &optIdx) != TCL_OK) {
+        Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+        rc = TCL_ERROR;
+        goto cleanupFinish;
+      }
+      if (optIdx != ShaOptAsyncIx && optIdx != ShaOptTreeIx) {
         ++argidx;
-        if (argidx < objc) {
-          sz = Tcl_GetStringFromObj (objv[argidx], &szlen);
-          flags |= SHA_HAVEBITS;
+        if (argidx >= objc) {
+          break;
         }
-      } else if (strcmp (buf, "-file") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          fn = Tcl_GetStringFromObj (objv[argidx], &len);
-          flags |= SHA_HAVEFILE;
-          msz = len;
+      }
+      switch (optIdx) {
+      case ShaOptAlgoIx:
+      case ShaOptBitsIx:
+        bitsObj = objv[argidx];
+        flags |= SHA_HAVEBITS;
+        break;
+      case ShaOptOutlenIx:
+        outlenObj = objv[argidx];
+        break;
+      case ShaOptFileIx:
+        fn = Tcl_GetStringFromObj (objv[argidx], &len);
+        flags |= SHA_HAVEFILE;
+        msz = len;
+        break;
+      case ShaOptChannelIx:
+        chanObj = objv[argidx];
+        flags |= SHA_HAVECHANNEL;
+        break;
+      case ShaOptListIx:
+        listObj = objv[argidx];
+        flags |= SHA_HAVELIST;
+        break;
+      case ShaOptFilesIx:
+        filesObj = objv[argidx];
+        flags |= SHA_HAVEFILES;
+        break;
+      case ShaOptThreadsIx:
+        if (Tcl_GetIntFromObj (interp, objv[argidx], &nthreads) != TCL_OK ||
+            nthreads < 0) {
+          Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp (buf, "-data") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          dbuf = Tcl_GetStringFromObj (objv[argidx], &len);
-          flags |= SHA_HAVEDATA;
-          msz = (size_t) len;
+        break;
+      case ShaOptErrorsIx:
+        errVarObj = objv[argidx];
+        break;
+      case ShaOptTreeIx:
+        treemode = 1;
+        break;
+      case ShaOptLeafsizeIx:
+        if (Tcl_GetWideIntFromObj (interp, objv[argidx], &leafsize) != TCL_OK ||
+            leafsize <= 0) {
+          Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp(buf, "-databin") == 0) {
-          ++argidx;
-          if (argidx < objc) {
-              msz = convert_to_binary(objv[argidx], &dbuf, &dataDynAlloc);
-              flags |= SHA_HAVEDATA;
-          }
-      } else if (strcmp(buf, "-datahex") == 0) {
-          ++argidx;
-          if (argidx < objc) {
-              int dhexlen = 0;
-              char* dhex = Tcl_GetStringFromObj(objv[argidx], &dhexlen);
-              msz = hexs2bin(dhex, &dbuf, &dataDynAlloc);
-              flags |= SHA_HAVEDATA;
-          }
-      } else if (strcmp(buf, "-key") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          key = Tcl_GetStringFromObj(objv[argidx], &klen);
-          havemac += 1;
+        break;
+      case ShaOptLeavesIx:
+        leavesVarObj = objv[argidx];
+        break;
+      case ShaOptAsyncIx:
+        async = 1;
+        break;
+      case ShaOptCallbackIx:
+        cbObj = objv[argidx];
+        break;
+      case ShaOptOffsetIx:
+        if (Tcl_GetWideIntFromObj (interp, objv[argidx], &offset) != TCL_OK ||
+            offset < 0) {
+          Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp(buf, "-keybin") == 0) {
-          ++argidx;
-          if (argidx < objc) {
-              klen = convert_to_binary(objv[argidx], &key, &keyDynAlloc);
-              havemac += 1;
-          }
-      } else if (strcmp(buf, "-keyhex") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          int khexlen = 0;
-          char* khex = Tcl_GetStringFromObj(objv[argidx], &khexlen);
-          klen = hexs2bin(khex, &key, &keyDynAlloc);
-          havemac += 1;
+        break;
+      case ShaOptSizeIx:
+        if (Tcl_GetWideIntFromObj (interp, objv[argidx], &size) != TCL_OK ||
+            size < 0) {
+          Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp (buf, "-keyfile") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          key = Tcl_GetStringFromObj (objv[argidx], &klen);
-          havemac += 1;
-          flags |= SHA_KEYISFILE;
+        break;
+      case ShaOptDataIx:
+        dbuf = Tcl_GetStringFromObj (objv[argidx], &len);
+        dataBinObj = NULL;
+        flags |= SHA_HAVEDATA;
+        msz = (size_t) len;
+        break;
+      case ShaOptDatabinIx:
+        dataBinObj = objv[argidx];
+        flags |= SHA_HAVEDATA;
+        break;
+      case ShaOptDatahexIx:
+        msz = hexs2bin (Tcl_GetString (objv[argidx]), &dbuf, &dataDynAlloc);
+        dataBinObj = NULL;
+        flags |= SHA_HAVEDATA;
+        break;
+      case ShaOptHmackeyIx:
+        hkeyObj = objv[argidx];
+        break;
+      case ShaOptVerifyIx:
+        verifyObj = objv[argidx];
+        break;
+      case ShaOptKeyIx:
+        key = Tcl_GetStringFromObj (objv[argidx], &klen);
+        keyBinObj = NULL;
+        havemac += 1;
+        break;
+      case ShaOptKeybinIx:
+        keyBinObj = objv[argidx];
+        havemac += 1;
+        break;
+      case ShaOptKeyhexIx:
+        klen = hexs2bin (Tcl_GetString (objv[argidx]), &key, &keyDynAlloc);
+        keyBinObj = NULL;
+        havemac += 1;
+        break;
+      case ShaOptKeyfileIx:
+        key = Tcl_GetStringFromObj (objv[argidx], &klen);
+        keyBinObj = NULL;
+        havemac += 1;
+        flags |= SHA_KEYISFILE;
+        break;
+      case ShaOptMacIx:
+        if (strcmp (Tcl_GetString (objv[argidx]), "hmac") != 0) {
+          Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp(buf, "-mac") == 0) {
-        ++argidx;
-        if (argidx < objc) {
-          buf = Tcl_GetStringFromObj(objv[argidx], &len);
-          if (strcmp(buf, "hmac") != 0) {
-            Tcl_WrongNumArgs(interp, 1, objv, usagestr);
-            rc = TCL_ERROR;
-            goto cleanupFinish;
-          }
-          havemac += 1;
+        havemac += 1;
+        break;
+      case ShaOptOutputIx:
+        if (Tcl_GetIndexFromObj (interp, objv[argidx], OutputFormats,
+            "format", 0, &outputFormatIdx) != TCL_OK) {
+          rc = TCL_ERROR;
+          goto cleanupFinish;
         }
-      } else if (strcmp(buf, "-output") == 0) {
-          ++argidx;
-          if (argidx < objc) {
-              int fmtIdx;
-              if (Tcl_GetIndexFromObj(interp, objv[argidx], OutputFormats, "format", 0, &outputFormatIdx) != TCL_OK) {
-                  return TCL_ERROR;
-              }
-          }
-
-      } else {
-        Tcl_WrongNumArgs (interp, 1, objv, usagestr);
-        rc = TCL_ERROR;
-        goto cleanupFinish;
+        break;
       }
     } else {
       /* backwards compatibility for sha 0.1 */
       if (argcount == 0) {
-        sz = Tcl_GetStringFromObj (objv[argidx], &szlen);
+        bitsObj = objv[argidx];
         flags |= SHA_HAVEBITS;
         ++argcount;
       } else if (argcount == 1) {
@@ -329,61 +3441,154 @@ shaObjCmd (
     rc = TCL_ERROR;
     goto cleanupFinish;
   }
-  if (! ((flags & SHA_HAVEBITS) == SHA_HAVEBITS &&
-      (((flags & SHA_HAVEFILE) == SHA_HAVEFILE &&
-        (flags & SHA_HAVEDATA) != SHA_HAVEDATA) ||
-       ((flags & SHA_HAVEFILE) != SHA_HAVEFILE &&
-        (flags & SHA_HAVEDATA) == SHA_HAVEDATA)))) {
+  nsrc = ((flags & SHA_HAVEFILE) == SHA_HAVEFILE) +
+      ((flags & SHA_HAVEDATA) == SHA_HAVEDATA) +
+      ((flags & SHA_HAVECHANNEL) == SHA_HAVECHANNEL) +
+      ((flags & SHA_HAVELIST) == SHA_HAVELIST) +
+      ((flags & SHA_HAVEFILES) == SHA_HAVEFILES);
+  if (((flags & SHA_HAVEBITS) == SHA_HAVEBITS) == (hkeyObj != NULL) ||
+      (hkeyObj != NULL && (havemac > 0 || outlenObj != NULL)) || nsrc != 1 ||
+      ((flags & SHA_HAVELIST) == SHA_HAVELIST &&
+      (havemac > 0 || hkeyObj != NULL))) {
+    Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if ((offset >= 0 || size >= 0) &&
+      (flags & SHA_HAVECHANNEL) != SHA_HAVECHANNEL) {
+    Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if ((errVarObj != NULL && (flags & SHA_HAVEFILES) != SHA_HAVEFILES) ||
+      (nthreads > 0 && (flags & SHA_HAVEFILES) != SHA_HAVEFILES &&
+      ! treemode)) {
+    Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if ((! treemode && (leafsize > 0 || leavesVarObj != NULL)) ||
+      (treemode && ((flags & SHA_HAVEFILE) != SHA_HAVEFILE ||
+      havemac > 0 || hkeyObj != NULL || async))) {
     Tcl_WrongNumArgs (interp, 1, objv, usagestr);
     rc = TCL_ERROR;
     goto cleanupFinish;
   }
 
-  if (havemac == 2) {
-    rc = hmac (sz, dbuf, (size_t) msz, key, (size_t) klen, fn, flags, dstr, &dlen);
-  } else {
-    rc = shahash (sz, dbuf, (size_t) msz, NULL, fn, flags, dstr, &dlen);
+  if (hkeyObj != NULL) {
+    if (shaHmacKeyFind (interp, hkeyObj, &hkey) != TCL_OK) {
+      rc = TCL_ERROR;
+      goto cleanupFinish;
+    }
+  } else if (shaGetAlgoFromObj (interp, bitsObj, &algo) != TCL_OK ||
+      shaGetOutlenAlgo (interp, algo, outlenObj, &algo) != TCL_OK) {
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if (havemac == 2 && algo->xof) {
+    Tcl_AppendResult (interp, "hmac is not defined for ", algo->name, NULL);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+  if (dataBinObj != NULL) {
+    msz = convert_to_binary (dataBinObj, &dbuf, &dataDynAlloc);
+  }
+  if (keyBinObj != NULL) {
+    klen = convert_to_binary (keyBinObj, &key, &keyDynAlloc);
   }
 
-  if (rc == 0) {
-      switch (outputFormatIdx) {
-      case OutputFormatBinaryIx: {
-          char *binaryOutput;
-          int dynAlloc;
-          int oLen = hexs2bin(dstr, &binaryOutput, &dynAlloc);
-          Tcl_UniChar* uniChars = ckalloc(oLen*sizeof(Tcl_UniChar));
-          Tcl_DString* dStr = ckalloc(sizeof(Tcl_DString));
-
-          Tcl_DStringInit(dStr);
-
-          for (int i = 0; i < oLen; i++) {
-              uniChars[i] = (Tcl_UniChar)binaryOutput[i];
-          }
-          Tcl_UniCharToUtfDString(uniChars, oLen, dStr);
-          Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(dStr), -1));
-          ckfree(binaryOutput);
-          Tcl_DStringFree(dStr);
-          ckfree(dStr);
-          ckfree(uniChars);
-          break;
-      }
-      case OutputFormatBase64Ix: {
-          char *binaryOutput, *base64Output;
-          int dynAlloc;
-          int oLen = hexs2bin(dstr, &binaryOutput, &dynAlloc);
+  if (treemode) {
+    rc = shaTreeHash (interp, algo, fn,
+        leafsize > 0 ? leafsize : 1024 * 1024, nthreads, leavesVarObj,
+        outputFormatIdx, verifyObj);
+    goto cleanupFinish;
+  }
 
-          base64Output = b64_encode(binaryOutput, oLen);
-          Tcl_SetObjResult(interp, Tcl_NewStringObj(base64Output, -1));
-          ckfree(binaryOutput);
-          ckfree(base64Output);
-          break;
-      }
-      case OutputFormatHexIx:
-      default:
-          Tcl_SetObjResult(interp, Tcl_NewStringObj(dstr, -1));
-      }
+  if (async != (cbObj != NULL) ||
+      (async && (flags & (SHA_HAVECHANNEL | SHA_HAVELIST)) != 0) ||
+      (verifyObj != NULL &&
+      (async || (flags & (SHA_HAVELIST | SHA_HAVEFILES)) != 0))) {
+    Tcl_WrongNumArgs (interp, 1, objv, usagestr);
+    rc = TCL_ERROR;
+    goto cleanupFinish;
+  }
+
+  if (async) {
+    shaCtxData    *cdata;
 
-    rc = TCL_OK;
+    if (hkey != NULL) {
+      rc = shaCtxClone (interp, hkey, &cdata);
+    } else {
+      rc = shaCtxMake (interp, algo, havemac == 2, key, klen,
+          (flags & SHA_KEYISFILE) == SHA_KEYISFILE, &cdata);
+    }
+    if (rc == TCL_OK) {
+      rc = shaAsyncStart (interp, cdata, cbObj, fn,
+          (flags & SHA_HAVEDATA) == SHA_HAVEDATA ? dbuf : NULL, msz,
+          filesObj, nthreads, errVarObj, outputFormatIdx);
+    }
+    goto cleanupFinish;
+  }
+
+  if ((flags & SHA_HAVEFILES) == SHA_HAVEFILES) {
+    shaCtxData    *cdata;
+
+    if (hkey != NULL) {
+      rc = shaCtxClone (interp, hkey, &cdata);
+    } else {
+      rc = shaCtxMake (interp, algo, havemac == 2, key, klen,
+          (flags & SHA_KEYISFILE) == SHA_KEYISFILE, &cdata);
+    }
+    if (rc == TCL_OK) {
+      rc = shaFilesHash (interp, cdata, filesObj, nthreads, errVarObj,
+          outputFormatIdx);
+      shaCtxDelete ((ClientData) cdata);
+    }
+    goto cleanupFinish;
+  }
+
+  if ((flags & SHA_HAVELIST) == SHA_HAVELIST) {
+    rc = shaListHash (interp, algo, listObj, outputFormatIdx);
+    goto cleanupFinish;
+  }
+
+  if ((flags & SHA_HAVECHANNEL) == SHA_HAVECHANNEL) {
+    shaCtxData    *cdata;
+
+    if (hkey != NULL) {
+      rc = shaCtxClone (interp, hkey, &cdata);
+    } else {
+      rc = shaCtxMake (interp, algo, havemac == 2, key, klen,
+          (flags & SHA_KEYISFILE) == SHA_KEYISFILE, &cdata);
+    }
+    if (rc == TCL_OK) {
+      rc = shaChanHash (interp, chanObj, offset, size, cdata,
+          outputFormatIdx, verifyObj);
+      shaCtxDelete ((ClientData) cdata);
+    }
+    goto cleanupFinish;
+  }
+
+  if (hkey != NULL) {
+    rc = shaHmacKeyHash (interp, hkey, fn, dbuf, msz, outputFormatIdx,
+        verifyObj);
+    goto cleanupFinish;
+  }
+
+  flags |= SHA_RETURN_RAW;
+  if (havemac == 0 && (flags & SHA_HAVEFILE) == SHA_HAVEFILE &&
+      shaCacheOn ()) {
+    rc = shaCacheHash (algo, fn, NULL, digest, &dlen);
+  } else if (havemac == 2) {
+    rc = hmacalgo (algo, dbuf, (size_t) msz, key, (size_t) klen,
+        fn, flags, (char *) digest, &dlen);
+  } else {
+    rc = shahashalgo (algo, dbuf, (size_t) msz, fn, flags,
+        (char *) digest, &dlen);
+  }
+
+  if (rc == 0) {
+    rc = shaDigestResult (interp, digest, dlen, outputFormatIdx, verifyObj);
   } else {
     rc = TCL_ERROR;
   }
@@ -398,6 +3603,8 @@ cleanupFinish:
   return rc;
 }
 
+TCL_DECLARE_MUTEX(shaInitMutex)
+static int shaInitDone = 0;
 
 DLLEXPORT int
 Sha_Init (Tcl_Interp *interp)
@@ -406,7 +3613,29 @@ Sha_Init (Tcl_Interp *interp)
     return TCL_ERROR;
   }
 
+  /* the backends are process wide; only the first load picks them */
+  Tcl_MutexLock (&shaInitMutex);
+  if (! shaInitDone) {
+    shabackend (NULL, NULL);
+    shambbackend (NULL, NULL);
+    shaInitDone = 1;
+  }
+  Tcl_MutexUnlock (&shaInitMutex);
+
   Tcl_CreateObjCommand (interp, "sha", shaObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::stack", shaStackObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::digest", shaChanDigestObjCmd,
+      NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::unstack", shaChanDigestObjCmd,
+      (ClientData) 1, NULL);
+  Tcl_CreateObjCommand (interp, "sha::cancel", shaCancelObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::hmackey", shaHmacKeyCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::cache", shaCacheObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::pbkdf2", shaPbkdf2ObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::hkdf", shaHkdfObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::backend", shaBackendObjCmd, NULL, NULL);
+  Tcl_CreateObjCommand (interp, "sha::backends", shaBackendsObjCmd,
+      NULL, NULL);
   Tcl_PkgProvide (interp, "sha", "2.1.1");
   return TCL_OK;
 }
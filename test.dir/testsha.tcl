@@ -26,11 +26,510 @@ proc runargtest { expected args } {
   }
 }
 
+# shake has no hmac
+proc hasmac { b } {
+  return [expr {! [string match shake* $b]}]
+}
+
+proc runctxtest { b } {
+  global verbose
+
+  set data [string repeat "streaming context test " 50]
+  set exp [sha -bits $b -data $data]
+  set h [sha create -bits $b]
+  foreach {sz} {1 7 64 128 200 1000} {
+    $h update [string range $data 0 $sz-1]
+    set data [string range $data $sz end]
+  }
+  $h update $data
+  set c [$h copy]
+  if { [$h digest] ne $exp || [$c digest] ne $exp } {
+    puts "ctx test fail: $b"
+  }
+  $c update x
+  if { [$h digest] ne $exp } {
+    puts "ctx copy test fail: $b"
+  }
+  $h reset
+  if { [$h digest] ne [sha -bits $b -data {}] } {
+    puts "ctx reset test fail: $b"
+  }
+  $h destroy
+  $c destroy
+
+  if { [hasmac $b] } {
+    set exp [sha -bits $b -key def456 -mac hmac -data abc123]
+    set h [sha create -bits $b -key def456 -mac hmac]
+    $h update abc
+    $h update 123
+    if { [$h digest] ne $exp } {
+      puts "ctx hmac test fail: $b"
+    }
+    $h destroy
+
+    set k [sha::hmackey -bits $b -key def456]
+    if { [sha -hmackey $k -data abc123] ne $exp ||
+        [sha -hmackey $k -data abc123] ne $exp ||
+        [dict get [sha -hmackey $k -files testsha.tcl] testsha.tcl] ne
+        [sha -bits $b -key def456 -mac hmac -file testsha.tcl] } {
+      puts "hmackey test fail: $b"
+    }
+    $k destroy
+  }
+
+  set exp [sha -bits $b -data abc123]
+  if { [binary encode hex [sha -bits $b -data abc123 -output binary]] ne $exp ||
+      [sha -bits $b -data abc123 -output base64] ne
+      [binary encode base64 [binary decode hex $exp]] } {
+    puts "output format test fail: $b"
+  }
+  if { ! [sha -bits $b -data abc123 -verify $exp] ||
+      [sha -bits $b -data abc124 -verify $exp] ||
+      ! [sha -bits $b -data abc123 -output base64 -verify \
+      [sha -bits $b -data abc123 -output base64]] ||
+      ! [sha -bits $b -data abc123 -output binary -verify \
+      [binary decode hex $exp]] } {
+    puts "verify test fail: $b"
+  }
+}
+
+proc runchantest { b } {
+  set exp [sha -bits $b -file testsha.tcl]
+  set ifh [open testsha.tcl rb]
+  set ofh [open testsha.bin wb]
+  sha::stack $ifh -bits $b
+  sha::stack $ofh -bits $b
+  fcopy $ifh $ofh
+  if { [sha::digest $ifh] ne $exp } {
+    puts "chan read test fail: $b"
+  }
+  if { [sha::unstack $ofh] ne $exp } {
+    puts "chan write test fail: $b"
+  }
+  sha::unstack $ifh
+  close $ifh
+  close $ofh
+  if { [sha -bits $b -file testsha.bin] ne $exp } {
+    puts "chan passthrough test fail: $b"
+  }
+  file delete -force testsha.bin
+
+  set fh [open testsha.tmp w]
+  puts $fh "after 500; fconfigure stdout -translation binary"
+  puts $fh "puts -nonewline \[string repeat x 5000\]"
+  close $fh
+  set xexp [sha -bits $b -data [string repeat x 5000]]
+  set ifh [open |[list [info nameofexecutable] testsha.tmp] rb]
+  sha::stack $ifh -bits $b
+  fconfigure $ifh -blocking 0
+  if { [read $ifh] ne "" || [eof $ifh] } {
+    puts "chan nonblocking test fail: $b read"
+  }
+  set ofh [open testsha.bin wb]
+  fcopy $ifh $ofh -command {set ::chandone}
+  vwait ::chandone
+  close $ofh
+  if { [sha::unstack $ifh] ne $xexp ||
+      [sha -bits $b -file testsha.bin] ne $xexp } {
+    puts "chan nonblocking test fail: $b fcopy"
+  }
+  close $ifh
+  file delete -force testsha.tmp
+  file delete -force testsha.bin
+
+  set fh [open testsha.tcl rb]
+  if { [sha -bits $b -channel $fh] ne $exp } {
+    puts "chan source test fail: $b"
+  }
+  seek $fh 0
+  set data [read $fh]
+  set exp [sha -bits $b -data [string range $data 100 1099]]
+  if { [sha -bits $b -channel $fh -offset 100 -size 1000] ne $exp } {
+    puts "chan range test fail: $b"
+  }
+  if { ! [catch {sha -bits $b -channel $fh -offset 100 \
+      -size [string length $data]} msg] ||
+      ! [string match "short read*" $msg] } {
+    puts "chan short read test fail: $b"
+  }
+  close $fh
+
+  set bin [binary format H* 00ff80fe7f]
+  set fh [open testsha.bin wb]
+  puts -nonewline $fh $bin
+  close $fh
+  set h [sha create -bits $b]
+  $h update -databin $bin
+  if { [sha -bits $b -databin $bin] ne [sha -bits $b -file testsha.bin] ||
+      [$h digest] ne [sha -bits $b -file testsha.bin] } {
+    puts "databin test fail: $b"
+  }
+  $h destroy
+  file delete -force testsha.bin
+}
+
+proc runlisttest { b } {
+  set msgs {}
+  for {set i 0} {$i < 40} {incr i} {
+    lappend msgs [string repeat "list$i " [expr {$i * 3}]]
+  }
+  set cur [sha::backend -multibuffer -bits $b]
+  foreach {be} [sha::backends -multibuffer -bits $b] {
+    sha::backend -multibuffer -bits $b $be
+    set res [sha -bits $b -list $msgs]
+    foreach {m} $msgs {d} $res {
+      if { $d ne [sha -bits $b -data $m] } {
+        puts "list test fail: $b $be"
+        break
+      }
+    }
+  }
+  sha::backend -multibuffer -bits $b $cur
+}
+
+proc runfilestest { b } {
+  set fns [list testsha.tcl ../README.txt ../sha.h ../sha.c]
+  set res [sha -bits $b -files [concat $fns nosuchfile] -threads 2 -errors errs]
+  foreach {fn} $fns {
+    if { ! [dict exists $res $fn] ||
+        [dict get $res $fn] ne [sha -bits $b -file $fn] } {
+      puts "files test fail: $b $fn"
+    }
+  }
+  if { [dict exists $res nosuchfile] ||
+      [lindex [dict get $errs nosuchfile] 0] ne "ENOENT" } {
+    puts "files test fail: $b nosuchfile"
+  }
+  if { ! [hasmac $b] } {
+    return
+  }
+  set res [sha -bits $b -key abc -mac hmac -files $fns]
+  foreach {fn} $fns {
+    if { [dict get $res $fn] ne
+        [sha -bits $b -key abc -mac hmac -file $fn] } {
+      puts "files test fail: $b hmac $fn"
+    }
+  }
+}
+
+proc runcachetest { b } {
+  sha::cache configure -size 2
+  sha::cache flush
+  set exp [sha -bits $b -file testsha.tcl]
+  if { [sha -bits $b -file testsha.tcl] ne $exp ||
+      [dict get [sha::cache stats] hits] != 1 ||
+      [dict get [sha -bits $b -files testsha.tcl] testsha.tcl] ne $exp ||
+      [dict get [sha::cache stats] hits] != 2 } {
+    puts "cache test fail: $b"
+  }
+  set fh [open testsha.bin wb]
+  puts -nonewline $fh abc
+  close $fh
+  sha -bits $b -file testsha.bin
+  set fh [open testsha.bin wb]
+  puts -nonewline $fh abcd
+  close $fh
+  if { [sha -bits $b -file testsha.bin] ne [sha -bits $b -data abcd] } {
+    puts "cache test fail: $b changed file"
+  }
+  sha -bits $b -file ../sha.h
+  if { [llength [sha::cache entries]] != 2 } {
+    puts "cache test fail: $b size"
+  }
+  sha::cache save testcache.txt
+  sha::cache flush
+  sha::cache load testcache.txt
+  if { [sha -bits $b -file ../sha.h] ne [sha -bits $b -data [readfile ../sha.h]] ||
+      [dict get [sha::cache stats] hits] != 1 } {
+    puts "cache test fail: $b load"
+  }
+  # -file loads whichever order -size is given in, and is kept absolute
+  sha::cache configure -size 0
+  sha::cache flush
+  set conf [sha::cache configure -file testcache.txt -size 2]
+  if { [llength [sha::cache entries]] != 2 ||
+      [file pathtype [dict get $conf -file]] ne "absolute" } {
+    puts "cache test fail: $b -file"
+  }
+  sha::cache configure -file {} -size 0
+  if { ! [catch {sha::cache configure -file testcache.txt}] ||
+      ! [catch {sha::cache load testcache.txt}] } {
+    puts "cache test fail: $b -file with -size 0"
+  }
+  file delete -force testsha.bin testcache.txt
+}
+
+proc readfile { fn } {
+  set fh [open $fn rb]
+  set data [read $fh]
+  close $fh
+  return $data
+}
+
+proc runtreetest { b } {
+  # tree layout version 1, "abc" x 1000, 1024 byte leaves
+  set expected [dict create \
+      256 e4adeea3837dc4146e39a072a97da5883edea0b19b188075d396a8d85c0a0ac7 \
+      224 bb59ee28e21da1a25aa1e197ff1aaa570812411a839bd0e10a6bfc46 \
+      512 55b84e56da795f1f9810ab45735c73cfedf1f807daf81da4314636c32d3c5142c4dade5709b93b7ee24a2d63453f2b76c4428a969f32631c9bb26270a6821e9a \
+      384 66f28e7622fa848db38abc4cde53b401f59e6eb51d6de036b1c9d1c8e2680af6f8fcadb9483e66891430062815d0c344 \
+      512/224 1888924504ba65ff6cc94a160f6c27bd3ba8a081a533c34b88a104dc \
+      512/256 0c2acaf2ded5a161499437dfd2229192338b8650763b6b960d7ed691d640e2ba \
+      1 c28682791ff3b6d83d90f9f778edf626f4932117 \
+      3-224 deed10035339b33cb53aab73b01e7f63bd95377acd931b29dc973ce6 \
+      3-256 3ee44f2e1337c780e942cd1b549114dbde93f1dc5eecc135220a2458f31dacc7 \
+      3-384 b0f45c42b45d80fdf74c52f518aaed702f6d3a52a4d64d9830b756c2f1b1f660e8760023a8194ef03bb46f043099834f \
+      3-512 58015274dcde1661f802315fdf974015e195b6f69b36cf1afac30568ba820b48e88ef8a440b6aefeffc226a601f010912925eb8a327da079dee29472570cdfa7 \
+      shake128 d8eb1d684f5ab9cae6162bb05bb054d6bffdb619e23049202dca4fe71f946eab \
+      shake256 3a7067836ce2a3bf3fa993916e608f415fb35c445a22c1fdad2f8b3526ee195309a1af4564b2733cea506d5383f8742591bf4792856a947ac80e34e23a592270]
+  set fn treetest.dat
+  set fh [open $fn w]
+  puts -nonewline $fh [string repeat abc 1000]
+  close $fh
+  foreach {n} {1 3} {
+    set res [sha -bits $b -tree -file $fn -leafsize 1024 -threads $n \
+        -leaves leaves]
+    if { $res ne [dict get $expected $b] || [llength $leaves] != 3 } {
+      puts "tree test fail: $b threads $n"
+    }
+  }
+
+  # 1G one byte leaves do not fit a leaf table; a sparse file is enough
+  set fh [open $fn w]
+  seek $fh [expr {1024 * 1024 * 1024}]
+  puts -nonewline $fh x
+  close $fh
+  if { ! [catch {sha -bits $b -tree -file $fn -leafsize 1} msg] ||
+      ! [string match "too many leaves*" $msg] } {
+    puts "tree test fail: $b leaf count"
+  }
+  file delete $fn
+}
+
+proc asyncdone { tag args } {
+  global asyncres
+  set asyncres($tag) $args
+}
+
+proc runasynctest { b } {
+  global asyncres
+  array unset asyncres
+  set fns [list testsha.tcl ../README.txt]
+  sha -async -callback {asyncdone file} -bits $b -file testsha.tcl
+  sha -async -callback {asyncdone data} -bits $b -data abc
+  set n 5
+  if { [hasmac $b] } {
+    sha -async -callback {asyncdone mac} -bits $b -key abc -mac hmac -data abc
+    incr n
+  }
+  sha -async -callback {asyncdone files} -bits $b -files $fns
+  sha -async -callback {asyncdone nofile} -bits $b -file nosuchfile
+  set h [sha -async -callback {asyncdone cancel} -bits $b -file testsha.tcl]
+  sha::cancel $h
+  while { [array size asyncres] < $n } {
+    vwait asyncres
+  }
+  if { [lrange $asyncres(file) 1 end] ne
+      [list ok [sha -bits $b -file testsha.tcl]] } {
+    puts "async test fail: $b file"
+  }
+  if { [lrange $asyncres(data) 1 end] ne [list ok [sha -bits $b -data abc]] } {
+    puts "async test fail: $b data"
+  }
+  if { [hasmac $b] && [lrange $asyncres(mac) 1 end] ne
+      [list ok [sha -bits $b -key abc -mac hmac -data abc]] } {
+    puts "async test fail: $b hmac"
+  }
+  if { [lindex $asyncres(files) 1] ne "ok" ||
+      [lindex $asyncres(files) 2] ne [sha -bits $b -files $fns] } {
+    puts "async test fail: $b files"
+  }
+  if { [lindex $asyncres(nofile) 1] ne "error" } {
+    puts "async test fail: $b nofile"
+  }
+  if { [lindex $asyncres(cancel) 0] ne $h ||
+      [lindex $asyncres(cancel) 1] ne "cancelled" ||
+      [sha::cancel $h] != 0 } {
+    puts "async test fail: $b cancel"
+  }
+}
+
+# FIPS 202 examples; the shake lengths are the defaults (256, 512 bits)
+proc runkattest { b } {
+  set kats [dict create \
+      3-224 {"" 6b4e03423667dbb73b6e15454f0eb1abd4597f9a1b078e3f5b5a6bc7
+          abc e642824c3f8cf24ad09234ee7d3c766fc9a3a5168d0c94ad73b46fdf} \
+      3-256 {"" a7ffc6f8bf1ed76651c14756a061d662f580ff4de43b49fa82d80a4b80f8434a
+          abc 3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532} \
+      3-384 {"" 0c63a75b845e4f7d01107d852e4c2485c51a50aaaa94fc61995e71bbee983a2ac3713831264adb47fb6bd1e058d5f004
+          abc ec01498288516fc926459f58e2c6ad8df9b473cb0fc08c2596da7cf0e49be4b298d88cea927ac7f539f1edf228376d25} \
+      3-512 {"" a69f73cca23a9ac5c8b567dc185a756e97c982164fe25859e0d1dcc1475c80a615b2123af1f5f94c11e3e9402c3ac558f500199d95b6d3e301758586281dcd26
+          abc b751850b1a57168a5693cd924b6b096e08f621827444f70d884f5d0240d2712e10e116e9192af3c91a7ec57647e3934057340b4cf408d5a56592f8274eec53f0} \
+      shake128 {"" 7f9c2ba4e88f827d616045507605853ed73b8093f6efbc88eb1a6eacfa66ef26
+          abc 5881092dd818bf5cf8a3ddb793fbcba74097d5c526a6d35f97b83351940f2cc8} \
+      shake256 {"" 46b9dd2b0ba88d13233b3feb743eeb243fcd52ea62b81b82b50c27646ed5762fd75dc4ddd8c0f200cb05019d67b592f6fc821c49479ab48640292eacb3b7c4be
+          abc 483366601360a8771c6863080cc4114d8db44530f8f1e1ee4f94ea37e78b5739d5a15bef186a5386c75744c0527e1faa9f8726e462a12a4feb06bd8801e751e4}]
+  if { ! [dict exists $kats $b] } {
+    return
+  }
+  puts "=== $b KAT"
+  foreach {msg md} [dict get $kats $b] {
+    if { [sha -bits $b -data $msg] ne $md } {
+      puts "kat test fail: $b \"$msg\""
+    }
+  }
+  if { $b eq "3-256" &&
+      [sha -bits $b -key key -mac hmac -data abc] ne
+      "09b6dbab8d11795ca7c8d82f1cf91682013c7cb980abbb25473be4ae7f7b5683" } {
+    puts "kat test fail: $b hmac"
+  }
+  if { [string match shake* $b] } {
+    # a longer output starts with the shorter one, past the rate too
+    set md [dict get $kats $b abc]
+    set long [sha -bits $b -data abc -outlen 400]
+    set h [sha create -bits $b -outlen 400]
+    $h update ab
+    $h update c
+    if { [string length $long] != 800 ||
+        [string range $long 0 9] ne [sha -bits $b -data abc -outlen 5] ||
+        [string range $long 0 [string length $md]-1] ne $md ||
+        [$h digest] ne $long ||
+        [sha -bits $b -data abc -outlen 400 -output binary] ne
+        [binary decode hex $long] } {
+      puts "kat test fail: $b -outlen"
+    }
+    $h destroy
+
+    # the cache keeps the length with the name
+    sha::cache configure -size 10
+    sha::cache flush
+    set exp [sha -bits $b -outlen 100 -file testsha.tcl]
+    sha::cache save testcache.txt
+    sha::cache flush
+    sha::cache load testcache.txt
+    if { [llength [sha::cache entries]] != 1 ||
+        [sha -bits $b -outlen 100 -file testsha.tcl] ne $exp ||
+        [sha -bits $b -file testsha.tcl] eq $exp ||
+        [dict get [sha::cache stats] hits] != 1 } {
+      puts "kat test fail: $b -outlen cache"
+    }
+    sha::cache configure -size 0
+    file delete -force testcache.txt
+  }
+}
+
+# pbkdf2 from the hmac command, for comparison
+proc pbkdf2ref { b pw salt iter len } {
+  set res {}
+  for {set i 1} {[string length $res] < $len} {incr i} {
+    set u [sha -bits $b -key $pw -mac hmac -output binary \
+        -databin $salt[binary format I $i]]
+    binary scan $u cu* t
+    for {set j 1} {$j < $iter} {incr j} {
+      set u [sha -bits $b -key $pw -mac hmac -output binary -databin $u]
+      set k 0
+      foreach {c} [binary scan $u cu* us; set us] {
+        lset t $k [expr {[lindex $t $k] ^ $c}]
+        incr k
+      }
+    }
+    append res [binary format cu* $t]
+  }
+  return [binary encode hex [string range $res 0 $len-1]]
+}
+
+proc runpbkdf2test { b } {
+  # RFC 6070 (sha-1), RFC 7914 (sha-256), and sha-512
+  set kats [dict create \
+      1 {password salt 4096 20 4b007901b765489abead49d926f721d065a429c1} \
+      256 {passwd salt 1 64 55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783} \
+      512 {password salt 4096 64 d197b1b33db0143e018b12f3d1d1479e6cdebdcc97c5c0f87f6902e072f457b5143f30602641b3d55cd335988cb36b84376060ecd532e039b742a239434af2d5}]
+  if { [dict exists $kats $b] } {
+    lassign [dict get $kats $b] pw salt iter len exp
+    if { [sha::pbkdf2 -bits $b -password $pw -salt $salt \
+        -iterations $iter -length $len] ne $exp } {
+      puts "pbkdf2 test fail: $b kat"
+    }
+  }
+  if { ! [hasmac $b] } {
+    return
+  }
+  set exp [pbkdf2ref $b pw\u00e9 [binary format H* 00ff73616c74] 5 150]
+  foreach {n} {1 4} {
+    if { [sha::pbkdf2 -bits $b -password pw\u00e9 \
+        -saltbin [binary format H* 00ff73616c74] -iterations 5 \
+        -length 150 -threads $n] ne $exp } {
+      puts "pbkdf2 test fail: $b threads $n"
+    }
+  }
+  if { [sha::pbkdf2 -bits $b -passwordbin abc -salt s -iterations 2 \
+      -length 7 -output binary] ne
+      [binary decode hex [pbkdf2ref $b abc s 2 7]] } {
+    puts "pbkdf2 test fail: $b binary"
+  }
+  # longer than the largest digest
+  set exp [pbkdf2ref $b abc s 1 600]
+  if { [sha::pbkdf2 -bits $b -password abc -salt s -iterations 1 \
+      -length 600 -threads 2] ne $exp ||
+      [sha::pbkdf2 -bits $b -password abc -salt s -iterations 1 \
+      -length 600 -output base64] ne
+      [binary encode base64 [binary decode hex $exp]] } {
+    puts "pbkdf2 test fail: $b long"
+  }
+}
+
+proc runhkdftest { b } {
+  # RFC 5869 test cases 1 (sha-256) and 4 (sha-1)
+  set kats [dict create \
+      256 {0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b 077709362c2e32df0ddc3f0dc47bba6390b6c73bb50f9c3122ec844ad7c2b3e5 3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf34007208d5b887185865} \
+      1 {0b0b0b0b0b0b0b0b0b0b0b 9b6c18c432a7bf8f0e71c8eb88f4b30baa2ba243 085a01ea1b10f36933068b56efa5ad81a4f14b822f5b091568a9cdd4f155fda2c22e422478d305f3f896}]
+  if { [dict exists $kats $b] } {
+    lassign [dict get $kats $b] ikm prk okm
+    set salt [binary decode hex 000102030405060708090a0b0c]
+    set info [binary decode hex f0f1f2f3f4f5f6f7f8f9]
+    set ikm [binary decode hex $ikm]
+    if { [binary encode hex [sha::hkdf extract -bits $b -saltbin $salt \
+        -ikmbin $ikm]] ne $prk ||
+        [binary encode hex [sha::hkdf expand -bits $b \
+        -prk [binary decode hex $prk] -infobin $info -length 42]] ne $okm ||
+        [binary encode hex [sha::hkdf derive -bits $b -saltbin $salt \
+        -ikmbin $ikm -infobin $info -length 42]] ne $okm } {
+      puts "hkdf test fail: $b kat"
+    }
+  }
+  if { ! [hasmac $b] } {
+    return
+  }
+  # T(i) = hmac(prk, T(i-1) || info || i), from the hmac command
+  set prk [sha::hkdf extract -bits $b -ikm secret]
+  if { $prk ne [sha -bits $b -key {} -mac hmac -data secret -output binary] } {
+    puts "hkdf test fail: $b extract"
+  }
+  set okm {}
+  set t {}
+  for {set i 1} {[string length $okm] < 100} {incr i} {
+    set t [sha -bits $b -keybin $prk -mac hmac -output binary \
+        -databin $t[encoding convertto utf-8 ctx\u00e9][binary format c $i]]
+    append okm $t
+  }
+  if { [sha::hkdf expand -bits $b -prk $prk -info ctx\u00e9 -length 100] ne
+      [string range $okm 0 99] ||
+      [sha::hkdf derive -bits $b -ikm secret -info ctx\u00e9 -length 100] ne
+      [string range $okm 0 99] } {
+    puts "hkdf test fail: $b expand"
+  }
+}
+
 proc runtest { b } {
   global verbose
 
-  foreach {fn} [list SHA${b}ShortMsg.rsp SHA${b}LongMsg.rsp] {
-    regsub / $fn _ fn
+  # 512/224 is in SHA512_224ShortMsg.rsp, 3-256 in SHA3_256ShortMsg.rsp
+  # and shake128 in SHAKE128ShortMsg.rsp
+  set pfx SHA[string map {/ _ - _} $b]
+  if { [string match shake* $b] } {
+    set pfx [string toupper $b]
+  }
+  foreach {fn} [list ${pfx}ShortMsg.rsp ${pfx}LongMsg.rsp] {
     puts "=== $fn"
     set fh [open $fn r]
     set have 0
@@ -47,7 +546,7 @@ proc runtest { b } {
       if { [regexp {^Msg = (\w+)} $line all tmsg] } {
         incr have
       }
-      if { [regexp {^MD = (\w+)} $line all md] } {
+      if { [regexp {^(?:MD|Output) = (\w+)} $line all md] } {
         incr have
         if { $have != 3 } {
           set have 0
@@ -66,7 +565,12 @@ proc runtest { b } {
           puts "-- test: $count"
         }
         regsub _ $b / b
-        set nmd [sha -bits ${b} -file testsha.bin]
+        if { [string match shake* $b] } {
+          set nmd [sha -bits ${b} -outlen [expr {[string length $md] / 2}] \
+              -file testsha.bin]
+        } else {
+          set nmd [sha -bits ${b} -file testsha.bin]
+        }
         if { $nmd ne $md } {
           incr fail
           if { $verbose } {
@@ -97,6 +601,9 @@ proc runtest { b } {
   }
 
   foreach {fn} [list HMAC.rsp] {
+    if { ! [hasmac $b] } {
+      continue
+    }
     set fh [open $fn r]
     set have 0
     set count 0
@@ -110,6 +617,9 @@ proc runtest { b } {
       if { [regexp {^\[L=(\d+)\]$} $line all len] } {
         set havelen 0
         set have 0
+        if { $len == 20 && $b eq "1" } {
+          incr havelen
+        }
         if { $len == 28 && $b eq "224" } {
           incr havelen
         }
@@ -172,6 +682,12 @@ proc runtest { b } {
           puts "res: $res"
           set nmac {}
         }
+        set hkey [sha::hmackey -bits ${b} -keyfile testkey.bin]
+        if { [sha -hmackey $hkey -file testsha.bin] ne $nmac ||
+            [sha -hmackey $hkey -databin $msg] ne $nmac } {
+          puts "hmackey test fail: $b $count"
+        }
+        $hkey destroy
         if { [string compare -length $testlen $nmac $mac] != 0 } {
           incr fail
           if { $verbose } {
@@ -221,17 +737,26 @@ proc main { } {
       set testb 256
     } elseif { $arg eq "512" } {
       set testb 512
+    } elseif { $arg eq "1" } {
+      set testb 1
+    } elseif { $arg eq "3" } {
+      set testb 3-256
     }
   }
 
+  load [file join .. sha[info sharedlibextension]]
   if { $testb == 256 } {
-    load [file join .. sha256[info sharedlibextension]]
     set tlist [list 256 224]
   }
   if { $testb == 512 } {
-    load [file join .. sha[info sharedlibextension]]
     set tlist [list 512 384 512/224 512/256]
   }
+  if { $testb == 1 } {
+    set tlist [list 1]
+  }
+  if { $testb eq "3-256" } {
+    set tlist [list 3-224 3-256 3-384 3-512 shake128 shake256]
+  }
 
   # backwards compatibility
   runargtest ok sha $testb -file testsha.tcl ; # old file style
@@ -248,12 +773,88 @@ proc main { } {
   runargtest fail sha -bits $testb testsha.tcl ; # incorrect usage, too few
   runargtest fail sha -bits $testb -file testsha.tcl testsha.tcl ; # too many
 
+  runargtest fail sha -bits $testb -data abc -size 10 ; # -size needs -channel
+  runargtest fail sha -bits $testb -channel nosuchchan ; # no channel
+  runargtest ok sha -bits $testb -list {a b c} ; # correct
+  runargtest fail sha -bits $testb -list {a b} -data a ; # two sources
+  runargtest fail sha -bits $testb -key k -mac hmac -list {a b} ; # no hmac
+  runargtest ok sha -bits $testb -files {testsha.tcl} ; # correct
+  runargtest ok sha -bits $testb -files {} -threads 4 ; # correct
+  runargtest fail sha -bits $testb -files {a} -file a ; # two sources
+  runargtest fail sha -bits $testb -file a -threads 2 ; # -threads needs -files
+  runargtest fail sha -bits $testb -files {a} -threads x ; # bad count
+  runargtest fail sha -async -bits $testb -data a ; # no -callback
+  runargtest fail sha -callback list -bits $testb -data a ; # no -async
+  runargtest fail sha -async -callback list -bits $testb -list {a} ; # no -list
+  runargtest ok sha -bits $testb -tree -file testsha.tcl ; # correct
+  runargtest fail sha -bits $testb -tree -data abc ; # -tree needs -file
+  runargtest fail sha -bits $testb -file testsha.tcl -leafsize 10 ; # no -tree
+  runargtest fail sha -bits $testb -tree -file testsha.tcl -leafsize 0 ; # bad size
+  runargtest ok sha -bits 256 -data abc ; # both families are loaded
+  runargtest ok sha -bits 512 -data abc ; # both families are loaded
+  runargtest fail sha -bits 123 -data abc ; # bad bits
+  runargtest ok sha -algo sha1 -data abc ; # algorithm name
+  runargtest ok sha -algo 256 -data abc ; # same as -bits
+  runargtest fail sha -algo md5 -data abc ; # bad name
+  runargtest ok sha -algo sha3-256 -data abc ; # sha-3
+  runargtest ok sha -bits shake128 -outlen 100 -data abc ; # correct
+  runargtest ok sha create -bits shake256 -outlen 100 ; # correct
+  runargtest fail sha -bits 256 -outlen 100 -data abc ; # not shake
+  runargtest fail sha -bits shake128 -outlen 0 -data abc ; # bad length
+  runargtest fail sha -bits shake128 -outlen 513 -data abc ; # too long
+  runargtest fail sha -bits shake128 -key k -mac hmac -data abc ; # no hmac
+  runargtest fail sha::hmackey -bits shake256 -key k ; # no hmac
+  runargtest ok sha::pbkdf2 -bits $testb -password p -salt s -iterations 1 -length 10 ; # correct
+  runargtest fail sha::pbkdf2 -bits $testb -password p -salt s -length 10 ; # no -iterations
+  runargtest fail sha::pbkdf2 -bits $testb -password p -salt s -iterations 0 -length 10 ; # bad count
+  runargtest fail sha::pbkdf2 -bits $testb -password p -iterations 1 -length 10 ; # no -salt
+  runargtest ok sha::pbkdf2 -bits $testb -password p -salt s -iterations 1 -length 513 ; # longer than a digest
+  runargtest fail sha::pbkdf2 -bits $testb -password p -salt s -iterations 1 -length 1099511627776 ; # too long
+  runargtest fail sha::pbkdf2 -bits shake128 -password p -salt s -iterations 1 -length 10 ; # no hmac
+  runargtest ok sha::hkdf derive -bits $testb -ikm k -length 10 ; # correct
+  runargtest ok sha::hkdf extract -bits $testb -salt s -ikm k ; # correct
+  runargtest ok sha::hkdf expand -bits $testb -prk k -info i -length 10 ; # correct
+  runargtest fail sha::hkdf extract -bits $testb -ikm k -length 10 ; # no -length
+  runargtest fail sha::hkdf expand -bits $testb -prk k ; # no -length
+  runargtest fail sha::hkdf expand -bits $testb -ikm k -length 10 ; # -prk
+  runargtest fail sha::hkdf derive -bits $testb -prk k -length 10 ; # -ikm
+  runargtest fail sha::hkdf derive -bits 256 -ikm k -length 8161 ; # too long
+  runargtest fail sha::hkdf derive -bits shake256 -ikm k -length 10 ; # no hmac
+  runargtest fail sha::hkdf split -bits $testb ; # bad subcommand
+  runargtest fail sha -bits $testb -dat abc ; # no abbreviations
+  runargtest fail sha -bits $testb -data abc -output xyz ; # bad format
+  runargtest fail sha -bits $testb -data abc -verify xyz ; # bad digest
+  runargtest fail sha -bits $testb -list {a} -verify 00 ; # no -list
+  runargtest fail sha::cache configure -size x ; # bad size
+  runargtest fail sha::cache load nosuchfile ; # no file
+  runargtest fail sha::backend -bits 123 ; # bad bits
+  runargtest ok sha create -bits $testb ; # correct
+  runargtest fail sha create -bits 123 ; # bad bits
+  runargtest fail sha create -bits $testb -key abc ; # no -mac
+  runargtest fail sha::hmackey -bits $testb ; # no key
+  runargtest fail sha::hmackey -bits $testb -key abc -mac hmac ; # -mac implied
+  runargtest fail sha -hmackey nosuchkey -data abc ; # no such key
+
   if { $verbose } {
     puts ""
   }
 
   foreach {b} $tlist {
-    runtest $b
+    runctxtest $b
+    runchantest $b
+    runlisttest $b
+    runfilestest $b
+    runcachetest $b
+    runasynctest $b
+    runtreetest $b
+    runkattest $b
+    runpbkdf2test $b
+    runhkdftest $b
+    foreach {be} [sha::backends -bits $b] {
+      sha::backend -bits $b $be
+      puts "--- backend $be"
+      runtest $b
+    }
   }
 }
 ::main
@@ -18,25 +18,18 @@
 int
 main (int argc, char *argv[]) {
   char      *buf = argv[2];
-  char      ret [SHA_CHARSINHASH*2+1];
+  char      ret [SHA_DIGESTSIZE];
   char      *sz;
   size_t    msz;
   int       flags;
   size_t    rlen;
 
-  if (argc < 3) {
-    fprintf (stderr, "usage: %s {512|512/256|512/224|384} {-file <file>|<data>}\n", argv[0]);
-    exit (1);
-  }
-
-  if ( strcmp (argv[1], "512") != 0 &&
-      strcmp (argv[1], "512/256") != 0 &&
-      strcmp (argv[1], "512/224") != 0 &&
-      strcmp (argv[1], "384") != 0 ) {
-    fprintf (stderr, "usage: %s {512|512/256|512/224|384} {-file <file>|<data>}\n", argv[0]);
+  if (argc < 3 || shaalgo (argv[1]) == NULL) {
+    fprintf (stderr, "usage: %s {512|512/256|512/224|384|256|224|1|3-224|3-256|3-384|3-512|shake128|shake256} {-file <file>|<data>}\n", argv[0]);
     exit (1);
   }
 
+  shabackend (NULL, NULL);
   sz = argv[1];
   flags = 0;
   flags |= SHA_HAVEBITS;
@@ -44,10 +37,10 @@ main (int argc, char *argv[]) {
     msz = 1024 * 1024 * 5;
     buf = NULL;
     flags |= SHA_HAVEFILE;
-    shahash (sz, buf, msz, NULL, argv[3], flags, ret, &rlen);
+    shahash (sz, buf, msz, argv[3], flags, ret, &rlen);
   } else {
     flags |= SHA_HAVEDATA;
-    shahash (sz, buf, strlen (buf), NULL, NULL, flags, ret, &rlen);
+    shahash (sz, buf, strlen (buf), NULL, flags, ret, &rlen);
   }
   printf ("%s\n", ret);
 }